@@ -51,6 +51,9 @@
 #define	RPC_MAXDATASIZE 9000
 #define	RPC_MAXADDRSIZE 1024
 
+/* decoded credentials, after the raw cred and verf (svc_getreq_xprt) */
+#define	RQCRED_SIZE	400	/* this size is excessive */
+
 #define __RPC_GETXID(now) ((u_int32_t)getpid() ^ (u_int32_t)(now)->tv_sec ^ \
     (u_int32_t)(now)->tv_usec)
 
@@ -81,13 +84,191 @@ bool_t __rpc_control(int,void *);
 char *_get_next_token(char *, int);
 
 bool_t __svc_clean_idle(fd_set *, int, bool_t);
+bool_t __svc_clean_idle2(int, bool_t);
+struct epoll_event;
+void svc_getreqset_epoll(struct epoll_event *, int);
+
+/*
+ * SVC_CONTROL(xprt, SVCSEND_DETACHED, struct svc_detached_reply *):
+ * send a reply to a detached request (svc_req_detach), without the
+ * transport's per-request state, which by now belongs to later ones.
+ */
+struct svc_detached_reply {
+	struct rpc_msg *msg;		/* rm_xid set */
+	SVCAUTH *auth;			/* wraps results */
+	struct netbuf *addr;		/* client (datagram transports) */
+};
+
+/*
+ * SVC_CONTROL(xprt, SVCTAKE_RECORD, struct svc_record *):  the next
+ * complete record of a nonblocking connection, if any, at the start
+ * of a buffer from __xdr_bufpool_get which the caller gives back.
+ * FALSE when there is none (see SVC_STAT).
+ *
+ * SVC_CONTROL(xprt, SVCTAKE_RECBUF, struct svc_record *):  the buffer
+ * holding the record being served, with whatever xdr_bytes_ref
+ * decoded from it;  the transport goes on without it.  FALSE if the
+ * transport cannot give it up.
+ *
+ * SVC_CONTROL(xprt, SVCDONE_RECORD, NULL):  the calls read so far are
+ * done with;  a transport keeping no buffer between calls (one with
+ * SVC_XPORT_FLAG_RECPOOL) drops them.  Only by the thread serving
+ * xprt, which SVC_STAT leaves alone.
+ */
+struct svc_record {
+	char *buf;
+	u_int len;			/* of the record */
+	u_int size;			/* of buf */
+};
+
+/*
+ * Work for an event thread (__svc_work_post).  The node belongs to
+ * the poster until fn is called.
+ */
+struct svc_work {
+	struct svc_work *next;
+	void (*fn)(void *);
+	void *arg;
+};
+
+/*
+ * An epoll set and the event thread(s) which service it
+ */
+struct svc_epoll_shard {
+	int epoll_fd;			/* or io_uring fd, SVC_EVENT_URING */
+	u_int id;
+	int wake_fd;			/* eventfd in epoll_fd, data.ptr NULL */
+	struct svc_work *volatile work;	/* posted, newest first */
+	struct svc_uring *uring;
+};
+
+/* the epoll engine, either way (svc_uring.c) */
+#define	__svc_ev_epoll(p) \
+	((p)->ev_type == SVC_EVENT_EPOLL || (p)->ev_type == SVC_EVENT_URING)
+
+void __svc_shard_enter(struct svc_epoll_shard *);
+struct svc_epoll_shard *__svc_shard_self(void);
+int __svc_shard_clone_fd(int);
+void __svc_shard_wake(struct svc_epoll_shard *);
+void __svc_work_post(int, struct svc_work *);
+
+/* replies queued on a connection:  stop reading requests over HIGH,
+ * until down to LOW (svc_vc.c, svc_uring.c) */
+#define	SVC_OUTQ_HIGH	(256 * 1024)
+#define	SVC_OUTQ_LOW	(64 * 1024)
+
+/* svc_uring.c */
+#if defined(TIRPC_EPOLL)
+struct epoll_event;
+struct iovec;
+struct sockaddr;
+struct svc_uring_io;
+bool_t __svc_uring_init(struct svc_epoll_shard *);
+void __svc_uring_arm(SVCXPRT *);
+void __svc_uring_disarm(SVCXPRT *);
+void __svc_uring_arm_wake(struct svc_epoll_shard *);
+int __svc_uring_wait(struct svc_epoll_shard *, struct epoll_event *, int, int);
+struct svc_uring_io *__svc_uring_attach(SVCXPRT *, bool_t);
+void __svc_uring_detach(struct svc_uring_io *);
+ssize_t __svc_uring_read(struct svc_uring_io *, void *, size_t);
+int __svc_uring_accept(struct svc_uring_io *, struct sockaddr *, socklen_t *,
+    int);
+int __svc_uring_send(struct svc_uring_io *, struct iovec *, int);
+bool_t __svc_uring_failed(struct svc_uring_io *);
+/* svc_vc.c:  the ring I/O of a transport with SVC_XPORT_FLAG_URING */
+struct svc_uring_io *__svc_vc_uring(SVCXPRT *);
+#endif
+
+/* svc_trace.c */
+extern volatile int __svc_trace_on;
+void __svc_trace_begin(SVCXPRT *);
+void __svc_trace_call(struct rpc_msg *);
+void __svc_trace_mark(u_int);
+void __svc_trace_mark_xid(u_int, u_int32_t);
+void __svc_trace_end(void);
+
+#define	__SVC_TRACE(phase) \
+	do { if (__svc_trace_on) __svc_trace_mark(phase); } while (0)
+#define	__SVC_TRACE_XID(phase, xid) \
+	do { if (__svc_trace_on) __svc_trace_mark_xid((phase), (xid)); } \
+	while (0)
+
+/* svc_epoch.c */
+struct svc_epoch_rec;
+struct svc_epoch_rec *__svc_epoch_register(void);
+void __svc_epoch_unregister(struct svc_epoch_rec *);
+struct svc_epoch_rec *__svc_epoch_self(void);
+void __svc_epoch_enter(struct svc_epoch_rec *);
+void __svc_epoch_exit(struct svc_epoch_rec *);
+void __svc_epoch_free(void *, size_t);
+void __svc_epoch_reclaim(void);
+
+/* svc_pool.c */
+bool_t __svc_pool_getreq(SVCXPRT *);
+void __svc_pool_start(void);
+void __svc_pool_stop(void);
+void __svc_sched_stats(struct svc_sched_stat *);
+
+/* xdr_bufpool.c */
+char *__xdr_bufpool_get(u_int, u_int *);
+void __xdr_bufpool_put(char *, u_int);
+void __xdr_bufpool_stats(struct svc_bufpool_stats *);
+
 bool_t __xdrrec_setnonblock(XDR *, int);
+bool_t __xdrrec_getout(XDR *);
 bool_t __xdrrec_getrec(XDR *, enum xprt_stat *, bool_t);
+bool_t __xdrrec_buffered(XDR *);
+void __xdrrec_freerec(XDR *);
+char *__xdrrec_getbytes_kept(XDR *, u_int);
+bool_t __xdrrec_takerec(XDR *, char **, u_int *, u_int *);
+struct iovec;
+void __xdrrec_setwritev(XDR *, int (*)(void *, struct iovec *, int));
+bool_t __xdrrec_setgather(XDR *, bool_t);
 void __xprt_unregister_unlocked(SVCXPRT *);
+void __xprt_register_shard(SVCXPRT *, int);
+bool_t __svc_xprt_ref(SVCXPRT *);
+void __svc_xprt_unref(SVCXPRT *);
+void __svc_xprt_setflags(SVCXPRT *, u_int, u_int);
+void __svc_xprt_destroy(SVCXPRT *, bool_t);
+void svc_getreq_xprt(SVCXPRT *);
+void __svc_inflight_get(SVCXPRT *);
+void __svc_inflight_put(SVCXPRT *);
+bool_t __svc_inflight_full(SVCXPRT *);
+void __svc_dispatch(SVCXPRT *, struct rpc_msg *, struct svc_req *);
 void __xprt_set_raddr(SVCXPRT *, const struct sockaddr_storage *);
+int __svc_xprt_limit(void);
+
+/*
+ * The built-in transports' ops.  The library's own hot paths call
+ * them through these macros:  a compare with the ops table's entry,
+ * then a direct call, rather than an indirect one.  Anything else,
+ * including an xp_recv replaced with SVCSET_XP_RECV, takes the
+ * pointer as before.
+ */
+bool_t __svc_vc_recv(SVCXPRT *, struct rpc_msg *);
+enum xprt_stat __svc_vc_stat(SVCXPRT *);
+bool_t __svc_vc_getargs(SVCXPRT *, xdrproc_t, void *);
+bool_t __svc_vc_reply(SVCXPRT *, struct rpc_msg *);
+bool_t __svc_vc_freeargs(SVCXPRT *, xdrproc_t, void *);
+bool_t __svc_dg_recv(SVCXPRT *, struct rpc_msg *);
+enum xprt_stat __svc_dg_stat(SVCXPRT *);
+bool_t __svc_dg_getargs(SVCXPRT *, xdrproc_t, void *);
+bool_t __svc_dg_reply(SVCXPRT *, struct rpc_msg *);
+bool_t __svc_dg_freeargs(SVCXPRT *, xdrproc_t, void *);
+
+#define	__SVC_OP(xprt, op, args)					\
+	(((xprt)->xp_ops->xp_##op == __svc_vc_##op) ? __svc_vc_##op args : \
+	 ((xprt)->xp_ops->xp_##op == __svc_dg_##op) ? __svc_dg_##op args : \
+	 (*(xprt)->xp_ops->xp_##op) args)
+#define	__SVC_RECV(xprt, msg)	__SVC_OP(xprt, recv, ((xprt), (msg)))
+#define	__SVC_STAT(xprt)	__SVC_OP(xprt, stat, ((xprt)))
+#define	__SVC_GETARGS(xprt, xargs, argsp) \
+	__SVC_OP(xprt, getargs, ((xprt), (xargs), (argsp)))
+#define	__SVC_REPLY(xprt, msg)	__SVC_OP(xprt, reply, ((xprt), (msg)))
+#define	__SVC_FREEARGS(xprt, xargs, argsp) \
+	__SVC_OP(xprt, freeargs, ((xprt), (xargs), (argsp)))
 
 
-SVCXPRT **__svc_xports;
 int __svc_maxrec;
 
 __END_DECLS
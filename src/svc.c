@@ -44,12 +44,16 @@
 #include <sys/poll.h>
 #if defined(TIRPC_EPOLL)
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <rpc/rpc.h>
 #ifdef PORTMAP
@@ -60,15 +64,15 @@
 
 #include <rpc/svc.h>
 
-#define	RQCRED_SIZE	400	/* this size is excessive */
-
 #define SVC_VERSQUIET 0x0001	/* keep quiet about vers mismatch */
 #define version_keepquiet(xp) ((u_long)(xp)->xp_p3 & SVC_VERSQUIET)
 
 #define max(a, b) (a > b ? a : b)
 
 extern tirpc_pkg_params __pkg_params;
-svc_params __svc_params[1];
+extern SVCAUTH svc_auth_none;
+/* svc_run reaps idle connections even if svc_init is never called */
+svc_params __svc_params[1] = { { .idle_timeout = 30 } };
 
 /*
  * The services list
@@ -83,15 +87,101 @@ static struct svc_callout
   rpcvers_t sc_vers;
   char *sc_netid;
   void (*sc_dispatch) (struct svc_req *, SVCXPRT *);
+  const struct svc_proc *sc_procs;	/* svc_reg_procs, else NULL */
+  u_int sc_nprocs;
 } *svc_head;
 
+/*
+ * The dispatch table, a hashed image of the services list which
+ * svc_getreq_xprt consults without svc_lock.  It is rebuilt (under
+ * svc_lock) whenever the list changes, and replaced whole;  readers
+ * look it up inside an epoch (svc_epoch.c), so a replaced table is
+ * freed only after they are done with it.  NULL means look at the
+ * list itself (nothing registered yet, or no memory for a table).
+ */
+struct svc_vers_ent
+{
+  rpcprog_t ve_prog;
+  rpcvers_t ve_vers;
+  void (*ve_dispatch) (struct svc_req *, SVCXPRT *);
+  const struct svc_proc *ve_procs;	/* both NULL => empty */
+  u_int ve_nprocs;
+  struct svc_stats_ent *ve_stats;	/* NULL until svc_stats_enable */
+};
+
+struct svc_prog_ent
+{
+  rpcprog_t pe_prog;
+  rpcvers_t pe_low;		/* versions registered, for PROG_MISMATCH */
+  rpcvers_t pe_high;
+  bool_t pe_used;
+};
+
+struct svc_dispatch_tab
+{
+  size_t dt_size;		/* bytes, with the slot arrays */
+  u_int dt_mask;		/* slots - 1, in each array */
+  struct svc_vers_ent *dt_vers;
+  struct svc_prog_ent *dt_progs;
+};
+
+static struct svc_dispatch_tab *volatile svc_dispatch_tab;
+
+/*
+ * Call statistics (svc_stats_enable), for each (prog, vers) ever in
+ * the dispatch table while they were on.  Entries are added under
+ * svc_lock and never freed, so the table and snapshots may hold on to
+ * them without locking.  Each has a row of counters per procedure,
+ * the last for the others, repeated for each CPU (modulo
+ * SVC_STATS_NCPU);  they are updated atomically, since a thread may
+ * move, or be preempted by another on the same CPU.
+ */
+#define SVC_STATS_NCPU	32
+
+struct svc_stats_row
+{
+  u_long sr_calls;
+  u_long sr_auth_errs;
+  u_long sr_decode_errs;
+  u_long sr_lat[SVC_STATS_BUCKETS];
+};
+
+struct svc_stats_ent
+{
+  struct svc_stats_ent *se_next;
+  rpcprog_t se_prog;
+  rpcvers_t se_vers;
+  u_int se_nrows;		/* per CPU */
+  struct svc_stats_row *se_rows;	/* [svc_stats_ncpu][se_nrows] */
+};
+
+static volatile int svc_stats_on;
+static u_int svc_stats_ncpu;
+static struct svc_stats_ent *volatile svc_stats_head;
+
+/* the row being counted by a dispatch routine in this thread */
+static thread_key_t svc_stats_key;
+static once_t svc_stats_key_once = ONCE_INITIALIZER;
+
 extern rwlock_t svc_lock;
 extern rwlock_t svc_fd_lock;
 
 static struct svc_callout *svc_find (rpcprog_t, rpcvers_t,
 				     struct svc_callout **, char *);
+static void svc_dispatch_rebuild (void);
+static bool_t svc_reg_common (SVCXPRT *, const rpcprog_t, const rpcvers_t,
+			      void (*)(struct svc_req *, SVCXPRT *),
+			      const struct svc_proc *, const u_int,
+			      const struct netconfig *);
 static void __xprt_do_unregister (SVCXPRT * xprt, bool_t dolock);
 
+#if defined(TIRPC_EPOLL)
+/* shard of the calling event thread, if any */
+static thread_key_t svc_shard_key = -1;
+
+static bool_t svc_shard_init (struct svc_epoll_shard *, u_int);
+#endif
+
 /* Package init function.
  * It is intended that applications which must make use of global state
  * will call svc_init() before accessing such state and before executing
@@ -100,7 +190,27 @@ static void __xprt_do_unregister (SVCXPRT * xprt, bool_t dolock);
 void
 svc_init (svc_init_params * params)
 {
+#if defined(TIRPC_EPOLL)
+    long code;
+    u_int ix;
+#endif
+
     __svc_params->max_connections = FD_SETSIZE;
+    __svc_params->idle_timeout = 30;
+    if (params->flags & SVC_INIT_IDLE)
+        __svc_params->idle_timeout = params->idle_timeout;
+    __svc_params->nworkers = 0;
+    if (params->flags & SVC_INIT_WORKERS)
+        __svc_params->nworkers = params->nworkers;
+    __svc_params->max_inflight = 0;
+    __svc_params->max_xprt_inflight = 0;
+    if (params->flags & SVC_INIT_THROTTLE) {
+        __svc_params->max_inflight = params->max_inflight;
+        __svc_params->max_xprt_inflight = params->max_xprt_inflight;
+    }
+    __svc_params->accept_batch = 1;
+    if ((params->flags & SVC_INIT_ACCEPT) && (params->accept_batch > 1))
+        __svc_params->accept_batch = params->accept_batch;
 
     if (params->flags & SVC_INIT_WARNX)
         __pkg_params.warnx = params->warnx;
@@ -110,34 +220,56 @@ svc_init (svc_init_params * params)
 #if defined(TIRPC_EPOLL)
     if (params->flags & SVC_INIT_EPOLL) {
         __svc_params->ev_type = SVC_EVENT_EPOLL;
+        if (params->flags & SVC_INIT_URING)
+            __svc_params->ev_type = SVC_EVENT_URING;
         __svc_params->max_connections = params->max_connections;
         __svc_params->ev_u.epoll.max_events = params->max_events;
-        __svc_params->ev_u.epoll.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-        if (__svc_params->ev_u.epoll.epoll_fd == -1) {
-            warnx("svc_init:  epoll_create failed");
-            return;
+        __svc_params->ev_u.epoll.nthreads = 1;
+        if ((params->flags & SVC_INIT_THREADS) && (params->nthreads > 1))
+            __svc_params->ev_u.epoll.nthreads = params->nthreads;
+        __svc_params->ev_u.epoll.edge =
+            (params->flags & SVC_INIT_EPOLLET) ? TRUE : FALSE;
+        __svc_params->ev_u.epoll.nshards = 1;
+        if (params->flags & SVC_INIT_SHARDS) {
+            if (params->nshards > 0)
+                __svc_params->ev_u.epoll.nshards = params->nshards;
+            else if ((code = sysconf(_SC_NPROCESSORS_ONLN)) > 1)
+                __svc_params->ev_u.epoll.nshards = code;
         }
-    } else {
-#else
-    if (TRUE) {
+        __svc_params->ev_u.epoll.shards = (struct svc_epoll_shard *)
+            mem_alloc(__svc_params->ev_u.epoll.nshards *
+                      sizeof(struct svc_epoll_shard));
+        if (__svc_params->ev_u.epoll.shards == NULL)
+            warnx("svc_init:  epoll shards allocation failure");
+        else {
+            if (svc_shard_key == -1)
+                thr_keycreate(&svc_shard_key, NULL);
+            for (ix = 0; ix < __svc_params->ev_u.epoll.nshards; ++ix)
+                if (! svc_shard_init(&__svc_params->ev_u.epoll.shards[ix],
+                                     ix))
+                    break;
+            /* with the shards set up, if any */
+            if (ix > 0) {
+                __svc_params->ev_u.epoll.nshards = ix;
+                __svc_params->ev_u.epoll.epoll_fd =
+                    __svc_params->ev_u.epoll.shards[0].epoll_fd;
+                return;
+            }
+            mem_free(__svc_params->ev_u.epoll.shards,
+                     __svc_params->ev_u.epoll.nshards *
+                     sizeof(struct svc_epoll_shard));
+        }
+        warnx("svc_init:  no epoll set, using select");
+        __svc_params->ev_u.epoll.shards = NULL;
+        __svc_params->ev_u.epoll.nshards = 0;
+        __svc_params->max_connections = FD_SETSIZE;
+    }
 #endif
-        __svc_params->ev_type = SVC_EVENT_FDSET;
-        FD_ZERO(&svc_fdset);
-    }
-
-    if (params->flags & SVC_INIT_XPORTS) {
-	if (__svc_xports == NULL) {
-	    __svc_xports = (SVCXPRT **) mem_alloc (
-                __svc_params->max_connections * sizeof (SVCXPRT *));
-	    if (__svc_xports == NULL) {
-		warnx(
-                    "svc_init: __svc_xports allocation failure");
-		return;
-	    }
-	    memset (__svc_xports, 0,
-                    __svc_params->max_connections * sizeof (SVCXPRT *));
-	} /* !__svc_xports */   
-    } /* SVC_INIT_XPORTS */
+    __svc_params->ev_type = SVC_EVENT_FDSET;
+    FD_ZERO(&svc_fdset);
+
+    /* SVC_INIT_XPORTS:  the transport table now grows as transports
+     * are registered (svc_xprt_set), so there is nothing to allocate */
 
     return;
 }
@@ -167,11 +299,267 @@ __xprt_set_raddr(SVCXPRT *xprt, const struct sockaddr_storage *ss)
 	}
 }
 
+#if defined(TIRPC_EPOLL)
+/*
+ * Create shard ix's epoll set, and the eventfd which wakes its event
+ * threads (__svc_shard_wake).  The eventfd is EPOLLONESHOT when
+ * several threads share the set, so that one thread takes each wakeup.
+ * With SVC_EVENT_URING, an io_uring stands in for the epoll set;  if
+ * the kernel cannot provide one for the first shard, all use epoll.
+ */
+static bool_t
+svc_shard_init (struct svc_epoll_shard *sh, u_int ix)
+{
+    struct epoll_event ev;
+
+    sh->id = ix;
+    sh->work = NULL;
+    sh->uring = NULL;
+    sh->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sh->wake_fd == -1) {
+        warnx ("svc_init:  eventfd failed");
+        return (FALSE);
+    }
+    if (__svc_params->ev_type == SVC_EVENT_URING) {
+        if (__svc_uring_init (sh))
+            return (TRUE);
+        if (ix > 0) {
+            warnx ("svc_init:  io_uring setup failed");
+            (void) close (sh->wake_fd);
+            return (FALSE);
+        }
+        warnx ("svc_init:  io_uring unavailable, using epoll");
+        __svc_params->ev_type = SVC_EVENT_EPOLL;
+    }
+    sh->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (sh->epoll_fd == -1) {
+        warnx ("svc_init:  epoll_create failed");
+        (void) close (sh->wake_fd);
+        return (FALSE);
+    }
+    memset (&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN;
+    if (__svc_params->ev_u.epoll.nthreads > 1)
+        ev.events |= EPOLLONESHOT;
+    ev.data.ptr = NULL;
+    if (epoll_ctl (sh->epoll_fd, EPOLL_CTL_ADD, sh->wake_fd, &ev) == -1) {
+        warnx ("svc_init:  epoll_ctl (eventfd) failed");
+        (void) close (sh->wake_fd);
+        (void) close (sh->epoll_fd);
+        return (FALSE);
+    }
+    return (TRUE);
+}
+
+/*
+ * Mark the calling thread as an event thread of shard sh.  Transports
+ * it registers (e.g., connections it accepts) join the same epoll set.
+ */
+void
+__svc_shard_enter (struct svc_epoll_shard *sh)
+{
+    thr_setspecific (svc_shard_key, (void *) sh);
+}
+
+/*
+ * The shard of the calling event thread, or NULL.
+ */
+struct svc_epoll_shard *
+__svc_shard_self (void)
+{
+    return ((struct svc_epoll_shard *) thr_getspecific (svc_shard_key));
+}
+
+/*
+ * Choose the epoll set of a new transport:  shard, if >= 0, else that
+ * of the calling event thread, else round-robin.
+ */
+static struct svc_epoll_shard *
+svc_shard_select (int shard)
+{
+    static u_int next;
+    struct svc_epoll_shard *sh;
+    u_int nshards = __svc_params->ev_u.epoll.nshards;
+
+    if (shard >= 0)
+        return (&__svc_params->ev_u.epoll.shards[shard % nshards]);
+    if (nshards == 1)
+        return (&__svc_params->ev_u.epoll.shards[0]);
+    sh = (struct svc_epoll_shard *) thr_getspecific (svc_shard_key);
+    if (sh)
+        return (sh);
+    return (&__svc_params->ev_u.epoll.shards[
+                __sync_fetch_and_add (&next, 1) % nshards]);
+}
+
+/*
+ * Open another socket bound to fd's local address, one member of a
+ * SO_REUSEPORT group, so that each shard can have its own listener.
+ * Returns the new (listening, if stream) socket, or -1.
+ */
+int
+__svc_shard_clone_fd (int fd)
+{
+    struct __rpc_sockinfo si;
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof (ss);
+    int one = 1, v6only = 0, nfd;
+
+    if (!__rpc_fd2sockinfo (fd, &si) ||
+        (si.si_af != AF_INET && si.si_af != AF_INET6))
+        return (-1);
+    if (getsockname (fd, (struct sockaddr *) (void *) &ss, &slen) < 0)
+        return (-1);
+    /* every member of the group, fd included, must set SO_REUSEPORT */
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0)
+        return (-1);
+    nfd = socket (si.si_af, si.si_socktype | SOCK_CLOEXEC, si.si_proto);
+    if (nfd < 0)
+        return (-1);
+    if (si.si_af == AF_INET6) {
+        slen = sizeof (v6only);
+        (void) getsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &slen);
+        (void) setsockopt (nfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only,
+                           sizeof (v6only));
+    }
+    if (setsockopt (nfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0 ||
+        bind (nfd, (struct sockaddr *) (void *) &ss, si.si_alen) < 0 ||
+        (si.si_socktype == SOCK_STREAM && listen (nfd, SOMAXCONN) < 0)) {
+        (void) close (nfd);
+        return (-1);
+    }
+    return (nfd);
+}
+
+/*
+ * Interrupt an event thread of shard sh in (or on its way into)
+ * epoll_wait.  Safe in a signal handler.
+ */
+void
+__svc_shard_wake (struct svc_epoll_shard *sh)
+{
+    uint64_t one = 1;
+
+    /* EAGAIN means the counter is saturated:  a wakeup is pending */
+    (void) write (sh->wake_fd, &one, sizeof (one));
+}
+#endif /* TIRPC_EPOLL */
+
+/*
+ * Have an event thread of shard (as for __xprt_register_shard, -1 for
+ * the caller's own or any) call w->fn(w->arg).  Posted work runs in
+ * order, after the events at hand.  Without epoll, runs it directly.
+ */
+void
+__svc_work_post (int shard, struct svc_work *w)
+{
+#if defined(TIRPC_EPOLL)
+    struct svc_epoll_shard *sh;
+    struct svc_work *head;
+
+    if (__svc_ev_epoll (__svc_params)) {
+        sh = svc_shard_select (shard);
+        do {
+            head = sh->work;
+            w->next = head;
+        } while (! __sync_bool_compare_and_swap (&sh->work, head, w));
+        /* else whoever made the queue non-empty has woken the shard,
+         * and the thread it woke has yet to take the queue */
+        if (head == NULL)
+            __svc_shard_wake (sh);
+        return;
+    }
+#endif
+    (*w->fn) (w->arg);
+}
+
+/*
+ * The transport table, by fd.  A directory of chunks of SVC_XPRT_CHUNK
+ * slots:  a chunk is allocated when a transport is first registered in
+ * its range, and freed when the last one there is unregistered, so
+ * memory follows the live transports, not the highest fd.  Growing
+ * moves no slot, so a lookup never races a reallocation.  Chunk 0 is
+ * never freed:  RPC_SVC_XPRTS_GET and _SET expose it as the flat
+ * table of old, which is what select (svc_fdset) can use anyway.
+ *
+ * All of it is under svc_fd_lock.
+ */
+#define SVC_XPRT_CHUNK		FD_SETSIZE
+#define SVC_XPRT_NCHUNKS	1024	/* 1M fds */
+
+static SVCXPRT **svc_xprt_dir[SVC_XPRT_NCHUNKS];
+static u_int svc_xprt_nlive[SVC_XPRT_NCHUNKS];
+
+/*
+ * Highest fd + 1 which can be registered:  select's limit, or the
+ * table's.
+ */
+int
+__svc_xprt_limit (void)
+{
+    if (__svc_params->ev_type == SVC_EVENT_FDSET)
+        return (FD_SETSIZE);
+    return (SVC_XPRT_NCHUNKS * SVC_XPRT_CHUNK);
+}
+
+/* svc_fd_lock held */
+static SVCXPRT *
+svc_xprt_lookup (int fd)
+{
+    SVCXPRT **chunk;
+
+    if ((fd < 0) || (fd >= SVC_XPRT_NCHUNKS * SVC_XPRT_CHUNK))
+        return (NULL);
+    chunk = svc_xprt_dir[fd / SVC_XPRT_CHUNK];
+    return ((chunk != NULL) ? chunk[fd % SVC_XPRT_CHUNK] : NULL);
+}
+
+/* svc_fd_lock held for writing */
+static bool_t
+svc_xprt_set (int fd, SVCXPRT * xprt)
+{
+    SVCXPRT ***chunkp = &svc_xprt_dir[fd / SVC_XPRT_CHUNK];
+
+    if (*chunkp == NULL) {
+        *chunkp = (SVCXPRT **) mem_alloc (SVC_XPRT_CHUNK * sizeof (SVCXPRT *));
+        if (*chunkp == NULL)
+            return (FALSE);
+        memset (*chunkp, 0, SVC_XPRT_CHUNK * sizeof (SVCXPRT *));
+    }
+    if ((*chunkp)[fd % SVC_XPRT_CHUNK] == NULL)
+        svc_xprt_nlive[fd / SVC_XPRT_CHUNK]++;
+    (*chunkp)[fd % SVC_XPRT_CHUNK] = xprt;
+    return (TRUE);
+}
+
+/* svc_fd_lock held for writing;  fd's slot is in use */
+static void
+svc_xprt_clear (int fd)
+{
+    u_int ix = fd / SVC_XPRT_CHUNK;
+
+    svc_xprt_dir[ix][fd % SVC_XPRT_CHUNK] = NULL;
+    if ((--svc_xprt_nlive[ix] == 0) && (ix > 0)) {
+        mem_free (svc_xprt_dir[ix], SVC_XPRT_CHUNK * sizeof (SVCXPRT *));
+        svc_xprt_dir[ix] = NULL;
+    }
+}
+
 /*
  * Activate a transport handle.
  */
 void
 xprt_register (SVCXPRT * xprt)
+{
+    __xprt_register_shard (xprt, -1);
+}
+
+/*
+ * Activate a transport handle;  with SVC_INIT_SHARDS, shard selects
+ * its epoll set (-1:  the caller's, or round-robin).
+ */
+void
+__xprt_register_shard (SVCXPRT * xprt, int shard)
 {
     int code, sock;
 
@@ -179,41 +567,54 @@ xprt_register (SVCXPRT * xprt)
 
     sock = xprt->xp_fd;
 
+    if (sock >= __svc_xprt_limit ()) {
+        __warnx ("xprt_register: fd %d too high", sock);
+        return;
+    }
+
     rwlock_wrlock (&svc_fd_lock);
-    if (__svc_xports == NULL) {
-        __svc_params->max_connections = FD_SETSIZE;
-        __svc_xports = (SVCXPRT **) mem_alloc (FD_SETSIZE * sizeof (SVCXPRT *));
-        if (__svc_xports == NULL) {
-            __warnx("xprt_register: __svc_xports allocation failure");
-            rwlock_unlock (&svc_fd_lock);
-            return;
-        }
-        memset (__svc_xports, 0, FD_SETSIZE * sizeof (SVCXPRT *));
+    if (! svc_xprt_set (sock, xprt)) {
+        __warnx ("xprt_register: transport table allocation failure");
+        rwlock_unlock (&svc_fd_lock);
+        return;
     }
-    if (sock < __svc_params->max_connections) {
-        __svc_xports[sock] = xprt;
-        switch (__svc_params->ev_type) {
+    switch (__svc_params->ev_type) {
 #if defined(TIRPC_EPOLL)
-        case SVC_EVENT_EPOLL:
-            /* set up epoll user data */
-            xprt->xp_epoll_ev.data.fd = sock;
-            /* wait for read events, level triggered */
-            xprt->xp_epoll_ev.events = EPOLLIN;
-            /* add to epoll vector */
-            code = epoll_ctl(__svc_params->ev_u.epoll.epoll_fd,
-                             EPOLL_CTL_ADD,
-                             sock,
-                             &xprt->xp_epoll_ev);
+    case SVC_EVENT_EPOLL:
+    case SVC_EVENT_URING:
+        /* set up epoll user data:  event threads find xprt
+         * without consulting the transport table */
+        xprt->xp_epoll_ev.data.ptr = xprt;
+        /* wait for read events, level triggered unless the
+         * transport drains its input (SVC_XPORT_FLAG_EDGE) */
+        xprt->xp_epoll_ev.events = EPOLLIN;
+        if (xprt->xp_flags & SVC_XPORT_FLAG_EDGE)
+            xprt->xp_epoll_ev.events |= EPOLLET;
+        /* with several event threads, each event disarms the xprt
+         * until its owner is done with it (svc_rearm_epoll) */
+        if (__svc_params->ev_u.epoll.nthreads > 1 ||
+            __svc_params->ev_type == SVC_EVENT_URING)
+            xprt->xp_epoll_ev.events |= EPOLLONESHOT;
+        xprt->xp_epoll_fd = svc_shard_select(shard)->epoll_fd;
+        if (__svc_params->ev_type == SVC_EVENT_URING) {
+            /* io_uring polls are one-shot, always */
+            __svc_uring_arm (xprt);
             break;
+        }
+        /* add to epoll vector */
+        code = epoll_ctl(xprt->xp_epoll_fd,
+                         EPOLL_CTL_ADD,
+                         sock,
+                         &xprt->xp_epoll_ev);
+        break;
 #endif
-        default:
-            FD_SET (sock, &svc_fdset);
-            break;
-        } /* switch */
-      svc_maxfd = max (svc_maxfd, sock);
-    }
+    default:
+        FD_SET (sock, &svc_fdset);
+        break;
+    } /* switch */
+    svc_maxfd = max (svc_maxfd, sock);
     rwlock_unlock (&svc_fd_lock);
-} /* xprt_register */
+} /* __xprt_register_shard */
 
 void
 xprt_unregister (SVCXPRT * xprt)
@@ -242,17 +643,19 @@ __xprt_do_unregister (SVCXPRT *xprt, bool_t dolock)
     if (dolock)
         rwlock_wrlock (&svc_fd_lock);
 
-    if ((sock < __svc_params->max_connections) && 
-        (__svc_xports[sock] == xprt)) {
-        __svc_xports[sock] = NULL;
+    if (svc_xprt_lookup (sock) == xprt) {
+        svc_xprt_clear (sock);
         switch (__svc_params->ev_type) {
 #if defined(TIRPC_EPOLL)
         case SVC_EVENT_EPOLL:
-            code = epoll_ctl(__svc_params->ev_u.epoll.epoll_fd,
+            code = epoll_ctl(xprt->xp_epoll_fd,
                              EPOLL_CTL_DEL,
                              sock,
                              &xprt->xp_epoll_ev);
           break;
+        case SVC_EVENT_URING:
+            __svc_uring_disarm (xprt);
+            break;
 #endif
         default:
             FD_CLR (sock, &svc_fdset);
@@ -260,9 +663,13 @@ __xprt_do_unregister (SVCXPRT *xprt, bool_t dolock)
         } /* switch */
 
         if (sock >= svc_maxfd) {
-            for (svc_maxfd--; svc_maxfd >= 0; svc_maxfd--)
-                if (__svc_xports[svc_maxfd])
+            for (svc_maxfd--; svc_maxfd >= 0; svc_maxfd--) {
+                if (svc_xprt_dir[svc_maxfd / SVC_XPRT_CHUNK] == NULL)
+                    /* to the end of the previous chunk */
+                    svc_maxfd -= svc_maxfd % SVC_XPRT_CHUNK;
+                else if (svc_xprt_lookup (svc_maxfd))
                     break;
+            }
         }
     } /* sock */
 
@@ -270,6 +677,222 @@ __xprt_do_unregister (SVCXPRT *xprt, bool_t dolock)
         rwlock_unlock (&svc_fd_lock);
 }
 
+/*
+ * Take a reference on xprt, unless it is already being torn down.
+ * The handle itself stays readable (see __svc_epoch_free), so this
+ * may be tried on a pointer obtained without any lock.
+ */
+bool_t
+__svc_xprt_ref (SVCXPRT * xprt)
+{
+    u_int refcnt;
+
+    if (xprt->xp_dtor == NULL)
+        return (TRUE); /* not reference counted */
+    do {
+        refcnt = xprt->xp_refcnt;
+        if (refcnt == 0)
+            return (FALSE);
+    } while (! __sync_bool_compare_and_swap (&xprt->xp_refcnt, refcnt,
+                                             refcnt + 1));
+    return (TRUE);
+}
+
+void
+__svc_xprt_unref (SVCXPRT * xprt)
+{
+    if (xprt->xp_dtor == NULL)
+        return;
+    if (__sync_sub_and_fetch (&xprt->xp_refcnt, 1) == 0)
+        (*xprt->xp_dtor) (xprt);
+}
+
+/*
+ * Set xprt's flags in mask to those in flags, leaving the others, which
+ * other threads may be changing meanwhile.
+ */
+void
+__svc_xprt_setflags (SVCXPRT * xprt, u_int mask, u_int flags)
+{
+    u_int old;
+
+    do {
+        old = xprt->xp_flags;
+    } while (! __sync_bool_compare_and_swap (&xprt->xp_flags, old,
+                                             (old & ~mask) | (flags & mask)));
+}
+
+/*
+ * Destroy a reference counted transport:  the first caller unregisters
+ * xprt and drops the reference it was created with;  xp_dtor runs when
+ * the last holder (e.g., an event thread in svc_getreq_xprt) lets go.
+ */
+void
+__svc_xprt_destroy (SVCXPRT * xprt, bool_t dolock)
+{
+    if (__sync_fetch_and_or (&xprt->xp_flags, SVC_XPORT_FLAG_DESTROYED) &
+        SVC_XPORT_FLAG_DESTROYED)
+        return;
+    __xprt_do_unregister (xprt, dolock);
+    __svc_xprt_unref (xprt);
+}
+
+/*
+ * Admission control (SVC_INIT_THROTTLE).  A request is in flight from
+ * its receipt until it is answered or dropped, whether on the event
+ * thread, detached (svc_req_detach) or queued to the worker pool.  An
+ * event thread done with a transport which is over either limit takes
+ * it out of the epoll set's interest instead of rearming it
+ * (svc_throttle), and __svc_inflight_put puts it back.  So excess
+ * requests wait in socket buffers, and the clients slow down, rather
+ * than piling up in memory.
+ */
+static volatile u_int svc_inflight;
+static volatile u_long svc_throttled_count;
+
+#define svc_throttling() \
+  ((__svc_params->max_inflight > 0) || (__svc_params->max_xprt_inflight > 0))
+
+#if defined(TIRPC_EPOLL)
+struct svc_throttled
+{
+  struct svc_throttled *next;
+  SVCXPRT *xprt;		/* referenced */
+  struct svc_work work;		/* svc_throttle_resume */
+};
+
+/* protects svc_throttled */
+static mutex_t svc_throttle_lock = MUTEX_INITIALIZER;
+static struct svc_throttled *volatile svc_throttled;
+#endif
+
+void
+__svc_inflight_get (SVCXPRT * xprt)
+{
+  if (! svc_throttling ())
+    return;
+  __sync_fetch_and_add (&svc_inflight, 1);
+  __sync_fetch_and_add (&xprt->xp_inflight, 1);
+}
+
+bool_t
+__svc_inflight_full (SVCXPRT * xprt)
+{
+  if ((__svc_params->max_inflight > 0) &&
+      (svc_inflight >= __svc_params->max_inflight))
+    return (TRUE);
+  if ((__svc_params->max_xprt_inflight > 0) &&
+      (xprt->xp_inflight >= __svc_params->max_xprt_inflight))
+    return (TRUE);
+  return (FALSE);
+}
+
+#if defined(TIRPC_EPOLL)
+/* the shard index of xprt's epoll set, for __svc_work_post */
+static int
+svc_xprt_shard (SVCXPRT * xprt)
+{
+  u_int ix;
+
+  for (ix = 0; ix < __svc_params->ev_u.epoll.nshards; ++ix)
+    if (__svc_params->ev_u.epoll.shards[ix].epoll_fd == xprt->xp_epoll_fd)
+      return (ix);
+  return (-1);
+}
+
+/* posted by svc_throttle_release:  serve what xprt has read ahead */
+static void
+svc_throttle_resume (void *arg)
+{
+  struct svc_throttled *t = (struct svc_throttled *) arg;
+  SVCXPRT *xprt = t->xprt;
+
+  mem_free (t, sizeof (struct svc_throttled));
+  /* throttled again meanwhile (after an event):  resumed again later */
+  if (xprt->xp_flags & SVC_XPORT_FLAG_THROTTLED)
+    {
+      __svc_xprt_unref (xprt);
+      return;
+    }
+  /* takes over the reference */
+  svc_getreq_xprt (xprt);
+}
+
+static void
+svc_throttle_release (void)
+{
+  struct svc_throttled **prev, *t, *ready = NULL;
+  SVCXPRT *xprt;
+  bool_t resume;
+  int code;
+
+  mutex_lock (&svc_throttle_lock);
+  prev = (struct svc_throttled **) &svc_throttled;
+  while ((t = *prev) != NULL)
+    {
+      if (__svc_inflight_full (t->xprt))
+	{
+	  prev = &t->next;
+	  continue;
+	}
+      *prev = t->next;
+      t->next = ready;
+      ready = t;
+    }
+  mutex_unlock (&svc_throttle_lock);
+
+  while ((t = ready) != NULL)
+    {
+      ready = t->next;
+      xprt = t->xprt;
+      __sync_fetch_and_and (&xprt->xp_flags, ~SVC_XPORT_FLAG_THROTTLED);
+      /* still ours until armed:  no event comes for a listed handle
+       * (see svc_throttle).  Calls read ahead would raise none, so an
+       * event thread serves them, as if they had. */
+      resume = (! (xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED) &&
+		(__SVC_STAT (xprt) == XPRT_MOREREQS));
+      if (resume && (xprt->xp_epoll_ev.events & EPOLLONESHOT))
+	;			/* rearmed when it is done */
+      else if (__svc_params->ev_type == SVC_EVENT_URING)
+	__svc_uring_arm (xprt);
+      else if (! (xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED))
+	{
+	  /* readable data, if any, raises an event now */
+	  code = epoll_ctl (xprt->xp_epoll_fd,
+			    (xprt->xp_epoll_ev.events & EPOLLONESHOT) ?
+			    EPOLL_CTL_MOD : EPOLL_CTL_ADD, xprt->xp_fd,
+			    &xprt->xp_epoll_ev);
+	  if (code == -1 && errno != ENOENT)
+	    __warnx ("svc_throttle_release: epoll_ctl failed "
+		     "(fd %d, errno %d)", xprt->xp_fd, errno);
+	}
+      if (resume)
+	{
+	  t->work.fn = svc_throttle_resume;
+	  t->work.arg = t;
+	  __svc_work_post (svc_xprt_shard (xprt), &t->work);
+	  continue;
+	}
+      mem_free (t, sizeof (struct svc_throttled));
+      __svc_xprt_unref (xprt);
+    }
+}
+#endif
+
+void
+__svc_inflight_put (SVCXPRT * xprt)
+{
+  if (! svc_throttling ())
+    return;
+  __sync_fetch_and_sub (&xprt->xp_inflight, 1);
+  __sync_fetch_and_sub (&svc_inflight, 1);
+#if defined(TIRPC_EPOLL)
+  /* the decrement is a full barrier:  see svc_throttle */
+  if (svc_throttled != NULL)
+    svc_throttle_release ();
+#endif
+}
+
 /*
  * Add a service program to the callout list.
  * The dispatch routine will be called when a rpc request for this
@@ -282,6 +905,31 @@ svc_reg (xprt, prog, vers, dispatch, nconf)
      const rpcvers_t vers;
      void (*dispatch) (struct svc_req *, SVCXPRT *);
      const struct netconfig *nconf;
+{
+  return (svc_reg_common (xprt, prog, vers, dispatch, NULL, 0, nconf));
+}
+
+/*
+ * Add a service program to the callout list, as a table of procedures
+ * which the library calls itself (see svc_dispatch_procs).
+ */
+bool_t
+svc_reg_procs (SVCXPRT * xprt, const rpcprog_t prog, const rpcvers_t vers,
+	       const struct svc_proc * procs, const u_int nprocs,
+	       const struct netconfig * nconf)
+{
+  return (svc_reg_common (xprt, prog, vers, NULL, procs, nprocs, nconf));
+}
+
+static bool_t
+svc_reg_common (xprt, prog, vers, dispatch, procs, nprocs, nconf)
+     SVCXPRT *xprt;
+     const rpcprog_t prog;
+     const rpcvers_t vers;
+     void (*dispatch) (struct svc_req *, SVCXPRT *);
+     const struct svc_proc *procs;
+     const u_int nprocs;
+     const struct netconfig *nconf;
 {
   bool_t dummy;
   struct svc_callout *prev;
@@ -290,6 +938,10 @@ svc_reg (xprt, prog, vers, dispatch, nconf)
   char *netid = NULL;
   int flag = 0;
 
+  /* the dispatch table takes an entry with neither for a free one */
+  if ((dispatch == NULL) && ((procs == NULL) || (nprocs == 0)))
+    return (FALSE);
+
 /* VARIABLES PROTECTED BY svc_lock: s, prev, svc_head */
   if (xprt->xp_netid)
     {
@@ -317,7 +969,7 @@ svc_reg (xprt, prog, vers, dispatch, nconf)
     {
       if (netid)
 	free (netid);
-      if (s->sc_dispatch == dispatch)
+      if ((s->sc_dispatch == dispatch) && (s->sc_procs == procs))
 	goto rpcb_it;		/* he is registering another xptr */
       rwlock_unlock (&svc_lock);
       return (FALSE);
@@ -334,9 +986,12 @@ svc_reg (xprt, prog, vers, dispatch, nconf)
   s->sc_prog = prog;
   s->sc_vers = vers;
   s->sc_dispatch = dispatch;
+  s->sc_procs = procs;
+  s->sc_nprocs = nprocs;
   s->sc_netid = netid;
   s->sc_next = svc_head;
   svc_head = s;
+  svc_dispatch_rebuild ();
 
   if ((xprt->xp_netid == NULL) && (flag == 1) && netid)
     ((SVCXPRT *) xprt)->xp_netid = strdup (netid);
@@ -383,112 +1038,519 @@ svc_unreg (prog, vers)
 	mem_free (s->sc_netid, sizeof (s->sc_netid) + 1);
       mem_free (s, sizeof (struct svc_callout));
     }
+  svc_dispatch_rebuild ();
   rwlock_unlock (&svc_lock);
 }
 
 /* ********************** CALLOUT list related stuff ************* */
 
-#ifdef PORTMAP
+#ifdef PORTMAP
+/*
+ * Add a service program to the callout list.
+ * The dispatch routine will be called when a rpc request for this
+ * program number comes in.
+ */
+bool_t
+svc_register (xprt, prog, vers, dispatch, protocol)
+     SVCXPRT *xprt;
+     u_long prog;
+     u_long vers;
+     void (*dispatch) (struct svc_req *, SVCXPRT *);
+     int protocol;
+{
+  struct svc_callout *prev;
+  struct svc_callout *s;
+
+  assert (xprt != NULL);
+  assert (dispatch != NULL);
+
+  rwlock_wrlock (&svc_lock);
+  if ((s = svc_find ((rpcprog_t) prog, (rpcvers_t) vers, &prev, NULL)) !=
+      NULL)
+    {
+      if (s->sc_dispatch == dispatch)
+	{
+	  rwlock_unlock (&svc_lock);
+	  goto pmap_it;		/* he is registering another xprt */
+	}
+      rwlock_unlock (&svc_lock);
+      return (FALSE);
+    }
+  s = mem_alloc (sizeof (struct svc_callout));
+  if (s == NULL)
+    {
+      rwlock_unlock (&svc_lock);
+      return (FALSE);
+    }
+  s->sc_prog = (rpcprog_t) prog;
+  s->sc_vers = (rpcvers_t) vers;
+  s->sc_dispatch = dispatch;
+  s->sc_procs = NULL;
+  s->sc_nprocs = 0;
+  s->sc_netid = NULL;
+  s->sc_next = svc_head;
+  svc_head = s;
+  svc_dispatch_rebuild ();
+  rwlock_unlock (&svc_lock);
+pmap_it:
+  /* now register the information with the local binder service */
+  if (protocol)
+    {
+      return (pmap_set (prog, vers, protocol, xprt->xp_port));
+    }
+  return (TRUE);
+}
+
+/*
+ * Remove a service program from the callout list.
+ */
+void
+svc_unregister (prog, vers)
+     u_long prog;
+     u_long vers;
+{
+  struct svc_callout *prev;
+  struct svc_callout *s;
+
+  rwlock_wrlock (&svc_lock);
+  if ((s = svc_find ((rpcprog_t) prog, (rpcvers_t) vers, &prev, NULL)) ==
+      NULL)
+    {
+      rwlock_unlock (&svc_lock);
+      return;
+    }
+  if (prev == NULL)
+    {
+      svc_head = s->sc_next;
+    }
+  else
+    {
+      prev->sc_next = s->sc_next;
+    }
+  s->sc_next = NULL;
+  mem_free (s, sizeof (struct svc_callout));
+  svc_dispatch_rebuild ();
+  rwlock_unlock (&svc_lock);
+  /* now unregister the information with the local binder service */
+  (void) pmap_unset (prog, vers);
+}
+#endif /* PORTMAP */
+
+/*
+ * Search the callout list for a program number, return the callout
+ * struct.
+ */
+static struct svc_callout *
+svc_find (prog, vers, prev, netid)
+     rpcprog_t prog;
+     rpcvers_t vers;
+     struct svc_callout **prev;
+     char *netid;
+{
+  struct svc_callout *s, *p;
+
+  assert (prev != NULL);
+
+  p = NULL;
+  for (s = svc_head; s != NULL; s = s->sc_next)
+    {
+      if (((s->sc_prog == prog) && (s->sc_vers == vers)) &&
+	  ((netid == NULL) || (s->sc_netid == NULL) ||
+	   (strcmp (netid, s->sc_netid) == 0)))
+	break;
+      p = s;
+    }
+  *prev = p;
+  return (s);
+}
+
+static inline u_int
+svc_dispatch_hash (rpcprog_t prog, rpcvers_t vers)
+{
+  u_int32_t h = (u_int32_t) prog * 0x9e3779b1 ^ (u_int32_t) vers * 0x85ebca6b;
+
+  return (h ^ (h >> 16));
+}
+
+static void
+svc_stats_key_init (void)
+{
+  long n;
+
+  thr_keycreate (&svc_stats_key, NULL);
+  n = sysconf (_SC_NPROCESSORS_CONF);
+  svc_stats_ncpu = (n < 1) ? 1 : (n > SVC_STATS_NCPU) ? SVC_STATS_NCPU : n;
+}
+
+/*
+ * The statistics entry for s, made if need be.  Called with svc_lock
+ * held (write).
+ */
+static struct svc_stats_ent *
+svc_stats_find (struct svc_callout *s)
+{
+  struct svc_stats_ent *se;
+  size_t size;
+
+  for (se = svc_stats_head; se != NULL; se = se->se_next)
+    if ((se->se_prog == s->sc_prog) && (se->se_vers == s->sc_vers))
+      return (se);
+
+  se = (struct svc_stats_ent *) mem_alloc (sizeof (struct svc_stats_ent));
+  if (se == NULL)
+    goto nomem;
+  se->se_prog = s->sc_prog;
+  se->se_vers = s->sc_vers;
+  se->se_nrows = ((s->sc_procs != NULL) ? s->sc_nprocs : SVC_STATS_PROCS) + 1;
+  size = svc_stats_ncpu * se->se_nrows * sizeof (struct svc_stats_row);
+  se->se_rows = (struct svc_stats_row *) mem_alloc (size);
+  if (se->se_rows == NULL)
+    {
+      mem_free (se, sizeof (struct svc_stats_ent));
+      goto nomem;
+    }
+  memset (se->se_rows, 0, size);
+  se->se_next = svc_stats_head;
+  __sync_synchronize ();
+  svc_stats_head = se;
+  return (se);
+
+nomem:
+  __warnx ("svc_stats_find: out of memory, not counting calls");
+  return (NULL);
+}
+
+/* the calling CPU's row for proc */
+static inline struct svc_stats_row *
+svc_stats_row (struct svc_stats_ent *se, rpcproc_t proc)
+{
+  int cpu = sched_getcpu ();
+
+  if (cpu < 0)
+    cpu = 0;
+  if (proc >= se->se_nrows - 1)
+    proc = se->se_nrows - 1;
+  return (&se->se_rows[(cpu % svc_stats_ncpu) * se->se_nrows + proc]);
+}
+
+static inline u_int64_t
+svc_stats_now (void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((u_int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* count a call which took from start (svc_stats_now) until now */
+static void
+svc_stats_lat (struct svc_stats_row *row, u_int64_t start)
+{
+  u_int64_t us = (svc_stats_now () - start) / 1000;
+  u_int b;
+
+  for (b = 0; (us != 0) && (b < SVC_STATS_BUCKETS - 1); b++)
+    us >>= 1;
+  __sync_fetch_and_add (&row->sr_lat[b], 1);
+}
+
+void
+svc_stats_enable (bool_t on)
+{
+  thr_once (&svc_stats_key_once, svc_stats_key_init);
+  rwlock_wrlock (&svc_lock);
+  svc_stats_on = on ? 1 : 0;
+  /* for the entries */
+  if (on)
+    svc_dispatch_rebuild ();
+  rwlock_unlock (&svc_lock);
+}
+
+void
+svc_stats_walk (svc_stats_cb_t cb, void *arg)
+{
+  struct svc_stats_ent *se;
+  struct svc_stats_row *row;
+  struct svc_stat st;
+  u_int ix, cpu, b;
+
+  for (se = svc_stats_head; se != NULL; se = se->se_next)
+    for (ix = 0; ix < se->se_nrows; ix++)
+      {
+	memset (&st, 0, sizeof (st));
+	st.ss_prog = se->se_prog;
+	st.ss_vers = se->se_vers;
+	st.ss_proc = (ix < se->se_nrows - 1) ? ix : SVC_STATS_OTHER;
+	for (cpu = 0; cpu < svc_stats_ncpu; cpu++)
+	  {
+	    row = &se->se_rows[cpu * se->se_nrows + ix];
+	    st.ss_calls += row->sr_calls;
+	    st.ss_auth_errs += row->sr_auth_errs;
+	    st.ss_decode_errs += row->sr_decode_errs;
+	    for (b = 0; b < SVC_STATS_BUCKETS; b++)
+	      st.ss_lat[b] += row->sr_lat[b];
+	  }
+	if (st.ss_calls != 0)
+	  (*cb) (&st, arg);
+      }
+}
+
+struct svc_stats_copy
+{
+  struct svc_stat *sc_stats;
+  u_int sc_max;
+  u_int sc_n;
+};
+
+static void
+svc_stats_copy (const struct svc_stat *st, void *arg)
+{
+  struct svc_stats_copy *sc = arg;
+
+  if (sc->sc_n < sc->sc_max)
+    sc->sc_stats[sc->sc_n] = *st;
+  sc->sc_n++;
+}
+
+u_int
+svc_stats_snapshot (struct svc_stat *stats, u_int max)
+{
+  struct svc_stats_copy sc;
+
+  sc.sc_stats = stats;
+  sc.sc_max = max;
+  sc.sc_n = 0;
+  svc_stats_walk (svc_stats_copy, &sc);
+  return (sc.sc_n);
+}
+
+/*
+ * Replace the dispatch table with one built from svc_head.  Called with
+ * svc_lock held (write).  The first entry in the list for a given
+ * (prog, vers) is the one dispatched to, as when walking the list.
+ */
+static void
+svc_dispatch_rebuild (void)
+{
+  struct svc_dispatch_tab *tab, *otab;
+  struct svc_callout *s;
+  struct svc_vers_ent *ve;
+  struct svc_prog_ent *pe;
+  u_int n, nslots, ix;
+  size_t size;
+
+  for (n = 0, s = svc_head; s != NULL; s = s->sc_next)
+    n++;
+  /* at most half full */
+  for (nslots = 8; nslots < 2 * n; nslots <<= 1)
+    ;
+  size = sizeof (struct svc_dispatch_tab) +
+    nslots * (sizeof (struct svc_vers_ent) + sizeof (struct svc_prog_ent));
+
+  tab = NULL;
+  if (n > 0)
+    tab = (struct svc_dispatch_tab *) mem_alloc (size);
+  if (tab != NULL)
+    {
+      memset (tab, 0, size);
+      tab->dt_size = size;
+      tab->dt_mask = nslots - 1;
+      tab->dt_vers = (struct svc_vers_ent *) (tab + 1);
+      tab->dt_progs = (struct svc_prog_ent *) (tab->dt_vers + nslots);
+      for (s = svc_head; s != NULL; s = s->sc_next)
+	{
+	  for (ix = svc_dispatch_hash (s->sc_prog, s->sc_vers);; ix++)
+	    {
+	      ve = &tab->dt_vers[ix & tab->dt_mask];
+	      if ((ve->ve_dispatch == NULL) && (ve->ve_procs == NULL))
+		{
+		  ve->ve_prog = s->sc_prog;
+		  ve->ve_vers = s->sc_vers;
+		  ve->ve_dispatch = s->sc_dispatch;
+		  ve->ve_procs = s->sc_procs;
+		  ve->ve_nprocs = s->sc_nprocs;
+		  if (svc_stats_on)
+		    ve->ve_stats = svc_stats_find (s);
+		  break;
+		}
+	      if ((ve->ve_prog == s->sc_prog) && (ve->ve_vers == s->sc_vers))
+		break;		/* shadowed */
+	    }
+	  for (ix = svc_dispatch_hash (s->sc_prog, 0);; ix++)
+	    {
+	      pe = &tab->dt_progs[ix & tab->dt_mask];
+	      if (!pe->pe_used)
+		{
+		  pe->pe_used = TRUE;
+		  pe->pe_prog = s->sc_prog;
+		  pe->pe_low = pe->pe_high = s->sc_vers;
+		  break;
+		}
+	      if (pe->pe_prog == s->sc_prog)
+		{
+		  if (s->sc_vers < pe->pe_low)
+		    pe->pe_low = s->sc_vers;
+		  if (s->sc_vers > pe->pe_high)
+		    pe->pe_high = s->sc_vers;
+		  break;
+		}
+	    }
+	}
+    }
+  else if (n > 0)
+    __warnx ("svc_dispatch_rebuild: out of memory, dispatching from list");
+
+  /* publish:  the table is complete before it is reachable */
+  __sync_synchronize ();
+  otab = svc_dispatch_tab;
+  svc_dispatch_tab = tab;
+  if (otab != NULL)
+    __svc_epoch_free (otab, otab->dt_size);
+}
+
 /*
- * Add a service program to the callout list.
- * The dispatch routine will be called when a rpc request for this
- * program number comes in.
+ * Find the service for (prog, vers), and copy it to *vep.  If there is
+ * none, return FALSE and set *prog_found, and if it is, the range of
+ * versions of prog which are registered.  Must be called in an epoch
+ * (see svc_dispatch_tab).
  */
-bool_t
-svc_register (xprt, prog, vers, dispatch, protocol)
-     SVCXPRT *xprt;
-     u_long prog;
-     u_long vers;
-     void (*dispatch) (struct svc_req *, SVCXPRT *);
-     int protocol;
+static bool_t
+svc_dispatch_lookup (rpcprog_t prog, rpcvers_t vers,
+		     struct svc_vers_ent *vep, bool_t * prog_found,
+		     rpcvers_t * low_vers, rpcvers_t * high_vers)
 {
-  struct svc_callout *prev;
+  struct svc_dispatch_tab *tab = svc_dispatch_tab;
   struct svc_callout *s;
+  struct svc_vers_ent *ve;
+  struct svc_prog_ent *pe;
+  u_int ix;
 
-  assert (xprt != NULL);
-  assert (dispatch != NULL);
+  *prog_found = FALSE;
+  *low_vers = (rpcvers_t) - 1L;
+  *high_vers = (rpcvers_t) 0L;
 
-  if ((s = svc_find ((rpcprog_t) prog, (rpcvers_t) vers, &prev, NULL)) !=
-      NULL)
+  if (tab == NULL)
     {
-      if (s->sc_dispatch == dispatch)
-	goto pmap_it;		/* he is registering another xprt */
+      rwlock_rdlock (&svc_lock);
+      for (s = svc_head; s != NULL; s = s->sc_next)
+	{
+	  if (s->sc_prog == prog)
+	    {
+	      if (s->sc_vers == vers)
+		{
+		  vep->ve_dispatch = s->sc_dispatch;
+		  vep->ve_procs = s->sc_procs;
+		  vep->ve_nprocs = s->sc_nprocs;
+		  vep->ve_stats = NULL;
+		  rwlock_unlock (&svc_lock);
+		  return (TRUE);
+		}
+	      *prog_found = TRUE;
+	      if (s->sc_vers < *low_vers)
+		*low_vers = s->sc_vers;
+	      if (s->sc_vers > *high_vers)
+		*high_vers = s->sc_vers;
+	    }
+	}
+      rwlock_unlock (&svc_lock);
       return (FALSE);
     }
-  s = mem_alloc (sizeof (struct svc_callout));
-  if (s == NULL)
+
+  for (ix = svc_dispatch_hash (prog, vers);; ix++)
     {
-      return (FALSE);
+      ve = &tab->dt_vers[ix & tab->dt_mask];
+      if ((ve->ve_dispatch == NULL) && (ve->ve_procs == NULL))
+	break;
+      if ((ve->ve_prog == prog) && (ve->ve_vers == vers))
+	{
+	  *vep = *ve;
+	  return (TRUE);
+	}
     }
-  s->sc_prog = (rpcprog_t) prog;
-  s->sc_vers = (rpcvers_t) vers;
-  s->sc_dispatch = dispatch;
-  s->sc_next = svc_head;
-  svc_head = s;
-pmap_it:
-  /* now register the information with the local binder service */
-  if (protocol)
+  for (ix = svc_dispatch_hash (prog, 0);; ix++)
     {
-      return (pmap_set (prog, vers, protocol, xprt->xp_port));
+      pe = &tab->dt_progs[ix & tab->dt_mask];
+      if (!pe->pe_used)
+	break;
+      if (pe->pe_prog == prog)
+	{
+	  *prog_found = TRUE;
+	  *low_vers = pe->pe_low;
+	  *high_vers = pe->pe_high;
+	  break;
+	}
     }
-  return (TRUE);
+  return (FALSE);
 }
 
 /*
- * Remove a service program from the callout list.
+ * Storage for the arguments and results of svc_reg_procs procedures,
+ * on the stack when small enough.
  */
-void
-svc_unregister (prog, vers)
-     u_long prog;
-     u_long vers;
+#define SVC_PROC_INLINE	256
+
+union svc_proc_buf
 {
-  struct svc_callout *prev;
-  struct svc_callout *s;
+  char pb_data[SVC_PROC_INLINE];
+  long double pb_align1;
+  void *pb_align2;
+};
 
-  if ((s = svc_find ((rpcprog_t) prog, (rpcvers_t) vers, &prev, NULL)) ==
-      NULL)
-    return;
-  if (prev == NULL)
+/*
+ * Decode, call, reply and clean up for a procedure registered with
+ * svc_reg_procs, as an rpcgen-generated dispatcher would.
+ */
+static void
+svc_dispatch_procs (struct svc_req *r, SVCXPRT * xprt,
+		    const struct svc_proc *procs, u_int nprocs)
+{
+  const struct svc_proc *p = NULL;
+  union svc_proc_buf argbuf, resbuf;
+  xdrproc_t xargs, xres;
+  void *argp, *resp;
+
+  if (r->rq_proc < nprocs)
+    p = &procs[r->rq_proc];
+  if ((p == NULL) || (p->sp_handler == NULL))
     {
-      svc_head = s->sc_next;
+      if (r->rq_proc == NULLPROC)
+	(void) svc_sendreply (xprt, (xdrproc_t) xdr_void, NULL);
+      else
+	svcerr_noproc (xprt);
+      return;
     }
-  else
+  xargs = p->sp_xargs ? p->sp_xargs : (xdrproc_t) xdr_void;
+  xres = p->sp_xres ? p->sp_xres : (xdrproc_t) xdr_void;
+
+  argp = (p->sp_argsize > sizeof (argbuf)) ?
+    mem_alloc (p->sp_argsize) : argbuf.pb_data;
+  resp = (p->sp_ressize > sizeof (resbuf)) ?
+    mem_alloc (p->sp_ressize) : resbuf.pb_data;
+  if ((argp == NULL) || (resp == NULL))
     {
-      prev->sc_next = s->sc_next;
+      __warnx ("svc_dispatch_procs: out of memory");
+      svcerr_systemerr (xprt);
+      goto out;
     }
-  s->sc_next = NULL;
-  mem_free (s, sizeof (struct svc_callout));
-  /* now unregister the information with the local binder service */
-  (void) pmap_unset (prog, vers);
-}
-#endif /* PORTMAP */
-
-/*
- * Search the callout list for a program number, return the callout
- * struct.
- */
-static struct svc_callout *
-svc_find (prog, vers, prev, netid)
-     rpcprog_t prog;
-     rpcvers_t vers;
-     struct svc_callout **prev;
-     char *netid;
-{
-  struct svc_callout *s, *p;
+  memset (argp, 0, p->sp_argsize);
+  memset (resp, 0, p->sp_ressize);
 
-  assert (prev != NULL);
-
-  p = NULL;
-  for (s = svc_head; s != NULL; s = s->sc_next)
+  if (!__SVC_GETARGS (xprt, xargs, argp))
     {
-      if (((s->sc_prog == prog) && (s->sc_vers == vers)) &&
-	  ((netid == NULL) || (s->sc_netid == NULL) ||
-	   (strcmp (netid, s->sc_netid) == 0)))
-	break;
-      p = s;
+      svcerr_decode (xprt);
+      goto out;
     }
-  *prev = p;
-  return (s);
+  if ((*p->sp_handler) (argp, resp, r) && !svc_sendreply (xprt, xres, resp))
+    svcerr_systemerr (xprt);
+  if (!__SVC_FREEARGS (xprt, xargs, argp))
+    __warnx ("svc_dispatch_procs: unable to free arguments");
+  xdr_free (xres, resp);
+
+out:
+  if ((argp != NULL) && (argp != argbuf.pb_data))
+    mem_free (argp, p->sp_argsize);
+  if ((resp != NULL) && (resp != resbuf.pb_data))
+    mem_free (resp, p->sp_ressize);
 }
 
 /* ******************* REPLY GENERATION ROUTINES  ************ */
@@ -512,7 +1574,7 @@ svc_sendreply (xprt, xdr_results, xdr_location)
   rply.acpted_rply.ar_stat = SUCCESS;
   rply.acpted_rply.ar_results.where = xdr_location;
   rply.acpted_rply.ar_results.proc = xdr_results;
-  return (SVC_REPLY (xprt, &rply));
+  return (__SVC_REPLY (xprt, &rply));
 }
 
 /*
@@ -530,7 +1592,7 @@ svcerr_noproc (xprt)
   rply.rm_reply.rp_stat = MSG_ACCEPTED;
   rply.acpted_rply.ar_verf = xprt->xp_verf;
   rply.acpted_rply.ar_stat = PROC_UNAVAIL;
-  SVC_REPLY (xprt, &rply);
+  __SVC_REPLY (xprt, &rply);
 }
 
 /*
@@ -548,7 +1610,14 @@ svcerr_decode (xprt)
   rply.rm_reply.rp_stat = MSG_ACCEPTED;
   rply.acpted_rply.ar_verf = xprt->xp_verf;
   rply.acpted_rply.ar_stat = GARBAGE_ARGS;
-  SVC_REPLY (xprt, &rply);
+  if (svc_stats_on)
+    {
+      struct svc_stats_row *row = thr_getspecific (svc_stats_key);
+
+      if (row != NULL)
+	__sync_fetch_and_add (&row->sr_decode_errs, 1);
+    }
+  __SVC_REPLY (xprt, &rply);
 }
 
 /*
@@ -566,7 +1635,186 @@ svcerr_systemerr (xprt)
   rply.rm_reply.rp_stat = MSG_ACCEPTED;
   rply.acpted_rply.ar_verf = xprt->xp_verf;
   rply.acpted_rply.ar_stat = SYSTEM_ERR;
-  SVC_REPLY (xprt, &rply);
+  __SVC_REPLY (xprt, &rply);
+}
+
+/*
+ * Detached requests (svc_req_detach).  The copy carries the credential
+ * area of svc_getreq_xprt, relocated, and whatever svc_sendreply would
+ * otherwise take from the transport at reply time.
+ */
+struct svc_detached
+{
+  struct svc_req dr_req;	/* first:  what the caller sees */
+  u_int32_t dr_xid;
+  struct opaque_auth dr_verf;
+  struct netbuf dr_addr;	/* client, when the reply is sent */
+  struct svc_record dr_rec;	/* the call, see SVCTAKE_RECBUF */
+  char dr_verf_body[MAX_AUTH_BYTES];
+  char dr_cred_area[2 * MAX_AUTH_BYTES + RQCRED_SIZE];
+};
+
+/* p, moved with the credential area from "from" to "to" */
+static void *
+svc_detach_reloc (void *p, char *from, char *to)
+{
+  if (((char *) p >= from) &&
+      ((char *) p < from + sizeof (((struct svc_detached *) 0)->dr_cred_area)))
+    return (to + ((char *) p - from));
+  return (p);
+}
+
+/*
+ * Take a request away from the thread dispatching it;  see svc.h.
+ */
+struct svc_req *
+svc_req_detach (struct svc_req *rqstp)
+{
+  SVCXPRT *xprt = rqstp->rq_xprt;
+  struct svc_detached *dr;
+  struct authunix_parms *aup;
+  char *area;
+
+  assert (xprt != NULL);
+
+  switch (rqstp->rq_cred.oa_flavor)
+    {
+    case AUTH_NONE:
+    case AUTH_SYS:
+    case AUTH_SHORT:
+      break;
+    default:
+      /* RPCSEC_GSS and AUTH_DES keep per-request state elsewhere */
+      return (NULL);
+    }
+  /* the transport must outlive us */
+  if ((xprt->xp_dtor == NULL) || (xprt->xp_verf.oa_length > MAX_AUTH_BYTES))
+    return (NULL);
+
+  dr = (struct svc_detached *) mem_alloc (sizeof (struct svc_detached));
+  if (dr == NULL)
+    {
+      __warnx ("svc_req_detach: out of memory");
+      return (NULL);
+    }
+  memset (dr, 0, sizeof (struct svc_detached));
+  if (! SVC_CONTROL (xprt, SVCGET_XID, &dr->dr_xid))
+    goto fail;
+  if (xprt->xp_rtaddr.len > 0)
+    {
+      dr->dr_addr.buf = mem_alloc (xprt->xp_rtaddr.len);
+      if (dr->dr_addr.buf == NULL)
+	goto fail;
+      memcpy (dr->dr_addr.buf, xprt->xp_rtaddr.buf, xprt->xp_rtaddr.len);
+      dr->dr_addr.len = dr->dr_addr.maxlen = xprt->xp_rtaddr.len;
+    }
+  if (! __svc_xprt_ref (xprt))
+    goto fail;
+  /* svc_pool.c counts its calls until their handles go */
+  if (! (xprt->xp_flags & SVC_XPORT_FLAG_PIPELINE))
+    __svc_inflight_get (xprt);
+
+  /* rq_cred.oa_base is the start of svc_getreq_xprt's cred_area */
+  area = rqstp->rq_cred.oa_base;
+  dr->dr_req = *rqstp;
+  memcpy (dr->dr_cred_area, area, sizeof (dr->dr_cred_area));
+  dr->dr_req.rq_cred.oa_base = dr->dr_cred_area;
+  dr->dr_req.rq_clntcred =
+    svc_detach_reloc (rqstp->rq_clntcred, area, dr->dr_cred_area);
+  if ((rqstp->rq_cred.oa_flavor == AUTH_SYS) &&
+      (dr->dr_req.rq_clntcred != rqstp->rq_clntcred))
+    {
+      aup = (struct authunix_parms *) dr->dr_req.rq_clntcred;
+      aup->aup_machname =
+	svc_detach_reloc (aup->aup_machname, area, dr->dr_cred_area);
+      aup->aup_gids = svc_detach_reloc (aup->aup_gids, area, dr->dr_cred_area);
+    }
+
+  dr->dr_verf = xprt->xp_verf;
+  memcpy (dr->dr_verf_body, xprt->xp_verf.oa_base, xprt->xp_verf.oa_length);
+  dr->dr_verf.oa_base = dr->dr_verf_body;
+
+  /* keep what the arguments may point into (xdr_bytes_ref) */
+  if (! SVC_CONTROL (xprt, SVCTAKE_RECBUF, &dr->dr_rec))
+    dr->dr_rec.buf = NULL;
+
+  return (&dr->dr_req);
+
+fail:
+  if (dr->dr_addr.buf != NULL)
+    mem_free (dr->dr_addr.buf, dr->dr_addr.maxlen);
+  mem_free (dr, sizeof (struct svc_detached));
+  return (NULL);
+}
+
+/*
+ * Free a detached request, unanswered or answered.
+ */
+void
+svc_req_release (struct svc_req *rqstp)
+{
+  struct svc_detached *dr = (struct svc_detached *) rqstp;
+
+  if (! (rqstp->rq_xprt->xp_flags & SVC_XPORT_FLAG_PIPELINE))
+    __svc_inflight_put (rqstp->rq_xprt);
+  __svc_xprt_unref (rqstp->rq_xprt);
+  if (dr->dr_addr.buf != NULL)
+    mem_free (dr->dr_addr.buf, dr->dr_addr.maxlen);
+  if (dr->dr_rec.buf != NULL)
+    __xdr_bufpool_put (dr->dr_rec.buf, dr->dr_rec.size);
+  mem_free (dr, sizeof (struct svc_detached));
+}
+
+static bool_t
+svc_detached_send (struct svc_detached *dr, struct rpc_msg *rply)
+{
+  SVCXPRT *xprt = dr->dr_req.rq_xprt;
+  struct svc_detached_reply dreply;
+  bool_t stat = FALSE;
+
+  rply->rm_direction = REPLY;
+  rply->rm_xid = dr->dr_xid;
+  rply->rm_reply.rp_stat = MSG_ACCEPTED;
+  rply->acpted_rply.ar_verf = dr->dr_verf;
+  dreply.msg = rply;
+  /* the flavors svc_req_detach takes do not wrap */
+  dreply.auth = &svc_auth_none;
+  dreply.addr = &dr->dr_addr;
+  if (! (xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED))
+    stat = SVC_CONTROL (xprt, SVCSEND_DETACHED, &dreply);
+  svc_req_release (&dr->dr_req);
+  return (stat);
+}
+
+/*
+ * Answer a detached request, and free it.
+ */
+bool_t
+svc_sendreply_detached (struct svc_req *rqstp, xdrproc_t xdr_results,
+			void *xdr_location)
+{
+  struct rpc_msg rply;
+
+  rply.acpted_rply.ar_stat = SUCCESS;
+  rply.acpted_rply.ar_results.where = xdr_location;
+  rply.acpted_rply.ar_results.proc = xdr_results;
+  return (svc_detached_send ((struct svc_detached *) rqstp, &rply));
+}
+
+/*
+ * Fail a detached request (PROC_UNAVAIL, GARBAGE_ARGS, SYSTEM_ERR...),
+ * and free it.
+ */
+bool_t
+svcerr_detached (struct svc_req *rqstp, enum accept_stat why)
+{
+  struct rpc_msg rply;
+
+  /* no results, nor version range */
+  assert ((why != SUCCESS) && (why != PROG_MISMATCH));
+
+  rply.acpted_rply.ar_stat = why;
+  return (svc_detached_send ((struct svc_detached *) rqstp, &rply));
 }
 
 #if 0
@@ -627,7 +1875,7 @@ svcerr_auth (xprt, why)
   rply.rm_reply.rp_stat = MSG_DENIED;
   rply.rjcted_rply.rj_stat = AUTH_ERROR;
   rply.rjcted_rply.rj_why = why;
-  SVC_REPLY (xprt, &rply);
+  __SVC_REPLY (xprt, &rply);
 }
 
 /*
@@ -658,7 +1906,7 @@ svcerr_noprog (xprt)
   rply.rm_reply.rp_stat = MSG_ACCEPTED;
   rply.acpted_rply.ar_verf = xprt->xp_verf;
   rply.acpted_rply.ar_stat = PROG_UNAVAIL;
-  SVC_REPLY (xprt, &rply);
+  __SVC_REPLY (xprt, &rply);
 }
 
 /*
@@ -680,7 +1928,7 @@ svcerr_progvers (xprt, low_vers, high_vers)
   rply.acpted_rply.ar_stat = PROG_MISMATCH;
   rply.acpted_rply.ar_vers.low = (u_int32_t) low_vers;
   rply.acpted_rply.ar_vers.high = (u_int32_t) high_vers;
-  SVC_REPLY (xprt, &rply);
+  __SVC_REPLY (xprt, &rply);
 }
 
 /* ******************* SERVER INPUT STUFF ******************* */
@@ -735,15 +1983,123 @@ svc_getreqset (readfds)
 }
 
 #if defined(TIRPC_EPOLL)
+/*
+ * Return a transport registered EPOLLONESHOT to the epoll set, once
+ * the event thread which owned it is done.  Called with a reference
+ * on xprt.
+ */
+static void
+svc_rearm_epoll (SVCXPRT * xprt)
+{
+  int code;
+
+  if (!(xprt->xp_epoll_ev.events & EPOLLONESHOT) ||
+      (xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED))
+    return;
+
+  if (__svc_params->ev_type == SVC_EVENT_URING)
+    {
+      /* queued;  an event thread submits it with its next wait */
+      __svc_uring_arm (xprt);
+      return;
+    }
+  code = epoll_ctl (xprt->xp_epoll_fd,
+		    EPOLL_CTL_MOD, xprt->xp_fd, &xprt->xp_epoll_ev);
+  /* ENOENT:  unregistered meanwhile */
+  if (code == -1 && errno != ENOENT)
+    __warnx ("svc_rearm_epoll: epoll_ctl failed (fd %d, errno %d)",
+	     xprt->xp_fd, errno);
+}
+
+/*
+ * Have xprt polled as its transport now needs:  for input unless it
+ * holds back (SVC_XPORT_FLAG_OUTFULL), for output while it has replies
+ * queued (SVC_XPORT_FLAG_OUTQ).  Called by the event thread done with
+ * it, before rearming;  a handle not EPOLLONESHOT is changed at once.
+ */
+static void
+svc_xprt_interest (SVCXPRT * xprt)
+{
+  u_int32_t events;
+  int code;
+
+  events = xprt->xp_epoll_ev.events & ~(EPOLLIN | EPOLLOUT);
+  if (!(xprt->xp_flags & SVC_XPORT_FLAG_OUTFULL))
+    events |= EPOLLIN;
+  if (xprt->xp_flags & SVC_XPORT_FLAG_OUTQ)
+    events |= EPOLLOUT;
+  if (events == xprt->xp_epoll_ev.events)
+    return;
+  xprt->xp_epoll_ev.events = events;
+  if ((events & EPOLLONESHOT) ||
+      (xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED))
+    return;
+  code = epoll_ctl (xprt->xp_epoll_fd,
+		    EPOLL_CTL_MOD, xprt->xp_fd, &xprt->xp_epoll_ev);
+  if (code == -1 && errno != ENOENT)
+    __warnx ("svc_xprt_interest: epoll_ctl failed (fd %d, errno %d)",
+	     xprt->xp_fd, errno);
+}
+
+/*
+ * Stop reading xprt, which the caller is done with, if it is over an
+ * in-flight limit.  TRUE if so:  its reference then passes to the
+ * throttled list, and __svc_inflight_put rearms it.
+ */
+static bool_t
+svc_throttle (SVCXPRT * xprt)
+{
+  struct svc_throttled *t;
+
+  if ((xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED) ||
+      ! __svc_inflight_full (xprt))
+    return (FALSE);
+  t = (struct svc_throttled *) mem_alloc (sizeof (struct svc_throttled));
+  if (t == NULL)
+    return (FALSE);		/* better overloaded than stuck */
+
+  /* no event thread may take up xprt while it is listed, so that
+   * svc_throttle_release may look at it.  EPOLLONESHOT handles (and
+   * io_uring's) are disarmed already;  others leave the set, since
+   * EPOLLHUP and EPOLLERR come whatever the events asked.  Queued
+   * replies wait too. */
+  if (! (xprt->xp_epoll_ev.events & EPOLLONESHOT) &&
+      (__svc_params->ev_type != SVC_EVENT_URING))
+    (void) epoll_ctl (xprt->xp_epoll_fd, EPOLL_CTL_DEL, xprt->xp_fd,
+		      &xprt->xp_epoll_ev);
+
+  t->xprt = xprt;
+  __sync_fetch_and_or (&xprt->xp_flags, SVC_XPORT_FLAG_THROTTLED);
+  mutex_lock (&svc_throttle_lock);
+  t->next = svc_throttled;
+  svc_throttled = t;
+  mutex_unlock (&svc_throttle_lock);
+  __sync_fetch_and_add (&svc_throttled_count, 1);
+
+  /* a request may have finished before we were listed, seeing an
+   * empty list;  the atomic above orders our list store before our
+   * re-check, as the putter's decrement does its list load */
+  if (! __svc_inflight_full (xprt))
+    svc_throttle_release ();
+  return (TRUE);
+}
+
 void
 svc_getreqset_epoll (struct epoll_event *events, int nfds)
 {
+  SVCXPRT *xprt;
   int ix;
 
   assert (events != NULL);
 
+  /* no lock:  the caller is in an epoch (__svc_epoch_enter), so each
+   * handle is readable, and live if we can reference it.  An io_uring
+   * event comes with the reference its request held. */
   for (ix = 0; ix < nfds; ++ix) {
-        svc_getreq_common (events[ix].data.fd);
+        xprt = (SVCXPRT *) events[ix].data.ptr;
+        if (__svc_params->ev_type == SVC_EVENT_URING ||
+            __svc_xprt_ref (xprt))
+          svc_getreq_xprt (xprt);
   }
 
 }
@@ -754,92 +2110,167 @@ svc_getreq_common (fd)
      int fd;
 {
   SVCXPRT *xprt;
-  struct svc_req r;
-  struct rpc_msg msg;
+
+  rwlock_rdlock (&svc_fd_lock);
+  xprt = svc_xprt_lookup (fd);
+  if ((xprt != NULL) && ! __svc_xprt_ref (xprt))
+    xprt = NULL;
+  rwlock_unlock (&svc_fd_lock);
+  if (xprt == NULL)
+    /* But do we control sock? */
+    return;
+
+  svc_getreq_xprt (xprt);
+}
+
+/*
+ * Authenticate a call decoded from xprt into msg, and hand it to the
+ * registered service.  The caller has pointed msg's cred and verf,
+ * and r->rq_clntcred, at a credential area.
+ */
+void
+__svc_dispatch (SVCXPRT * xprt, struct rpc_msg *msg, struct svc_req *r)
+{
+  struct svc_vers_ent ve;
+  struct svc_epoch_rec *epoch;
+  struct svc_stats_row *row;
+  u_int64_t start = 0;
   int prog_found;
   rpcvers_t low_vers;
   rpcvers_t high_vers;
+  bool_t found;
+  enum auth_stat why;
+
+  r->rq_xprt = xprt;
+  r->rq_prog = msg->rm_call.cb_prog;
+  r->rq_vers = msg->rm_call.cb_vers;
+  r->rq_proc = msg->rm_call.cb_proc;
+  r->rq_cred = msg->rm_call.cb_cred;
+  if (__svc_trace_on)
+    __svc_trace_call (msg);
+  /* match message with a registered service, for after authenticating
+   * it;  the statistics count failures too */
+  epoch = __svc_epoch_self ();
+  __svc_epoch_enter (epoch);
+  found = svc_dispatch_lookup (r->rq_prog, r->rq_vers, &ve, &prog_found,
+			       &low_vers, &high_vers);
+  __svc_epoch_exit (epoch);
+  row = NULL;
+  if (found && svc_stats_on && (ve.ve_stats != NULL))
+    {
+      row = svc_stats_row (ve.ve_stats, r->rq_proc);
+      __sync_fetch_and_add (&row->sr_calls, 1);
+    }
+  if ((why = _authenticate (r, msg)) != AUTH_OK)
+    {
+      if (row != NULL)
+	__sync_fetch_and_add (&row->sr_auth_errs, 1);
+      svcerr_auth (xprt, why);
+      goto done;
+    }
+  __SVC_TRACE (SVC_TRACE_DISPATCH);
+  if (found)
+    {
+      if (row != NULL)
+	{
+	  start = svc_stats_now ();
+	  thr_setspecific (svc_stats_key, row);
+	}
+      if (ve.ve_procs != NULL)
+	svc_dispatch_procs (r, xprt, ve.ve_procs, ve.ve_nprocs);
+      else
+	(*ve.ve_dispatch) (r, xprt);
+      if (row != NULL)
+	{
+	  thr_setspecific (svc_stats_key, NULL);
+	  svc_stats_lat (row, start);
+	}
+      goto done;
+    }
+  /*
+   * if we got here, the program or version
+   * is not served ...
+   */
+  if (prog_found)
+    svcerr_progvers (xprt, low_vers, high_vers);
+  else
+    svcerr_noprog (xprt);
+done:
+  if (__svc_trace_on)
+    __svc_trace_end ();
+}
+
+/*
+ * Receive and dispatch requests from xprt.  The caller holds a
+ * reference on xprt, which is released here.
+ *
+ * A handle which is not reference counted (no xp_dtor) is freed by
+ * SVC_DESTROY at once, so for those we check the transport table as
+ * before.
+ */
+void
+svc_getreq_xprt (xprt)
+     SVCXPRT *xprt;
+{
+  bool_t counted = (xprt->xp_dtor != NULL);
+  int fd = xprt->xp_fd;
+  struct svc_req r;
+  struct rpc_msg msg;
   enum xprt_stat stat;
   char cred_area[2 * MAX_AUTH_BYTES + RQCRED_SIZE];
 
+#if defined(TIRPC_EPOLL)
+again:
+#endif
+  if (xprt->xp_flags & SVC_XPORT_FLAG_PIPELINE)
+    {
+      /* the worker pool decodes and dispatches (svc_pool.c) */
+      if (! __svc_pool_getreq (xprt))
+	SVC_DESTROY (xprt);
+      goto release;
+    }
+
   msg.rm_call.cb_cred.oa_base = cred_area;
   msg.rm_call.cb_verf.oa_base = &(cred_area[MAX_AUTH_BYTES]);
   r.rq_clntcred = &(cred_area[2 * MAX_AUTH_BYTES]);
 
-  rwlock_rdlock (&svc_fd_lock);
-  xprt = __svc_xports[fd];
-  rwlock_unlock (&svc_fd_lock);
-  if (xprt == NULL)
-    /* But do we control sock? */
-    return;
   /* now receive msgs from xprtprt (support batch calls) */
   do
     {
-      if (SVC_RECV (xprt, &msg))
+      if (__svc_trace_on)
+	__svc_trace_begin (xprt);
+      if (__SVC_RECV (xprt, &msg))
 	{
-
-	  /* now find the exported program and call it */
-	  struct svc_callout *s;
-	  enum auth_stat why;
-
-	  r.rq_xprt = xprt;
-	  r.rq_prog = msg.rm_call.cb_prog;
-	  r.rq_vers = msg.rm_call.cb_vers;
-	  r.rq_proc = msg.rm_call.cb_proc;
-	  r.rq_cred = msg.rm_call.cb_cred;
-	  /* first authenticate the message */
-	  if ((why = _authenticate (&r, &msg)) != AUTH_OK)
-	    {
-	      svcerr_auth (xprt, why);
-	      goto call_done;
-	    }
-	  /* now match message with a registered service */
-	  prog_found = FALSE;
-	  low_vers = (rpcvers_t) - 1L;
-	  high_vers = (rpcvers_t) 0L;
-	  for (s = svc_head; s != NULL; s = s->sc_next)
-	    {
-	      if (s->sc_prog == r.rq_prog)
-		{
-		  if (s->sc_vers == r.rq_vers)
-		    {
-		      (*s->sc_dispatch) (&r, xprt);
-		      goto call_done;
-		    }		/* found correct version */
-		  prog_found = TRUE;
-		  if (s->sc_vers < low_vers)
-		    low_vers = s->sc_vers;
-		  if (s->sc_vers > high_vers)
-		    high_vers = s->sc_vers;
-		}		/* found correct program */
-	    }
-	  /*
-	   * if we got here, the program or version
-	   * is not served ...
-	   */
-	  if (prog_found)
-	    svcerr_progvers (xprt, low_vers, high_vers);
-	  else
-	    svcerr_noprog (xprt);
-	  /* Fall through to ... */
+	  __svc_inflight_get (xprt);
+	  __svc_dispatch (xprt, &msg, &r);
+	  __svc_inflight_put (xprt);
+	  goto call_done;
 	}
       /*
        * Check if the xprt has been disconnected in a
        * recursive call in the service dispatch routine.
        * If so, then break.
        */
-      rwlock_rdlock (&svc_fd_lock);
-      
-      if (xprt != __svc_xports[fd])
+      if (! counted)
 	{
+	  rwlock_rdlock (&svc_fd_lock);
+	  if (xprt != svc_xprt_lookup (fd))
+	    {
+	      rwlock_unlock (&svc_fd_lock);
+	      return;
+	    }
 	  rwlock_unlock (&svc_fd_lock);
-	  break;
 	}
-      rwlock_unlock (&svc_fd_lock);
+      else if (xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED)
+	break;
     call_done:
-      if ((stat = SVC_STAT (xprt)) == XPRT_DIED)
+      if (xprt->xp_flags & SVC_XPORT_FLAG_RECPOOL)
+	(void) SVC_CONTROL (xprt, SVCDONE_RECORD, NULL);
+      if ((stat = __SVC_STAT (xprt)) == XPRT_DIED)
 	{
 	  SVC_DESTROY (xprt);
+	  if (! counted)
+	    return;
 	  break;
 	}
     else if ((xprt->xp_auth != NULL) &&
@@ -847,8 +2278,31 @@ svc_getreq_common (fd)
 	{
 	  xprt->xp_auth = NULL;
 	}
+      /* a connection left unread here, edge-triggered or with calls
+       * read ahead, is taken up again by svc_throttle_release */
+      if ((stat == XPRT_MOREREQS) && __svc_inflight_full (xprt))
+	break;
     }
   while (stat == XPRT_MOREREQS);
+
+release:
+  /* release xprt */
+#if defined(TIRPC_EPOLL)
+  if (__svc_ev_epoll (__svc_params))
+    {
+      svc_xprt_interest (xprt);
+      if (svc_throttling () && svc_throttle (xprt))
+	return;
+      /* stopped for a limit since lifted, with calls read ahead,
+       * which will raise no event */
+      if (svc_throttling () &&
+	  ! (xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED) &&
+	  (__SVC_STAT (xprt) == XPRT_MOREREQS))
+	goto again;
+      svc_rearm_epoll (xprt);
+    }
+#endif
+  __svc_xprt_unref (xprt);
 }
 
 
@@ -908,10 +2362,23 @@ rpc_control (int what, void *arg)
       rwlock_unlock(&svc_fd_lock);
       break;
   case RPC_SVC_XPRTS_GET:
-      *(SVCXPRT ***)arg = __svc_xports;
+      /* the first FD_SETSIZE slots, see svc_xprt_dir */
+      rwlock_wrlock(&svc_fd_lock);
+      if (svc_xprt_dir[0] == NULL) {
+          svc_xprt_dir[0] = (SVCXPRT **) mem_alloc (SVC_XPRT_CHUNK *
+                                                    sizeof (SVCXPRT *));
+          if (svc_xprt_dir[0] != NULL)
+              memset (svc_xprt_dir[0], 0, SVC_XPRT_CHUNK * sizeof (SVCXPRT *));
+      }
+      *(SVCXPRT ***)arg = svc_xprt_dir[0];
+      rwlock_unlock(&svc_fd_lock);
+      if (*(SVCXPRT ***)arg == NULL)
+          return FALSE;
       break;
   case RPC_SVC_XPRTS_SET:
-      __svc_xports = *(SVCXPRT ***)arg;
+      rwlock_wrlock(&svc_fd_lock);
+      svc_xprt_dir[0] = *(SVCXPRT ***)arg;
+      rwlock_unlock(&svc_fd_lock);
       break;
   case RPC_SVC_CONNMAXREC_SET:
       val = *(int *) arg;
@@ -922,6 +2389,18 @@ rpc_control (int what, void *arg)
   case RPC_SVC_CONNMAXREC_GET:
       *(int *) arg = __svc_maxrec;
       break;
+  case RPC_SVC_INFLIGHT_GET:
+      *(u_int *) arg = svc_inflight;
+      break;
+  case RPC_SVC_THROTTLED_GET:
+      *(u_long *) arg = svc_throttled_count;
+      break;
+  case RPC_SVC_SCHED_STATS_GET:
+      __svc_sched_stats ((struct svc_sched_stat *) arg);
+      break;
+  case RPC_SVC_BUFPOOL_STATS_GET:
+      __xdr_bufpool_stats ((struct svc_bufpool_stats *) arg);
+      break;
   default:
       return (FALSE);
   }
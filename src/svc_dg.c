@@ -31,6 +31,8 @@
  * Copyright (c) 1986-1991 by Sun Microsystems Inc.
  */
 
+#include <config.h>
+
 #include <sys/cdefs.h>
 
 /*
@@ -42,6 +44,9 @@
 #include <reentrant.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#if defined(TIRPC_EPOLL)
+#include <sys/epoll.h> /* before rpc.h */
+#endif
 #include <rpc/rpc.h>
 #include <rpc/svc_dg.h>
 #include <errno.h>
@@ -55,6 +60,7 @@
 #include "rpc_com.h"
 
 extern tirpc_pkg_params __pkg_params;
+extern svc_params __svc_params[1];
 
 #define	su_data(xprt)	((struct svc_dg_data *)(xprt->xp_p2))
 #define	rpc_buffer(xprt) ((xprt)->xp_p1)
@@ -63,14 +69,12 @@ extern tirpc_pkg_params __pkg_params;
 #define	MAX(a, b)	(((a) > (b)) ? (a) : (b))
 #endif
 
+static SVCXPRT *svc_dg_create_shard(int, u_int, u_int, int);
 static void svc_dg_ops(SVCXPRT *);
-static enum xprt_stat svc_dg_stat(SVCXPRT *);
-static bool_t svc_dg_recv(SVCXPRT *, struct rpc_msg *);
-static bool_t svc_dg_reply(SVCXPRT *, struct rpc_msg *);
-static bool_t svc_dg_getargs(SVCXPRT *, xdrproc_t, void *);
-static bool_t svc_dg_freeargs(SVCXPRT *, xdrproc_t, void *);
 static void svc_dg_destroy(SVCXPRT *);
+static void svc_dg_dodestroy(SVCXPRT *);
 static bool_t svc_dg_control(SVCXPRT *, const u_int, void *);
+static bool_t svc_dg_send_detached(SVCXPRT *, struct svc_detached_reply *);
 static int svc_dg_cache_get(SVCXPRT *, struct rpc_msg *, char **, size_t *);
 static void svc_dg_cache_set(SVCXPRT *, size_t);
 int svc_dg_enablecache(SVCXPRT *, u_int);
@@ -96,6 +100,54 @@ svc_dg_create(fd, sendsize, recvsize)
 	int fd;
 	u_int sendsize;
 	u_int recvsize;
+{
+	SVCXPRT *xprt;
+#if defined(TIRPC_EPOLL)
+	SVCXPRT *prev, *clone;
+	const char *netid;
+	struct __rpc_sockinfo si;
+	u_int ix;
+	int nfd;
+#endif
+
+	xprt = svc_dg_create_shard(fd, sendsize, recvsize, 0);
+#if defined(TIRPC_EPOLL)
+	if ((xprt == NULL) || !__svc_ev_epoll(__svc_params))
+		return (xprt);
+
+	/*
+	 * With SVC_INIT_SHARDS, each other shard receives on its own
+	 * socket bound to the same address (SO_REUSEPORT);  clones are
+	 * chained from xprt, and destroyed with it.
+	 */
+	prev = xprt;
+	for (ix = 1; ix < __svc_params->ev_u.epoll.nshards; ++ix) {
+		if ((nfd = __svc_shard_clone_fd(fd)) < 0) {
+			__warnx("svc_dg_create: could not clone socket "
+			    "for shard %u (errno %d)", ix, errno);
+			break;
+		}
+		clone = svc_dg_create_shard(nfd, sendsize, recvsize, ix);
+		if (clone == NULL) {
+			(void) close(nfd);
+			break;
+		}
+		if (__rpc_fd2sockinfo(nfd, &si) &&
+		    __rpc_sockinfo2netid(&si, &netid))
+			clone->xp_netid = strdup(netid);
+		su_data(prev)->su_sibling = clone;
+		prev = clone;
+	}
+#endif
+	return (xprt);
+}
+
+static SVCXPRT *
+svc_dg_create_shard(fd, sendsize, recvsize, shard)
+	int fd;
+	u_int sendsize;
+	u_int recvsize;
+	int shard;
 {
 	SVCXPRT *xprt;
 	struct svc_dg_data *su = NULL;
@@ -121,6 +173,8 @@ svc_dg_create(fd, sendsize, recvsize)
 	if (xprt == NULL)
 		goto freedata;
 	memset(xprt, 0, sizeof (SVCXPRT));
+	xprt->xp_refcnt = 1;
+	xprt->xp_dtor = svc_dg_dodestroy;
 
 	su = mem_alloc(sizeof (*su));
 	if (su == NULL)
@@ -131,6 +185,7 @@ svc_dg_create(fd, sendsize, recvsize)
 	xdrmem_create(&(su->su_xdrs), rpc_buffer(xprt), su->su_iosz,
 		XDR_DECODE);
 	su->su_cache = NULL;
+	su->su_sibling = NULL;
 	xprt->xp_flags = SVC_XPORT_FLAG_NONE;
 	xprt->xp_fd = fd;
 	xprt->xp_p2 = su;
@@ -147,7 +202,7 @@ svc_dg_create(fd, sendsize, recvsize)
 	/* Enable reception of IP*_PKTINFO control msgs */
 	svc_dg_enable_pktinfo(fd, &si);
 
-	xprt_register(xprt);
+	__xprt_register_shard(xprt, shard);
 	return (xprt);
 freedata:
 	(void) __warnx(svc_dg_str, __no_mem_str);
@@ -160,15 +215,15 @@ freedata:
 }
 
 /*ARGSUSED*/
-static enum xprt_stat
-svc_dg_stat(xprt)
+enum xprt_stat
+__svc_dg_stat(xprt)
 	SVCXPRT *xprt;
 {
 	return (XPRT_IDLE);
 }
 
-static bool_t
-svc_dg_recv(xprt, msg)
+bool_t
+__svc_dg_recv(xprt, msg)
 	SVCXPRT *xprt;
 	struct rpc_msg *msg;
 {
@@ -201,7 +256,7 @@ again:
 	__rpc_set_netbuf(&xprt->xp_rtaddr, &ss, mesgp->msg_namelen);
 
 	/* Check whether there's an IP_PKTINFO or IP6_PKTINFO control message.
-	 * If yes, preserve it for svc_dg_reply; otherwise just zap any cmsgs */
+	 * If yes, preserve it for __svc_dg_reply; otherwise just zap any cmsgs */
 	if (!svc_dg_valid_pktinfo(mesgp)) {
 		mesgp->msg_control = NULL;
 		mesgp->msg_controllen = 0;
@@ -225,8 +280,8 @@ again:
 	return (TRUE);
 }
 
-static bool_t
-svc_dg_reply(xprt, msg)
+bool_t
+__svc_dg_reply(xprt, msg)
 	SVCXPRT *xprt;
 	struct rpc_msg *msg;
 {
@@ -250,6 +305,7 @@ svc_dg_reply(xprt, msg)
 	} else
 		has_args = FALSE;
 
+	__SVC_TRACE(SVC_TRACE_ENCODE);
 	xdrs->x_op = XDR_ENCODE;
 	XDR_SETPOS(xdrs, 0);
 	msg->rm_xid = su->su_xid;
@@ -265,33 +321,37 @@ svc_dg_reply(xprt, msg)
 		msg->msg_iovlen = 1;
 		msg->msg_name = (struct sockaddr *)(void *) xprt->xp_rtaddr.buf;
 		msg->msg_namelen = xprt->xp_rtaddr.len;
-		/* cmsg already set in svc_dg_recv */
+		/* cmsg already set in __svc_dg_recv */
 
+		__SVC_TRACE(SVC_TRACE_SEND);
 		if (sendmsg(xprt->xp_fd, msg, 0) == (ssize_t) slen) {
 			stat = TRUE;
 			if (su->su_cache)
 				svc_dg_cache_set(xprt, slen);
 		}
+		__SVC_TRACE(SVC_TRACE_SENT);
 	}
 	return (stat);
 }
 
-static bool_t
-svc_dg_getargs(xprt, xdr_args, args_ptr)
+bool_t
+__svc_dg_getargs(xprt, xdr_args, args_ptr)
 	SVCXPRT *xprt;
 	xdrproc_t xdr_args;
 	void *args_ptr;
 {
+	__SVC_TRACE(SVC_TRACE_GETARGS);
 	if (! SVCAUTH_UNWRAP(xprt->xp_auth, &(su_data(xprt)->su_xdrs),
 			     xdr_args, args_ptr)) {
 		(void)svc_freeargs(xprt, xdr_args, args_ptr);
 		return FALSE;
 	}
+	__SVC_TRACE(SVC_TRACE_EXEC);
 	return TRUE;
 }
 
-static bool_t
-svc_dg_freeargs(xprt, xdr_args, args_ptr)
+bool_t
+__svc_dg_freeargs(xprt, xdr_args, args_ptr)
 	SVCXPRT *xprt;
 	xdrproc_t xdr_args;
 	void *args_ptr;
@@ -305,10 +365,19 @@ svc_dg_freeargs(xprt, xdr_args, args_ptr)
 static void
 svc_dg_destroy(xprt)
 	SVCXPRT *xprt;
+{
+	/* svc_dg_dodestroy runs with the last reference */
+	__svc_xprt_destroy(xprt, TRUE);
+}
+
+static void
+svc_dg_dodestroy(xprt)
+	SVCXPRT *xprt;
 {
 	struct svc_dg_data *su = su_data(xprt);
 
-	xprt_unregister(xprt);
+	if (su->su_sibling)
+		SVC_DESTROY(su->su_sibling);
 	if (xprt->xp_fd != -1)
 		(void)close(xprt->xp_fd);
 	if (xprt->xp_auth != NULL) {
@@ -324,7 +393,10 @@ svc_dg_destroy(xprt)
 		(void) mem_free(xprt->xp_ltaddr.buf, xprt->xp_ltaddr.maxlen);
 	if (xprt->xp_tp)
 		(void) free(xprt->xp_tp);
-	(void) mem_free(xprt, sizeof (SVCXPRT));
+	if (xprt->xp_netid)
+		(void) free(xprt->xp_netid);
+	/* an event thread may yet find xprt in an epoll event */
+	__svc_epoch_free(xprt, sizeof (SVCXPRT));
 }
 
 static bool_t
@@ -339,7 +411,7 @@ svc_dg_control(xprt, rq, in)
 	    *(u_int *)in = xprt->xp_flags;
 	    break;
 	case SVCSET_XP_FLAGS:
-	    xprt->xp_flags = *(u_int *)in;
+	    __svc_xprt_setflags(xprt, ~SVC_XPORT_FLAG_INTERNAL, *(u_int *)in);
 	    break;
 	case SVCGET_XP_RECV:
 	    *(xp_recv_t *)in = xprt->xp_ops->xp_recv;
@@ -347,12 +419,71 @@ svc_dg_control(xprt, rq, in)
 	case SVCSET_XP_RECV:
 	    xprt->xp_ops->xp_recv = *(xp_recv_t)in;
 	    break;
+	case SVCGET_XID:
+	    *(u_int32_t *)in = su_data(xprt)->su_xid;
+	    break;
+	case SVCSEND_DETACHED:
+	    return (svc_dg_send_detached(xprt,
+		(struct svc_detached_reply *)in));
 	default:
 	    return (FALSE);
 	}
 	return (TRUE);
 }
 
+/*
+ * Reply to a detached request (svc_req_detach).  su_xdrs and the
+ * buffer behind it belong to the request at hand, so encode into a
+ * buffer of our own.  The reply is not entered in the reply cache.
+ */
+static bool_t
+svc_dg_send_detached(xprt, dreply)
+	SVCXPRT *xprt;
+	struct svc_detached_reply *dreply;
+{
+	struct svc_dg_data *su = su_data(xprt);
+	struct rpc_msg *msg = dreply->msg;
+	XDR xdrs;
+	char *buf;
+	bool_t stat = FALSE;
+	size_t slen;
+
+	xdrproc_t xdr_results;
+	caddr_t xdr_location;
+	bool_t has_args;
+
+	if (msg->rm_reply.rp_stat == MSG_ACCEPTED &&
+	    msg->rm_reply.rp_acpt.ar_stat == SUCCESS) {
+		has_args = TRUE;
+		xdr_results = msg->acpted_rply.ar_results.proc;
+		xdr_location = msg->acpted_rply.ar_results.where;
+
+		msg->acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
+		msg->acpted_rply.ar_results.where = NULL;
+	} else
+		has_args = FALSE;
+
+	__SVC_TRACE_XID(SVC_TRACE_ENCODE, msg->rm_xid);
+	buf = mem_alloc(su->su_iosz);
+	if (buf == NULL)
+		return (FALSE);
+	xdrmem_create(&xdrs, buf, su->su_iosz, XDR_ENCODE);
+	if (xdr_replymsg(&xdrs, msg) &&
+	    (!has_args ||
+	     SVCAUTH_WRAP(dreply->auth, &xdrs, xdr_results, xdr_location))) {
+		slen = XDR_GETPOS(&xdrs);
+		__SVC_TRACE_XID(SVC_TRACE_SEND, msg->rm_xid);
+		if (sendto(xprt->xp_fd, buf, slen, 0,
+		    (struct sockaddr *)(void *)dreply->addr->buf,
+		    dreply->addr->len) == (ssize_t) slen)
+			stat = TRUE;
+		__SVC_TRACE_XID(SVC_TRACE_SENT, msg->rm_xid);
+	}
+	XDR_DESTROY(&xdrs);
+	mem_free(buf, su->su_iosz);
+	return (stat);
+}
+
 static void
 svc_dg_ops(xprt)
 	SVCXPRT *xprt;
@@ -365,11 +496,11 @@ svc_dg_ops(xprt)
 
 	mutex_lock(&ops_lock);
 	if (ops.xp_recv == NULL) {
-		ops.xp_recv = svc_dg_recv;
-		ops.xp_stat = svc_dg_stat;
-		ops.xp_getargs = svc_dg_getargs;
-		ops.xp_reply = svc_dg_reply;
-		ops.xp_freeargs = svc_dg_freeargs;
+		ops.xp_recv = __svc_dg_recv;
+		ops.xp_stat = __svc_dg_stat;
+		ops.xp_getargs = __svc_dg_getargs;
+		ops.xp_reply = __svc_dg_reply;
+		ops.xp_freeargs = __svc_dg_freeargs;
 		ops.xp_destroy = svc_dg_destroy;
 		ops2.xp_control = svc_dg_control;
 	}
@@ -496,15 +627,18 @@ svc_dg_enablecache(transp, size)
 	MEMZERO(uc->uc_fifo, cache_ptr, size);
 	su->su_cache = (char *)(void *)uc;
 	mutex_unlock(&dupreq_lock);
+	/* shard clones of transp have caches of their own */
+	if (su->su_sibling)
+		(void) svc_dg_enablecache(su->su_sibling, size);
 	return (1);
 }
 
 /*
  * Set an entry in the cache.  It assumes that the uc entry is set from
  * the earlier call to svc_dg_cache_get() for the same procedure.  This will
- * always happen because svc_dg_cache_get() is calle by svc_dg_recv and
- * svc_dg_cache_set() is called by svc_dg_reply().  All this hoopla because
- * the right RPC parameters are not available at svc_dg_reply time.
+ * always happen because svc_dg_cache_get() is calle by __svc_dg_recv and
+ * svc_dg_cache_set() is called by __svc_dg_reply().  All this hoopla because
+ * the right RPC parameters are not available at __svc_dg_reply time.
  */
 
 static const char cache_set_str[] = "cache_set: %s";
@@ -0,0 +1,229 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * svc_epoch.c, epoch-based deferred reclamation for the server side.
+ *
+ * Event threads find transports without taking a lock (the handle is
+ * carried in the epoll event), so a handle must stay readable until
+ * every thread which could have seen it has moved on.  Each event
+ * thread brackets its work with __svc_epoch_enter/__svc_epoch_exit;
+ * memory passed to __svc_epoch_free is released only when no thread
+ * is still inside an epoch at or before the one in which it was
+ * retired.
+ */
+#include <config.h>
+
+#include <pthread.h>
+#include <reentrant.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(TIRPC_EPOLL)
+#include <sys/epoll.h> /* before rpc.h */
+#endif
+#include <rpc/rpc.h>
+
+#include "rpc_com.h"
+
+struct svc_epoch_rec {
+	struct svc_epoch_rec *next;
+	volatile u_long epoch;		/* entered in, 0 => quiescent */
+	u_int depth;			/* nested __svc_epoch_enter */
+};
+
+struct svc_epoch_garbage {
+	struct svc_epoch_garbage *next;
+	u_long epoch;			/* retired in */
+	void *ptr;
+	size_t size;
+};
+
+/* protects svc_epoch_recs and svc_epoch_garbage */
+static mutex_t svc_epoch_lock = MUTEX_INITIALIZER;
+
+static volatile u_long svc_epoch = 1;
+static struct svc_epoch_rec *svc_epoch_recs;
+static struct svc_epoch_garbage *svc_epoch_garbage;
+
+static thread_key_t svc_epoch_key;
+static once_t svc_epoch_key_once = ONCE_INITIALIZER;
+
+static void svc_epoch_reclaim_locked(void);
+
+/*
+ * Register the calling thread as a reader.
+ */
+struct svc_epoch_rec *
+__svc_epoch_register(void)
+{
+	struct svc_epoch_rec *rec;
+
+	rec = mem_alloc(sizeof (struct svc_epoch_rec));
+	if (rec == NULL) {
+		__warnx("__svc_epoch_register: out of memory");
+		return (NULL);
+	}
+	rec->epoch = 0;
+	rec->depth = 0;
+	mutex_lock(&svc_epoch_lock);
+	rec->next = svc_epoch_recs;
+	svc_epoch_recs = rec;
+	mutex_unlock(&svc_epoch_lock);
+
+	return (rec);
+}
+
+void
+__svc_epoch_unregister(struct svc_epoch_rec *rec)
+{
+	struct svc_epoch_rec **prev;
+
+	if (rec == NULL)
+		return;
+
+	mutex_lock(&svc_epoch_lock);
+	for (prev = &svc_epoch_recs; *prev != NULL; prev = &(*prev)->next)
+		if (*prev == rec) {
+			*prev = rec->next;
+			break;
+		}
+	svc_epoch_reclaim_locked();
+	mutex_unlock(&svc_epoch_lock);
+	mem_free(rec, sizeof (struct svc_epoch_rec));
+}
+
+static void
+svc_epoch_key_init(void)
+{
+	thr_keycreate(&svc_epoch_key,
+	    (void (*)(void *))__svc_epoch_unregister);
+}
+
+/*
+ * The calling thread's record, registered on first use and
+ * unregistered when the thread exits.
+ */
+struct svc_epoch_rec *
+__svc_epoch_self(void)
+{
+	struct svc_epoch_rec *rec;
+
+	thr_once(&svc_epoch_key_once, svc_epoch_key_init);
+	rec = (struct svc_epoch_rec *)thr_getspecific(svc_epoch_key);
+	if (rec == NULL) {
+		rec = __svc_epoch_register();
+		if (rec != NULL)
+			thr_setspecific(svc_epoch_key, rec);
+	}
+	return (rec);
+}
+
+/*
+ * Begin a read-side section.  Pointers to retired objects obtained
+ * after this are valid until the matching __svc_epoch_exit.  Sections
+ * nest.
+ */
+void
+__svc_epoch_enter(struct svc_epoch_rec *rec)
+{
+	if (rec == NULL || rec->depth++ > 0)
+		return;
+	rec->epoch = svc_epoch;
+	/* publish our epoch before loading any shared pointer */
+	__sync_synchronize();
+}
+
+void
+__svc_epoch_exit(struct svc_epoch_rec *rec)
+{
+	if (rec == NULL || --rec->depth > 0)
+		return;
+	__sync_synchronize();
+	rec->epoch = 0;
+	if (svc_epoch_garbage != NULL)
+		__svc_epoch_reclaim();
+}
+
+/*
+ * Free ptr (of size bytes, from mem_alloc) once no reader can hold it.
+ * The caller has already made it unreachable.
+ */
+void
+__svc_epoch_free(void *ptr, size_t size)
+{
+	struct svc_epoch_garbage *g;
+
+	if (svc_epoch_recs == NULL) {
+		/* no lock-free readers */
+		mem_free(ptr, size);
+		return;
+	}
+	g = mem_alloc(sizeof (struct svc_epoch_garbage));
+	if (g == NULL) {
+		/* leaking is safe, freeing is not */
+		__warnx("__svc_epoch_free: out of memory");
+		return;
+	}
+	g->ptr = ptr;
+	g->size = size;
+
+	mutex_lock(&svc_epoch_lock);
+	g->epoch = __sync_fetch_and_add(&svc_epoch, 1);
+	g->next = svc_epoch_garbage;
+	svc_epoch_garbage = g;
+	mutex_unlock(&svc_epoch_lock);
+}
+
+void
+__svc_epoch_reclaim(void)
+{
+	if (mutex_trylock(&svc_epoch_lock) != 0)
+		return;	/* someone else is at it */
+	svc_epoch_reclaim_locked();
+	mutex_unlock(&svc_epoch_lock);
+}
+
+static void
+svc_epoch_reclaim_locked(void)
+{
+	struct svc_epoch_garbage **prev, *g;
+	struct svc_epoch_rec *rec;
+	u_long epoch, min_epoch = ULONG_MAX;
+
+	for (rec = svc_epoch_recs; rec != NULL; rec = rec->next) {
+		epoch = rec->epoch;
+		if (epoch != 0 && epoch < min_epoch)
+			min_epoch = epoch;
+	}
+
+	prev = &svc_epoch_garbage;
+	while ((g = *prev) != NULL) {
+		if (g->epoch < min_epoch) {
+			*prev = g->next;
+			mem_free(g->ptr, g->size);
+			mem_free(g, sizeof (struct svc_epoch_garbage));
+		} else
+			prev = &g->next;
+	}
+}
@@ -31,6 +31,8 @@
  * Copyright (c) 1986-1991 by Sun Microsystems Inc.
  */
 
+#include <config.h>
+
 /*
  * svc_generic.c, Server side for RPC.
  *
@@ -40,6 +42,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#if defined(TIRPC_EPOLL)
+#include <sys/epoll.h> /* before rpc.h */
+#endif
 #include <rpc/rpc.h>
 #include <rpc/nettype.h>
 #include <stdio.h>
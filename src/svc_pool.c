@@ -0,0 +1,636 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * svc_pool.c, a worker pool for pipelined calls.
+ *
+ * Normally an event thread decodes, dispatches and answers the calls
+ * on a connection one at a time, so a slow procedure holds up every
+ * call queued behind it.  With SVC_INIT_WORKERS, the event thread only
+ * cuts the complete records off a nonblocking connection and queues
+ * them;  workers decode and dispatch them concurrently, and replies go
+ * out in completion order (RPC matches them to calls by xid).
+ *
+ * Each call gets a shadow SVCXPRT, so that the per-request state the
+ * svc_req interfaces keep in the handle (xp_verf, xp_auth, the xid,
+ * the argument stream) is private to it.  The shadow holds a reference
+ * on the connection and sends through SVCSEND_DETACHED.
+ *
+ * Queued calls are scheduled (svc_sched_class):  by class first, then
+ * by deficit round robin over the clients with calls in that class.
+ */
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <pthread.h>
+#include <reentrant.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(TIRPC_EPOLL)
+#include <sys/epoll.h> /* before rpc.h */
+#endif
+#include <rpc/rpc.h>
+
+#include "rpc_com.h"
+
+extern SVCAUTH svc_auth_none;
+extern svc_params __svc_params[1];
+
+struct svc_pool_req {
+	struct svc_pool_req *next;
+	SVCXPRT xprt;			/* the shadow;  xp_p1 is us */
+	SVCXPRT *parent;		/* the connection */
+	XDR xdrs;			/* over rec */
+	struct svc_record rec;
+	u_int32_t xid;
+	u_int cls;			/* svc_sched_class */
+	struct timespec queued;
+	char verf_body[MAX_AUTH_BYTES];
+	char cred_area[2 * MAX_AUTH_BYTES + RQCRED_SIZE];
+};
+
+#define	SVC_POOL_REQ(xprt)	((struct svc_pool_req *)(xprt)->xp_p1)
+
+#define	SVC_SCHED_QUANTUM	8192	/* record bytes per client and round */
+#define	SVC_SCHED_NBUCKETS	64
+
+/*
+ * A client's calls of one class, in arrival order.  It exists while
+ * it has calls, and meanwhile takes its turn on its class's ring.
+ */
+struct svc_sched_flow {
+	struct svc_sched_flow *hnext;	/* hash chain */
+	struct svc_sched_flow *rnext;	/* ring */
+	struct svc_pool_req *head;
+	struct svc_pool_req *tail;
+	int deficit;			/* bytes it may take this round */
+	u_int keylen;
+	char key[16];			/* client address, less the port */
+};
+
+struct svc_sched_queue {
+	struct svc_sched_flow *rhead;	/* whose turn it is */
+	struct svc_sched_flow *rtail;
+	struct svc_sched_flow *flows[SVC_SCHED_NBUCKETS];
+	struct svc_sched_stat stat;
+};
+
+struct svc_sched_ent {
+	struct svc_sched_ent *next;
+	rpcprog_t prog;
+	rpcvers_t vers;
+	rpcproc_t proc;
+	u_int cls;
+};
+
+/* protects everything below */
+static mutex_t svc_pool_lock = MUTEX_INITIALIZER;
+static cond_t svc_pool_cv = PTHREAD_COND_INITIALIZER;
+
+static struct svc_sched_queue svc_sched_q[SVC_SCHED_CLASSES];
+static struct svc_sched_ent *svc_sched_tab[SVC_SCHED_NBUCKETS];
+static u_int svc_pool_queued;
+static pthread_t *svc_pool_threads;
+static int svc_pool_nthreads;
+static bool_t svc_pool_stopping;
+
+static bool_t svc_pool_recv(SVCXPRT *, struct rpc_msg *);
+static enum xprt_stat svc_pool_stat(SVCXPRT *);
+static bool_t svc_pool_getargs(SVCXPRT *, xdrproc_t, void *);
+static bool_t svc_pool_reply(SVCXPRT *, struct rpc_msg *);
+static bool_t svc_pool_freeargs(SVCXPRT *, xdrproc_t, void *);
+static void svc_pool_destroy(SVCXPRT *);
+static bool_t svc_pool_control(SVCXPRT *, const u_int, void *);
+
+static struct xp_ops svc_pool_ops = {
+	svc_pool_recv,
+	svc_pool_stat,
+	svc_pool_getargs,
+	svc_pool_reply,
+	svc_pool_freeargs,
+	svc_pool_destroy
+};
+
+static struct xp_ops2 svc_pool_ops2 = {
+	svc_pool_control
+};
+
+/*ARGSUSED*/
+static bool_t
+svc_pool_recv(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+	return (FALSE);	/* one call per shadow, decoded by svc_pool_run */
+}
+
+/*ARGSUSED*/
+static enum xprt_stat
+svc_pool_stat(SVCXPRT *xprt)
+{
+	return (XPRT_IDLE);
+}
+
+static bool_t
+svc_pool_getargs(SVCXPRT *xprt, xdrproc_t xdr_args, void *args_ptr)
+{
+	struct svc_pool_req *pr = SVC_POOL_REQ(xprt);
+	bool_t stat;
+
+	__SVC_TRACE(SVC_TRACE_GETARGS);
+	stat = SVCAUTH_UNWRAP(xprt->xp_auth, &pr->xdrs, xdr_args, args_ptr);
+	__SVC_TRACE(SVC_TRACE_EXEC);
+	return (stat);
+}
+
+static bool_t
+svc_pool_freeargs(SVCXPRT *xprt, xdrproc_t xdr_args, void *args_ptr)
+{
+	struct svc_pool_req *pr = SVC_POOL_REQ(xprt);
+
+	pr->xdrs.x_op = XDR_FREE;
+	return ((*xdr_args)(&pr->xdrs, args_ptr));
+}
+
+static bool_t
+svc_pool_reply(SVCXPRT *xprt, struct rpc_msg *msg)
+{
+	struct svc_pool_req *pr = SVC_POOL_REQ(xprt);
+	struct svc_detached_reply dreply;
+
+	if (pr->parent->xp_flags & SVC_XPORT_FLAG_DESTROYED)
+		return (FALSE);
+	msg->rm_xid = pr->xid;
+	dreply.msg = msg;
+	dreply.auth = xprt->xp_auth;
+	dreply.addr = &pr->parent->xp_rtaddr;
+	return (SVC_CONTROL(pr->parent, SVCSEND_DETACHED, &dreply));
+}
+
+/*
+ * A service destroying the handle it was called with means the
+ * connection.
+ */
+static void
+svc_pool_destroy(SVCXPRT *xprt)
+{
+	SVC_DESTROY(SVC_POOL_REQ(xprt)->parent);
+}
+
+static bool_t
+svc_pool_control(SVCXPRT *xprt, const u_int rq, void *in)
+{
+	struct svc_pool_req *pr = SVC_POOL_REQ(xprt);
+
+	switch (rq) {
+	case SVCGET_XID:
+		*(u_int32_t *)in = pr->xid;
+		return (TRUE);
+	case SVCTAKE_RECORD:
+	case SVCTAKE_RECBUF:
+	case SVCDONE_RECORD:
+		/* pr->rec lasts as long as the request */
+		return (FALSE);
+	default:
+		return (SVC_CONTROL(pr->parent, rq, in));
+	}
+}
+
+/* xp_dtor of the shadow */
+static void
+svc_pool_req_free(SVCXPRT *xprt)
+{
+	struct svc_pool_req *pr = SVC_POOL_REQ(xprt);
+
+	XDR_DESTROY(&pr->xdrs);
+	__svc_inflight_put(pr->parent);
+	__svc_xprt_unref(pr->parent);
+	__xdr_bufpool_put(pr->rec.buf, pr->rec.size);
+	mem_free(pr, sizeof (struct svc_pool_req));
+}
+
+static struct svc_pool_req *
+svc_pool_req_create(SVCXPRT *parent, struct svc_record *rec)
+{
+	struct svc_pool_req *pr;
+	SVCXPRT *xprt;
+
+	pr = mem_alloc(sizeof (struct svc_pool_req));
+	if (pr == NULL) {
+		__warnx("svc_pool_req_create: out of memory");
+		return (NULL);
+	}
+	if (!__svc_xprt_ref(parent)) {
+		mem_free(pr, sizeof (struct svc_pool_req));
+		return (NULL);
+	}
+	__svc_inflight_get(parent);
+	memset(pr, 0, sizeof (struct svc_pool_req));
+	pr->parent = parent;
+	pr->rec = *rec;
+	xdrmem_create(&pr->xdrs, pr->rec.buf, pr->rec.len, XDR_DECODE);
+
+	xprt = &pr->xprt;
+	xprt->xp_fd = parent->xp_fd;
+	xprt->xp_port = parent->xp_port;
+	xprt->xp_ops = &svc_pool_ops;
+	xprt->xp_ops2 = &svc_pool_ops2;
+	xprt->xp_addrlen = parent->xp_addrlen;
+	xprt->xp_raddr = parent->xp_raddr;
+	xprt->xp_tp = parent->xp_tp;
+	xprt->xp_netid = parent->xp_netid;
+	/* shallow:  the connection outlives us */
+	xprt->xp_ltaddr = parent->xp_ltaddr;
+	xprt->xp_rtaddr = parent->xp_rtaddr;
+	xprt->xp_verf.oa_base = pr->verf_body;
+	xprt->xp_auth = &svc_auth_none;
+	xprt->xp_p1 = pr;
+	xprt->xp_p3 = parent->xp_p3;
+	xprt->xp_type = parent->xp_type;
+	/* accounted on the parent (svc_req_detach) */
+	xprt->xp_flags = SVC_XPORT_FLAG_PIPELINE;
+	rwlock_init(&xprt->lock, NULL);
+	xprt->xp_refcnt = 1;
+	xprt->xp_dtor = svc_pool_req_free;
+
+	return (pr);
+}
+
+/*
+ * Decode and dispatch one call, as svc_getreq_xprt would.
+ */
+static void
+svc_pool_run(struct svc_pool_req *pr)
+{
+	struct svc_req r;
+	struct rpc_msg msg;
+
+	msg.rm_call.cb_cred.oa_base = pr->cred_area;
+	msg.rm_call.cb_verf.oa_base = &(pr->cred_area[MAX_AUTH_BYTES]);
+	r.rq_clntcred = &(pr->cred_area[2 * MAX_AUTH_BYTES]);
+
+	if (__svc_trace_on)
+		__svc_trace_begin(&pr->xprt);
+	if (!xdr_callmsg(&pr->xdrs, &msg)) {
+		/* garbage on a record stream, as in __svc_vc_recv */
+		SVC_DESTROY(pr->parent);
+	} else {
+		pr->xid = msg.rm_xid;
+		if (msg.rm_call.cb_cred.oa_flavor == RPCSEC_GSS) {
+			/* its context is bound to the connection handle */
+			svcerr_auth(&pr->xprt, AUTH_FAILED);
+		} else
+			__svc_dispatch(&pr->xprt, &msg, &r);
+	}
+	__svc_xprt_unref(&pr->xprt);
+}
+
+static u_int
+svc_sched_hash(const char *key, u_int len)
+{
+	u_int32_t h = 2166136261U;	/* FNV-1a */
+
+	while (len-- > 0)
+		h = (h ^ (u_char)*key++) * 16777619U;
+	return (h % SVC_SCHED_NBUCKETS);
+}
+
+#define	svc_sched_ent_hash(prog, vers, proc) \
+	(((prog) * 31 + (vers) * 7 + (proc)) % SVC_SCHED_NBUCKETS)
+
+/*
+ * Set the class of calls to (prog, vers, proc);  see svc.h.
+ */
+bool_t
+svc_sched_class(const rpcprog_t prog, const rpcvers_t vers,
+    const rpcproc_t proc, const u_int cls)
+{
+	struct svc_sched_ent *e;
+	u_int h = svc_sched_ent_hash(prog, vers, proc);
+
+	if (cls >= SVC_SCHED_CLASSES)
+		return (FALSE);
+	mutex_lock(&svc_pool_lock);
+	for (e = svc_sched_tab[h]; e != NULL; e = e->next)
+		if (e->prog == prog && e->vers == vers && e->proc == proc)
+			break;
+	if (e == NULL) {
+		e = mem_alloc(sizeof (struct svc_sched_ent));
+		if (e == NULL) {
+			mutex_unlock(&svc_pool_lock);
+			__warnx("svc_sched_class: out of memory");
+			return (FALSE);
+		}
+		e->prog = prog;
+		e->vers = vers;
+		e->proc = proc;
+		e->next = svc_sched_tab[h];
+		svc_sched_tab[h] = e;
+	}
+	e->cls = cls;
+	mutex_unlock(&svc_pool_lock);
+	return (TRUE);
+}
+
+/* svc_pool_lock held */
+static u_int
+svc_sched_classify(struct svc_record *rec)
+{
+	struct svc_sched_ent *e;
+	u_int32_t w[6];		/* xid, CALL, rpcvers, prog, vers, proc */
+
+	if (rec->len < sizeof (w))
+		return (SVC_SCHED_DEFAULT);	/* xdr_callmsg will fail */
+	memcpy(w, rec->buf, sizeof (w));
+	for (e = svc_sched_tab[svc_sched_ent_hash(ntohl(w[3]), ntohl(w[4]),
+	    ntohl(w[5]))]; e != NULL; e = e->next)
+		if (e->prog == ntohl(w[3]) && e->vers == ntohl(w[4]) &&
+		    e->proc == ntohl(w[5]))
+			return (e->cls);
+	return (w[5] == 0 ? SVC_SCHED_URGENT : SVC_SCHED_DEFAULT);
+}
+
+/* the client's address, less the port, which differs per connection */
+static u_int
+svc_sched_key(const struct netbuf *nb, char *key)
+{
+	const struct sockaddr *sa = (const struct sockaddr *)nb->buf;
+	u_int len;
+
+	if (nb->len >= sizeof (struct sockaddr_in6) &&
+	    sa->sa_family == AF_INET6) {
+		len = sizeof (struct in6_addr);
+		memcpy(key, &((const struct sockaddr_in6 *)sa)->sin6_addr, len);
+	} else if (nb->len >= sizeof (struct sockaddr_in) &&
+	    sa->sa_family == AF_INET) {
+		len = sizeof (struct in_addr);
+		memcpy(key, &((const struct sockaddr_in *)sa)->sin_addr, len);
+	} else {
+		len = nb->len < 16 ? nb->len : 16;
+		memcpy(key, nb->buf, len);
+	}
+	return (len);
+}
+
+/* svc_pool_lock held;  FALSE if out of memory */
+static bool_t
+svc_sched_enqueue(struct svc_pool_req *pr, const char *key, u_int keylen)
+{
+	struct svc_sched_queue *q = &svc_sched_q[pr->cls];
+	struct svc_sched_flow *f;
+	u_int h = svc_sched_hash(key, keylen);
+
+	for (f = q->flows[h]; f != NULL; f = f->hnext)
+		if (f->keylen == keylen && memcmp(f->key, key, keylen) == 0)
+			break;
+	if (f == NULL) {
+		f = mem_alloc(sizeof (struct svc_sched_flow));
+		if (f == NULL)
+			return (FALSE);
+		f->head = f->tail = NULL;
+		f->deficit = 0;
+		f->keylen = keylen;
+		memcpy(f->key, key, keylen);
+		f->hnext = q->flows[h];
+		q->flows[h] = f;
+		/* last in this round */
+		f->rnext = NULL;
+		if (q->rtail != NULL)
+			q->rtail->rnext = f;
+		else
+			q->rhead = f;
+		q->rtail = f;
+	}
+	pr->next = NULL;
+	if (f->tail != NULL)
+		f->tail->next = pr;
+	else
+		f->head = pr;
+	f->tail = pr;
+
+	svc_pool_queued++;
+	if (++q->stat.ss_queued > q->stat.ss_max_queued)
+		q->stat.ss_max_queued = q->stat.ss_queued;
+	return (TRUE);
+}
+
+/* svc_pool_lock held, svc_pool_queued > 0 */
+static struct svc_pool_req *
+svc_sched_dequeue(void)
+{
+	struct svc_sched_queue *q;
+	struct svc_sched_flow *f, **fp;
+	struct svc_pool_req *pr;
+	struct timespec now;
+	u_long wait;
+
+	for (q = svc_sched_q; q->rhead == NULL; q++)
+		;
+	for (;;) {
+		f = q->rhead;
+		pr = f->head;
+		if (f->deficit >= (int)pr->rec.len)
+			break;
+		/* its turn is over:  top up, to the back */
+		f->deficit += SVC_SCHED_QUANTUM;
+		if (f->rnext != NULL) {
+			q->rhead = f->rnext;
+			f->rnext = NULL;
+			q->rtail->rnext = f;
+			q->rtail = f;
+		}
+	}
+	f->deficit -= pr->rec.len;
+	if ((f->head = pr->next) == NULL) {
+		/* idle clients bank no credit */
+		if ((q->rhead = f->rnext) == NULL)
+			q->rtail = NULL;
+		for (fp = &q->flows[svc_sched_hash(f->key, f->keylen)];
+		    *fp != f; fp = &(*fp)->hnext)
+			;
+		*fp = f->hnext;
+		mem_free(f, sizeof (struct svc_sched_flow));
+	}
+
+	svc_pool_queued--;
+	q->stat.ss_queued--;
+	q->stat.ss_dispatched++;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait = (now.tv_sec - pr->queued.tv_sec) * 1000000 +
+	    (now.tv_nsec - pr->queued.tv_nsec) / 1000;
+	q->stat.ss_wait_usec += wait;
+	if (wait > q->stat.ss_max_wait_usec)
+		q->stat.ss_max_wait_usec = wait;
+	return (pr);
+}
+
+/*
+ * For rpc_control(RPC_SVC_SCHED_STATS_GET).
+ */
+void
+__svc_sched_stats(struct svc_sched_stat *stats)
+{
+	int c;
+
+	mutex_lock(&svc_pool_lock);
+	for (c = 0; c < SVC_SCHED_CLASSES; c++)
+		stats[c] = svc_sched_q[c].stat;
+	mutex_unlock(&svc_pool_lock);
+}
+
+static void *
+svc_pool_thread(void *arg)
+{
+	struct svc_pool_req *pr;
+
+	mutex_lock(&svc_pool_lock);
+	for (;;) {
+		while (svc_pool_queued == 0 && !svc_pool_stopping)
+			cond_wait(&svc_pool_cv, &svc_pool_lock);
+		/* drain the queue before going */
+		if (svc_pool_queued == 0)
+			break;
+		pr = svc_sched_dequeue();
+		mutex_unlock(&svc_pool_lock);
+		svc_pool_run(pr);
+		mutex_lock(&svc_pool_lock);
+	}
+	mutex_unlock(&svc_pool_lock);
+	return (NULL);
+}
+
+/* the pool not running, run pr here */
+static void
+svc_pool_enqueue(struct svc_pool_req *pr)
+{
+	char key[16];
+	u_int keylen;
+
+	keylen = svc_sched_key(&pr->parent->xp_rtaddr, key);
+	clock_gettime(CLOCK_MONOTONIC, &pr->queued);
+	mutex_lock(&svc_pool_lock);
+	pr->cls = svc_sched_classify(&pr->rec);
+	if (svc_pool_nthreads == 0 || svc_pool_stopping ||
+	    !svc_sched_enqueue(pr, key, keylen)) {
+		mutex_unlock(&svc_pool_lock);
+		svc_pool_run(pr);
+		return;
+	}
+	cond_signal(&svc_pool_cv);
+	mutex_unlock(&svc_pool_lock);
+}
+
+/*
+ * Queue every complete call on xprt (SVC_XPORT_FLAG_PIPELINE), for
+ * svc_getreq_xprt.  FALSE when the connection is to be destroyed.
+ */
+bool_t
+__svc_pool_getreq(SVCXPRT *xprt)
+{
+	struct svc_pool_req *pr;
+	struct svc_record rec;
+	enum xprt_stat stat;
+
+	do {
+		while (SVC_CONTROL(xprt, SVCTAKE_RECORD, &rec)) {
+			if ((pr = svc_pool_req_create(xprt, &rec)) == NULL) {
+				__xdr_bufpool_put(rec.buf, rec.size);
+				return (FALSE);
+			}
+			svc_pool_enqueue(pr);
+			/* the rest stays in the socket:  see svc_throttle */
+			if (__svc_inflight_full(xprt))
+				return (TRUE);
+		}
+		(void) SVC_CONTROL(xprt, SVCDONE_RECORD, NULL);
+		if ((stat = __SVC_STAT(xprt)) == XPRT_DIED)
+			return (FALSE);
+	} while (stat == XPRT_MOREREQS);
+
+	return (TRUE);
+}
+
+/*
+ * Start __svc_params->nworkers workers, if not already running.
+ */
+void
+__svc_pool_start(void)
+{
+	int n, nworkers = __svc_params->nworkers;
+
+	if (nworkers <= 0)
+		return;
+	mutex_lock(&svc_pool_lock);
+	if (svc_pool_nthreads > 0) {
+		mutex_unlock(&svc_pool_lock);
+		return;
+	}
+	svc_pool_threads = mem_alloc(nworkers * sizeof (pthread_t));
+	if (svc_pool_threads == NULL) {
+		mutex_unlock(&svc_pool_lock);
+		__warnx("__svc_pool_start: out of memory");
+		return;
+	}
+	svc_pool_stopping = FALSE;
+	for (n = 0; n < nworkers; n++)
+		if (pthread_create(&svc_pool_threads[n], NULL,
+		    svc_pool_thread, NULL) != 0) {
+			__warnx("__svc_pool_start: pthread_create failed");
+			break;
+		}
+	svc_pool_nthreads = n;
+	mutex_unlock(&svc_pool_lock);
+}
+
+/*
+ * Stop the workers once the queue is empty.  Calls arriving after
+ * this run on the event thread.
+ */
+void
+__svc_pool_stop(void)
+{
+	pthread_t *threads;
+	int n, nthreads;
+
+	mutex_lock(&svc_pool_lock);
+	if (svc_pool_nthreads == 0 || svc_pool_stopping) {
+		mutex_unlock(&svc_pool_lock);
+		return;
+	}
+	threads = svc_pool_threads;
+	nthreads = svc_pool_nthreads;
+	svc_pool_stopping = TRUE;
+	cond_broadcast(&svc_pool_cv);
+	mutex_unlock(&svc_pool_lock);
+
+	for (n = 0; n < nthreads; n++)
+		pthread_join(threads[n], NULL);
+
+	mutex_lock(&svc_pool_lock);
+	svc_pool_threads = NULL;
+	svc_pool_nthreads = 0;
+	mutex_unlock(&svc_pool_lock);
+	mem_free(threads, __svc_params->nworkers * sizeof (pthread_t));
+}
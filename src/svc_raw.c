@@ -30,6 +30,8 @@
  * Copyright (c) 1986-1991 by Sun Microsystems Inc. 
  */
 
+#include <config.h>
+
 /*
  * svc_raw.c,   This a toy for simple testing and timing.
  * Interface to create an rpc client and server in the same UNIX process.
@@ -39,6 +41,9 @@
  */
 #include <pthread.h>
 #include <reentrant.h>
+#if defined(TIRPC_EPOLL)
+#include <sys/epoll.h> /* before rpc.h */
+#endif
 #include <rpc/rpc.h>
 #include <sys/types.h>
 #include <rpc/raw.h>
@@ -34,10 +34,15 @@
 
 #include <pthread.h>
 #include <reentrant.h>
+#include <sched.h>
 #include <err.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined(TIRPC_EPOLL)
@@ -52,7 +57,7 @@ extern svc_params __svc_params[1];
 static void
 svc_run_select()
 {
-	fd_set readfds, cleanfds;
+	fd_set readfds;
 	struct timeval timeout;
 	extern rwlock_t svc_fd_lock;
 
@@ -60,7 +65,6 @@ svc_run_select()
 	for (;;) {
 		rwlock_rdlock(&svc_fd_lock);
 		readfds = svc_fdset;
-		cleanfds = svc_fdset;
 		rwlock_unlock(&svc_fd_lock);
 		timeout.tv_sec = 30;
 		timeout.tv_usec = 0;
@@ -73,7 +77,11 @@ svc_run_select()
 			warn("svc_run: - select failed");
 			return;
 		case 0:
-			__svc_clean_idle(&cleanfds, 30, FALSE);
+			/* the idle queues hold just the registered
+			 * connections, so there is no fd_set to filter by */
+			if (__svc_params->idle_timeout != 0)
+				__svc_clean_idle2(__svc_params->idle_timeout,
+				    FALSE);
 			continue;
 		default:
 			svc_getreqset(&readfds);
@@ -83,43 +91,285 @@ svc_run_select()
 
 #if defined(TIRPC_EPOLL)
 
-/* static */ void
-svc_run_epoll()
+/* set by svc_exit, cleared when svc_run_epoll returns */
+static volatile sig_atomic_t svc_run_exiting;
+
+static volatile time_t svc_idle_reaped;
+
+/*
+ * Reap idle connections about once a second, busy or not;  whichever
+ * event thread notices the second change does it.  The idle queues
+ * make this cost O(expired), not O(connections).
+ */
+static void
+svc_run_epoll_idle(void)
+{
+    time_t last, now;
+
+    if (__svc_params->idle_timeout == 0)
+        return;
+    now = time(NULL);
+    last = svc_idle_reaped;
+    if ((now != last) &&
+        __sync_bool_compare_and_swap(&svc_idle_reaped, last, now))
+        __svc_clean_idle2(__svc_params->idle_timeout, FALSE);
+}
+
+static void
+svc_run_epoll_rearm(struct svc_epoll_shard *sh)
+{
+    struct epoll_event ev;
+
+    if (__svc_params->ev_type == SVC_EVENT_URING) {
+        __svc_uring_arm_wake(sh);
+        return;
+    }
+    if (__svc_params->ev_u.epoll.nthreads < 2)
+        return;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_MOD, sh->wake_fd, &ev) == -1)
+        __warnx("svc_run: rearm eventfd failed (errno %d)", errno);
+}
+
+/*
+ * Run the work posted to shard sh (__svc_work_post), oldest first.
+ */
+static void
+svc_run_epoll_work(struct svc_epoll_shard *sh)
+{
+    struct svc_work *w, *next, *fifo;
+
+    /* posted newest first */
+    fifo = NULL;
+    for (w = __sync_lock_test_and_set(&sh->work, NULL); w; w = next) {
+        next = w->next;
+        w->next = fifo;
+        fifo = w;
+    }
+    for (w = fifo; w; w = next) {
+        next = w->next;
+        (*w->fn)(w->arg);
+    }
+}
+
+/*
+ * The shard's eventfd fired:  svc_exit, svc_wakeup or __svc_work_post.
+ * Returns FALSE if the loop is to exit.
+ */
+static bool_t
+svc_run_epoll_wake(struct svc_epoll_shard *sh)
 {
+    uint64_t count;
+
+    if (svc_run_exiting) {
+        /* leave the count up, so the next thread wakes in turn */
+        svc_run_epoll_rearm(sh);
+        return (FALSE);
+    }
+    (void) read(sh->wake_fd, &count, sizeof(count));
+    svc_run_epoll_rearm(sh);
+    svc_run_epoll_work(sh);
+    return (TRUE);
+}
+
+/*
+ * Wait up to timeout_ms for shard sh's events, and enter rec's epoch.
+ *
+ * Epoll events carry the SVCXPRT itself, so they are only taken from
+ * the set inside the epoch:  a handle unregistered after that is not
+ * freed under the caller (svc_epoch.c), and one unregistered before
+ * is not in them.  Blocking, which may last indefinitely, is done
+ * outside it, in poll on the epoll fd, so that an idle thread does not
+ * hold back reclamation.  Under load the first epoll_wait has events,
+ * and there is no poll.
+ *
+ * io_uring completions come with the reference their request held, so
+ * __svc_uring_wait needs no epoch.
+ */
+static int
+svc_run_epoll_wait(struct svc_epoll_shard *sh, struct epoll_event *events,
+                   struct svc_epoch_rec *rec, int timeout_ms)
+{
+    struct pollfd pfd;
     int nfds;
-    int timeout_s = 30;
-    fd_set cleanfds; /* XXX adapt for epoll */
-    extern rwlock_t svc_fd_lock;
 
-    if (! __svc_params->ev_u.epoll.events)
-        __svc_params->ev_u.epoll.events =
-            (struct epoll_event *) mem_alloc(
-                __svc_params->ev_u.epoll.max_events * 
-                sizeof(struct epoll_event));
+    if (__svc_params->ev_type == SVC_EVENT_URING) {
+        nfds = __svc_uring_wait(sh, events,
+                                __svc_params->ev_u.epoll.max_events,
+                                timeout_ms);
+        __svc_epoch_enter(rec);
+        return (nfds);
+    }
+    __svc_epoch_enter(rec);
+    nfds = epoll_wait(sh->epoll_fd, events,
+                      __svc_params->ev_u.epoll.max_events, 0);
+    if (nfds != 0 || timeout_ms == 0)
+        return (nfds);
+    __svc_epoch_exit(rec);
+    pfd.fd = sh->epoll_fd;
+    pfd.events = POLLIN;
+    nfds = poll(&pfd, 1, timeout_ms);
+    __svc_epoch_enter(rec);
+    if (nfds > 0)
+        nfds = epoll_wait(sh->epoll_fd, events,
+                          __svc_params->ev_u.epoll.max_events, 0);
+    return (nfds);
+}
 
-    for (;;) {
-        rwlock_rdlock(&svc_fd_lock);
-        cleanfds = svc_fdset;
-        rwlock_unlock(&svc_fd_lock);
-        switch (nfds = epoll_wait(
-                    __svc_params->ev_u.epoll.epoll_fd,
-                    __svc_params->ev_u.epoll.events, 
-                    __svc_params->ev_u.epoll.max_events, 
-                    timeout_s)) {
+/*
+ * One epoll event loop on shard sh.  Several of these may run
+ * concurrently on the same epoll set (SVC_INIT_THREADS);  transports
+ * are then registered EPOLLONESHOT, so each event is delivered to
+ * exactly one thread.  The loop is in an epoch from taking events
+ * until they are consumed (svc_run_epoll_wait).
+ *
+ * With SVC_EVENT_URING, __svc_uring_wait takes the place of epoll_wait.
+ */
+static void
+svc_run_epoll_thread(struct svc_epoll_shard *sh, struct epoll_event *events)
+{
+    struct svc_epoch_rec *rec;
+    bool_t woken;
+    int ix, nfds;
+    /* ms;  wakeups are explicit, so only idle reaping needs a tick */
+    int timeout_ms = (__svc_params->idle_timeout != 0) ? 1000 : -1;
+
+    __svc_shard_enter(sh);
+    rec = __svc_epoch_self();
+
+    while (! svc_run_exiting) {
+        woken = FALSE;
+        nfds = svc_run_epoll_wait(sh, events, rec, timeout_ms);
+        switch (nfds) {
         case -1:
+            __svc_epoch_exit(rec);
             if (errno == EINTR)
                 continue;
             /* XXX epoll_ctl del all events ? */
             __pkg_params.warnx("svc_run: epoll_wait failed %d", nfds);
             return;
         case 0:
-            __svc_clean_idle2(30, FALSE);
-            continue;
+            break;
         default:
-            svc_getreqset_epoll(__svc_params->ev_u.epoll.events, nfds);
+            for (ix = 0; ix < nfds; ++ix)
+                if (events[ix].data.ptr == NULL) {
+                    /* the eventfd;  there is only one */
+                    events[ix] = events[--nfds];
+                    woken = TRUE;
+                    break;
+                }
+            svc_getreqset_epoll(events, nfds);
+            if (woken && ! svc_run_epoll_wake(sh)) {
+                __svc_epoch_exit(rec);
+                return;
+            }
         } /* switch */
+        __svc_epoch_exit(rec);
+        svc_run_epoll_idle();
     } /* ;; */
 }
+
+static void *
+svc_run_epoll_worker(void *arg)
+{
+    struct svc_epoll_shard *sh = (struct svc_epoll_shard *) arg;
+    struct epoll_event *events;
+    cpu_set_t cpus;
+    int cpu, n, ncpu;
+
+    /* with one shard per cpu, keep each shard's threads on its cpu:
+     * the sh->id'th of those we may run on (a cpuset may leave out
+     * any), or none if that cannot be had */
+    if ((__svc_params->ev_u.epoll.nshards > 1) &&
+        (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) &&
+        ((ncpu = CPU_COUNT(&cpus)) > 1)) {
+        n = sh->id % ncpu;
+        for (cpu = 0; ; ++cpu)
+            if (CPU_ISSET(cpu, &cpus) && (n-- == 0))
+                break;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            __warnx("svc_run: could not pin shard %u to cpu %d",
+                    sh->id, cpu);
+    }
+
+    events = (struct epoll_event *) mem_alloc(
+        __svc_params->ev_u.epoll.max_events * sizeof(struct epoll_event));
+    if (! events) {
+        __warnx("svc_run: epoll worker events allocation failure");
+        return (NULL);
+    }
+    svc_run_epoll_thread(sh, events);
+    mem_free(events,
+             __svc_params->ev_u.epoll.max_events * sizeof(struct epoll_event));
+
+    return (NULL);
+}
+
+/* static */ void
+svc_run_epoll()
+{
+    pthread_t *workers = NULL;
+    u_int ix, nworkers = 0, nthreads;
+
+    if (! __svc_params->ev_u.epoll.events)
+        __svc_params->ev_u.epoll.events =
+            (struct epoll_event *) mem_alloc(
+                __svc_params->ev_u.epoll.max_events * 
+                sizeof(struct epoll_event));
+
+    /* SVC_INIT_WORKERS:  pipelined calls (svc_pool.c) */
+    __svc_pool_start();
+
+    /* the calling thread is event thread 0 (of shard 0);  the others
+     * are dealt round the shards */
+    nthreads = __svc_params->ev_u.epoll.nthreads *
+        __svc_params->ev_u.epoll.nshards;
+    if (nthreads > 1) {
+        workers = (pthread_t *) mem_alloc((nthreads - 1) * sizeof(pthread_t));
+        if (! workers)
+            __warnx("svc_run: epoll workers allocation failure");
+        else {
+            for (ix = 0; ix < nthreads - 1; ++ix) {
+                if (pthread_create(&workers[ix], NULL, svc_run_epoll_worker,
+                                   &__svc_params->ev_u.epoll.shards[
+                                       (ix + 1) %
+                                       __svc_params->ev_u.epoll.nshards])
+                    != 0) {
+                    __warnx("svc_run: could not start epoll worker %u", ix);
+                    break;
+                }
+            }
+            nworkers = ix;
+        }
+    }
+
+    svc_run_epoll_thread(&__svc_params->ev_u.epoll.shards[0],
+                         __svc_params->ev_u.epoll.events);
+
+    for (ix = 0; ix < nworkers; ++ix)
+        (void) pthread_join(workers[ix], NULL);
+    if (workers)
+        mem_free(workers, (nthreads - 1) * sizeof(pthread_t));
+    /* after the event threads, which feed it */
+    __svc_pool_stop();
+
+    /* all event threads are gone:  a later svc_run starts afresh.
+     * Work posted and not yet run is run now, or __svc_work_post,
+     * finding the queue non-empty, would never wake a shard again;
+     * work posted from here on wakes it as usual. */
+    for (ix = 0; ix < __svc_params->ev_u.epoll.nshards; ++ix) {
+        uint64_t count;
+        (void) read(__svc_params->ev_u.epoll.shards[ix].wake_fd,
+                    &count, sizeof(count));
+        while (__svc_params->ev_u.epoll.shards[ix].work != NULL)
+            svc_run_epoll_work(&__svc_params->ev_u.epoll.shards[ix]);
+    }
+    svc_run_exiting = 0;
+}
 #endif /* TIRPC_EPOLL */
 
 void
@@ -128,6 +378,7 @@ svc_run()
     switch (__svc_params->ev_type) {
 #if defined(TIRPC_EPOLL)
     case SVC_EVENT_EPOLL:
+    case SVC_EVENT_URING:
         return (svc_run_epoll());
         break;
 #endif
@@ -140,23 +391,51 @@ svc_run()
 /*
  *      This function causes svc_run() to exit by telling it that it has no
  *      more work to do.
+ *
+ *      With epoll, every event thread returns once done with the events
+ *      at hand, and svc_run returns when all have;  this takes no locks,
+ *      so may be called from a signal handler.
  */
 void
 svc_exit()
 {
     extern rwlock_t svc_fd_lock;
+#if defined(TIRPC_EPOLL)
+    u_int ix;
+#endif
 
-    rwlock_wrlock(&svc_fd_lock);
     switch (__svc_params->ev_type) {
 #if defined(TIRPC_EPOLL)
     case SVC_EVENT_EPOLL:
-        /* XXXX need to actually signal svc_run */
-        close(__svc_params->ev_u.epoll.epoll_fd);
+    case SVC_EVENT_URING:
+        svc_run_exiting = 1;
+        /* the eventfds stay readable:  each woken thread passes the
+         * wakeup on (svc_run_epoll_wake) */
+        for (ix = 0; ix < __svc_params->ev_u.epoll.nshards; ++ix)
+            __svc_shard_wake(&__svc_params->ev_u.epoll.shards[ix]);
         break;
 #endif
     default:
+        rwlock_wrlock(&svc_fd_lock);
 	FD_ZERO(&svc_fdset);
+        rwlock_unlock(&svc_fd_lock);
         break;
     } /* switch */
-    rwlock_unlock(&svc_fd_lock);
+}
+
+/*
+ *      Interrupt the event loop(s) in svc_run, e.g. so that they notice
+ *      work queued from another thread.  A no-op without epoll, which
+ *      polls svc_fdset.
+ */
+void
+svc_wakeup()
+{
+#if defined(TIRPC_EPOLL)
+    u_int ix;
+
+    if (__svc_ev_epoll(__svc_params))
+        for (ix = 0; ix < __svc_params->ev_u.epoll.nshards; ++ix)
+            __svc_shard_wake(&__svc_params->ev_u.epoll.shards[ix]);
+#endif
 }
@@ -0,0 +1,274 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * svc_trace.c, per-request phase timestamps (svc_trace_enable).
+ *
+ * Each serving thread has a ring:  the request in progress is built
+ * in its cur record, by __svc_trace_begin, __svc_trace_call and the
+ * __SVC_TRACE marks on the way, and is appended to the ring by
+ * __svc_trace_end.  Only the owner writes cur, so marks take no lock;
+ * the ring proper has a mutex, which svc_trace_drain takes too.
+ *
+ * The reply phases are marked by the transports' send paths, which
+ * may run on behalf of a detached request in a thread serving some
+ * other one, so those marks go by xid (__SVC_TRACE_XID).  All hooks
+ * run only while __svc_trace_on, which svc_trace_enable sets after
+ * creating svc_trace_key.
+ *
+ * With <sys/sdt.h>, each mark is also the USDT probe
+ * libtirpc:svc_trace(phase, xid, ns).
+ */
+#include <config.h>
+
+#include <pthread.h>
+#include <reentrant.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#if defined(TIRPC_EPOLL)
+#include <sys/epoll.h> /* before rpc.h */
+#endif
+#include <rpc/rpc.h>
+
+#include "rpc_com.h"
+
+#define	SVC_TRACE_RING	256	/* records kept per thread */
+
+struct svc_trace_ring {
+	struct svc_trace_ring *next;	/* svc_trace_rings */
+	u_int active;			/* svc_trace_gen if cur is live */
+	struct svc_trace cur;
+	mutex_t lock;			/* head, tail, recs */
+	u_int head;			/* records appended, ever */
+	u_int tail;			/* ... and drained or overwritten */
+	struct svc_trace recs[SVC_TRACE_RING];
+};
+
+volatile int __svc_trace_on;
+
+/* bumped by svc_trace_enable, so records left open when tracing was
+ * turned off are not picked up again */
+static volatile u_int svc_trace_gen;
+
+static svc_trace_cb_t svc_trace_cb;
+static void *svc_trace_cb_arg;
+
+/* protects svc_trace_rings */
+static mutex_t svc_trace_lock = MUTEX_INITIALIZER;
+static struct svc_trace_ring *svc_trace_rings;
+
+static thread_key_t svc_trace_key;
+static once_t svc_trace_key_once = ONCE_INITIALIZER;
+
+/* at thread exit */
+static void
+svc_trace_ring_free(void *arg)
+{
+	struct svc_trace_ring *ring = arg, **prev;
+
+	mutex_lock(&svc_trace_lock);
+	for (prev = &svc_trace_rings; *prev != NULL; prev = &(*prev)->next)
+		if (*prev == ring) {
+			*prev = ring->next;
+			break;
+		}
+	mutex_unlock(&svc_trace_lock);
+	mem_free(ring, sizeof (struct svc_trace_ring));
+}
+
+static void
+svc_trace_key_init(void)
+{
+	thr_keycreate(&svc_trace_key, svc_trace_ring_free);
+}
+
+/* the calling thread's ring, or NULL if out of memory */
+static struct svc_trace_ring *
+svc_trace_ring(void)
+{
+	struct svc_trace_ring *ring;
+
+	thr_once(&svc_trace_key_once, svc_trace_key_init);
+	ring = (struct svc_trace_ring *)thr_getspecific(svc_trace_key);
+	if (ring != NULL)
+		return (ring);
+	ring = mem_alloc(sizeof (struct svc_trace_ring));
+	if (ring == NULL)
+		return (NULL);
+	memset(ring, 0, sizeof (struct svc_trace_ring));
+	mutex_init(&ring->lock, NULL);
+	thr_setspecific(svc_trace_key, ring);
+	mutex_lock(&svc_trace_lock);
+	ring->next = svc_trace_rings;
+	svc_trace_rings = ring;
+	mutex_unlock(&svc_trace_lock);
+	return (ring);
+}
+
+static u_int64_t
+svc_trace_now(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+svc_trace_stamp(struct svc_trace_ring *ring, u_int phase)
+{
+	ring->cur.st_ns[phase] = svc_trace_now();
+#ifdef HAVE_SYS_SDT_H
+	DTRACE_PROBE3(libtirpc, svc_trace, phase, ring->cur.st_xid,
+	    ring->cur.st_ns[phase]);
+#endif
+}
+
+void
+svc_trace_enable(bool_t on, svc_trace_cb_t cb, void *arg)
+{
+	thr_once(&svc_trace_key_once, svc_trace_key_init);
+	mutex_lock(&svc_trace_lock);
+	__svc_trace_on = 0;
+	svc_trace_cb = cb;
+	svc_trace_cb_arg = arg;
+	if (++svc_trace_gen == 0)
+		svc_trace_gen = 1;
+	__svc_trace_on = on ? 1 : 0;
+	mutex_unlock(&svc_trace_lock);
+}
+
+/*
+ * Start a record:  the calling thread is about to receive a call on
+ * xprt.  Nothing is kept unless __svc_trace_call follows.
+ */
+void
+__svc_trace_begin(SVCXPRT *xprt)
+{
+	struct svc_trace_ring *ring;
+
+	if ((ring = svc_trace_ring()) == NULL)
+		return;
+	memset(&ring->cur, 0, sizeof (struct svc_trace));
+	ring->cur.st_fd = xprt->xp_fd;
+	ring->active = svc_trace_gen;
+	svc_trace_stamp(ring, SVC_TRACE_RECV);
+}
+
+/*
+ * A call was received (msg), and is about to be authenticated.
+ */
+void
+__svc_trace_call(struct rpc_msg *msg)
+{
+	struct svc_trace_ring *ring;
+
+	if ((ring = svc_trace_ring()) == NULL)
+		return;
+	if (ring->active != svc_trace_gen) {
+		/* no __svc_trace_begin, e.g. tracing was off then */
+		memset(&ring->cur, 0, sizeof (struct svc_trace));
+		ring->cur.st_fd = -1;
+		ring->active = svc_trace_gen;
+	}
+	ring->cur.st_xid = msg->rm_xid;
+	ring->cur.st_prog = msg->rm_call.cb_prog;
+	ring->cur.st_vers = msg->rm_call.cb_vers;
+	ring->cur.st_proc = msg->rm_call.cb_proc;
+	svc_trace_stamp(ring, SVC_TRACE_AUTH);
+}
+
+void
+__svc_trace_mark(u_int phase)
+{
+	struct svc_trace_ring *ring;
+
+	ring = (struct svc_trace_ring *)thr_getspecific(svc_trace_key);
+	if ((ring != NULL) && (ring->active == svc_trace_gen))
+		svc_trace_stamp(ring, phase);
+}
+
+/* the same, if the request being served is xid */
+void
+__svc_trace_mark_xid(u_int phase, u_int32_t xid)
+{
+	struct svc_trace_ring *ring;
+
+	ring = (struct svc_trace_ring *)thr_getspecific(svc_trace_key);
+	if ((ring != NULL) && (ring->active == svc_trace_gen) &&
+	    (ring->cur.st_xid == xid))
+		svc_trace_stamp(ring, phase);
+}
+
+/*
+ * The dispatch routine returned:  file the record.
+ */
+void
+__svc_trace_end(void)
+{
+	struct svc_trace_ring *ring;
+	svc_trace_cb_t cb;
+
+	ring = (struct svc_trace_ring *)thr_getspecific(svc_trace_key);
+	if ((ring == NULL) || (ring->active != svc_trace_gen))
+		return;
+	ring->active = 0;
+	svc_trace_stamp(ring, SVC_TRACE_DONE);
+
+	mutex_lock(&ring->lock);
+	ring->recs[ring->head % SVC_TRACE_RING] = ring->cur;
+	if (++ring->head - ring->tail > SVC_TRACE_RING)
+		ring->tail = ring->head - SVC_TRACE_RING;	/* overwritten */
+	mutex_unlock(&ring->lock);
+
+	cb = svc_trace_cb;
+	if (cb != NULL)
+		(*cb)(&ring->cur, svc_trace_cb_arg);
+}
+
+/*
+ * Copy up to max records, oldest first per thread, into recs, and
+ * forget them.
+ */
+u_int
+svc_trace_drain(struct svc_trace *recs, u_int max)
+{
+	struct svc_trace_ring *ring;
+	u_int n = 0;
+
+	mutex_lock(&svc_trace_lock);
+	for (ring = svc_trace_rings; (ring != NULL) && (n < max);
+	    ring = ring->next) {
+		mutex_lock(&ring->lock);
+		while ((ring->tail != ring->head) && (n < max))
+			recs[n++] = ring->recs[ring->tail++ % SVC_TRACE_RING];
+		mutex_unlock(&ring->lock);
+	}
+	mutex_unlock(&svc_trace_lock);
+
+	return (n);
+}
@@ -0,0 +1,1319 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * svc_uring.c, the io_uring event engine (SVC_EVENT_URING).
+ *
+ * It is the epoll engine with io_uring underneath:  the same shards,
+ * event threads and svc_run loop, fed epoll_events made from
+ * completions.  A transport is delivered to one event thread at a
+ * time, as if registered EPOLLONESHOT, and armed again when that
+ * thread is done (svc_rearm_epoll).  An event thread queues what it
+ * arms, and its next io_uring_enter submits all it has queued while
+ * waiting for completions.
+ *
+ * Nonblocking connections and their listeners do their I/O through
+ * the ring as well (ring I/O, SVC_XPORT_FLAG_URING):
+ * - a connection has a multishot IORING_OP_RECV outstanding, which
+ *   receives into the shard's provided buffer ring;  read_vc copies
+ *   out of the buffers received (__svc_uring_read), and gives them
+ *   back;
+ * - a listener has a multishot IORING_OP_ACCEPT outstanding, and
+ *   rendezvous_request takes the connections it accepted
+ *   (__svc_uring_accept);
+ * - replies are copied and queued (__svc_uring_send), and an event
+ *   thread submits those of a connection as a chain of linked
+ *   IORING_OP_SENDs, one chain at a time, so they go out in order.
+ * So under load a request costs no syscall of its own:  one
+ * io_uring_enter submits and reaps for many.
+ *
+ * Completions come in while the transport is being served;  they are
+ * kept with it (struct svc_uring_io) until it is armed again, when it
+ * is delivered at once if they concern it.  Ring I/O needs provided
+ * buffer rings (Linux 5.19);  without them, and for other transports
+ * (svc_dg, blocking connections), there are one-shot IORING_OP_POLL_ADDs
+ * instead, and the transport does its own I/O.  If the kernel turns
+ * down multishot recv or accept, its transports are polled likewise.
+ *
+ * A request holds a reference on its transport, so a completion never
+ * names a freed handle;  the reference passes to the event thread
+ * (svc_getreqset_epoll), or is dropped when the request ends.
+ */
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <reentrant.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(TIRPC_EPOLL)
+#include <sys/epoll.h> /* before rpc.h */
+#endif
+#include <rpc/rpc.h>
+
+#include "rpc_com.h"
+
+#if defined(TIRPC_EPOLL) && defined(HAVE_LINUX_IO_URING_H)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+extern svc_params __svc_params[1];
+
+#define	SVC_URING_SQ_ENTRIES	256
+#define	SVC_URING_CQ_ENTRIES	4096
+
+/* provided buffers, per shard;  a power of two */
+#define	SVC_URING_NBUFS		256
+#define	SVC_URING_BUFSZ		8192
+#define	SVC_URING_BGID		0
+
+/* sends of a connection linked in one chain, at most */
+#define	SVC_URING_CHAIN		16
+
+/* completions taken per wait, at most */
+#define	SVC_URING_REAP		128
+
+/*
+ * user_data:  0 for the eventfd's poll, SVC_URING_CANCEL for
+ * cancellations (ignored), an SVCXPRT for a poll, or else a struct
+ * svc_uring_io or svc_uring_ob with what it is for in its low bits.
+ */
+#define	SVC_URING_CANCEL	((u_int64_t)1)
+#define	SVC_URING_POLL		1	/* io:  poll */
+#define	SVC_URING_RECV		2	/* io:  multishot recv or accept */
+#define	SVC_URING_SEND		3	/* ob:  send */
+#define	SVC_URING_TAGS		((u_int64_t)7)
+
+/* a request svc_uring_queue could not put in the full submission queue */
+struct svc_uring_pend {
+	struct io_uring_sqe sqe;
+};
+
+/* a provided buffer holding data received, by buffer id */
+struct svc_uring_chunk {
+	int next;			/* id, or -1 */
+	u_int len;
+	u_int off;			/* read already */
+};
+
+/* a connection accepted by a multishot accept */
+struct svc_uring_fd {
+	struct svc_uring_fd *next;
+	int fd;
+};
+
+/* a reply, or part of one, to send;  data follows the header */
+struct svc_uring_ob {
+	struct svc_uring_ob *next;
+	struct svc_uring_io *io;
+	u_int len;
+};
+
+/*
+ * Ring I/O of a transport (SVC_XPORT_FLAG_URING).  Under its shard's
+ * cq_lock, but for what is set up by __svc_uring_attach.
+ */
+struct svc_uring_io {
+	SVCXPRT *xprt;
+	bool_t accept;			/* a listener */
+	struct svc_epoll_shard *sh;	/* once armed */
+
+	bool_t waiting;			/* armed:  deliver what comes */
+	bool_t rx_armed;		/* multishot recv or accept */
+	bool_t poll_armed;
+	u_int32_t want;			/* EPOLLIN, EPOLLOUT, when armed */
+	u_int32_t pend_ev;		/* came meanwhile */
+	bool_t rx_eof;
+	int err;			/* connection failed, errno */
+
+	int rx_head;			/* buffers received, oldest first */
+	int rx_tail;
+	struct svc_uring_fd *acc_head;	/* connections accepted */
+	struct svc_uring_fd *acc_tail;
+
+	struct svc_uring_ob *tx_head;	/* replies not yet submitted */
+	struct svc_uring_ob *tx_tail;
+	u_int tx_busy;			/* sends submitted */
+	u_int tx_bytes;			/* replies queued or submitted */
+
+	struct svc_uring_io *ready_next; /* svc_uring.ready */
+	u_int32_t ready_ev;
+	bool_t on_ready;
+	struct svc_uring_io *tx_next;	/* svc_uring.tx_ready */
+	bool_t on_tx;
+};
+
+struct svc_uring {
+	int fd;
+	mutex_t sq_lock;		/* queuers */
+	mutex_t cq_lock;		/* reapers, and ring I/O */
+
+	/* waiting for room, oldest first, under sq_lock */
+	struct svc_uring_pend *pend;
+	u_int npend;
+	u_int pend_max;
+
+	u_int *sq_head;			/* kernel's */
+	u_int *sq_tail;
+	u_int sq_mask;
+	u_int sq_entries;
+	u_int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	u_int *cq_head;
+	u_int *cq_tail;			/* kernel's */
+	u_int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;			/* == sq_ring, IORING_FEAT_SINGLE_MMAP */
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+
+	/* provided buffers, NULL without ring I/O;  under cq_lock */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	struct svc_uring_chunk *chunks;
+	u_short br_tail;
+	bool_t recv_ok;			/* multishot recv works */
+	bool_t accept_ok;		/* multishot accept works */
+
+	/* transports to deliver, and to send for;  under cq_lock */
+	struct svc_uring_io *ready;
+	struct svc_uring_io *tx_ready;
+};
+
+static int
+svc_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz)
+{
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	    flags, arg, argsz));
+}
+
+/* entries queued but not yet consumed by the kernel */
+static u_int
+svc_uring_unsubmitted(struct svc_uring *u)
+{
+	return (__atomic_load_n(u->sq_tail, __ATOMIC_ACQUIRE) -
+	    __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Put a copy of sqe in the submission queue;  sq_lock held.  FALSE if
+ * it is full.
+ */
+static bool_t
+svc_uring_sqe(struct svc_uring *u, const struct io_uring_sqe *sqe)
+{
+	u_int tail, ix;
+
+	tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+	    u->sq_entries)
+		return (FALSE);
+	ix = tail & u->sq_mask;
+	u->sqes[ix] = *sqe;
+	u->sq_array[ix] = ix;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return (TRUE);
+}
+
+/*
+ * Move the requests waiting for room to the submission queue,
+ * submitting when it fills;  sq_lock held, by an event thread.
+ */
+static void
+svc_uring_flush(struct svc_uring *u)
+{
+	struct svc_uring_pend *p;
+	u_int ix;
+
+	for (ix = 0; ix < u->npend; ++ix) {
+		p = &u->pend[ix];
+		if (svc_uring_sqe(u, &p->sqe))
+			continue;
+		(void) svc_uring_enter(u->fd, svc_uring_unsubmitted(u), 0, 0,
+		    NULL, 0);
+		if (!svc_uring_sqe(u, &p->sqe))
+			break;
+	}
+	if (ix > 0) {
+		memmove(u->pend, u->pend + ix,
+		    (u->npend - ix) * sizeof (struct svc_uring_pend));
+		__atomic_store_n(&u->npend, u->npend - ix, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Queue sqe on sh's ring;  sq_lock held.  When the submission queue
+ * is full, an event thread of sh submits it;  any other thread leaves
+ * the request waiting, in order, for an event thread to queue
+ * (svc_uring_kick).  FALSE if out of memory.
+ */
+static bool_t
+svc_uring_queue(struct svc_epoll_shard *sh, const struct io_uring_sqe *sqe)
+{
+	struct svc_uring *u = sh->uring;
+	struct svc_uring_pend *pend;
+	u_int max;
+
+	if (u->npend > 0 && __svc_shard_self() == sh)
+		svc_uring_flush(u);
+	if (u->npend == 0) {
+		if (svc_uring_sqe(u, sqe))
+			return (TRUE);
+		if (__svc_shard_self() == sh) {
+			(void) svc_uring_enter(u->fd,
+			    svc_uring_unsubmitted(u), 0, 0, NULL, 0);
+			if (svc_uring_sqe(u, sqe))
+				return (TRUE);
+		}
+	}
+	if (u->npend == u->pend_max) {
+		max = (u->pend_max > 0) ? 2 * u->pend_max : u->sq_entries;
+		pend = mem_alloc(max * sizeof (struct svc_uring_pend));
+		if (pend == NULL)
+			return (FALSE);
+		if (u->pend != NULL) {
+			memcpy(pend, u->pend,
+			    u->npend * sizeof (struct svc_uring_pend));
+			mem_free(u->pend,
+			    u->pend_max * sizeof (struct svc_uring_pend));
+		}
+		u->pend = pend;
+		u->pend_max = max;
+	}
+	u->pend[u->npend].sqe = *sqe;
+	__atomic_store_n(&u->npend, u->npend + 1, __ATOMIC_RELEASE);
+	return (TRUE);
+}
+
+/* a poll of fd for events (POLLIN, POLLOUT) */
+static void
+svc_uring_prep_poll(struct io_uring_sqe *sqe, int fd, u_int events,
+    u_int64_t data)
+{
+	memset(sqe, 0, sizeof (struct io_uring_sqe));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = data;
+}
+
+/*
+ * Have an event thread of sh submit what is queued, on its way back
+ * into svc_uring_wait, unless the caller is one.  Other threads do not
+ * submit themselves:  the kernel cancels a request when the thread
+ * which submitted it exits, as a detached request's may.
+ */
+static void
+svc_uring_kick(struct svc_epoll_shard *sh)
+{
+	if (__svc_shard_self() == sh)
+		return;
+	__svc_shard_wake(sh);
+}
+
+static struct svc_epoll_shard *
+svc_uring_shard(SVCXPRT *xprt)
+{
+	struct svc_epoll_shard *sh;
+	u_int ix;
+
+	sh = __svc_shard_self();
+	if (sh != NULL && sh->epoll_fd == xprt->xp_epoll_fd)
+		return (sh);
+	for (ix = 0; ix < __svc_params->ev_u.epoll.nshards; ++ix) {
+		sh = &__svc_params->ev_u.epoll.shards[ix];
+		if (sh->epoll_fd == xprt->xp_epoll_fd)
+			return (sh);
+	}
+	return (NULL);
+}
+
+/*
+ * Give provided buffer bid back to the kernel;  cq_lock held.
+ */
+static void
+svc_uring_buf_put(struct svc_uring *u, int bid)
+{
+	struct io_uring_buf *b;
+
+	b = &u->br->bufs[u->br_tail & (SVC_URING_NBUFS - 1)];
+	b->addr = (u_int64_t)(u->bufs + (size_t)bid * SVC_URING_BUFSZ);
+	b->len = SVC_URING_BUFSZ;
+	b->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Register sh's provided buffer ring, for ring I/O.  FALSE if the
+ * kernel cannot (before Linux 5.19).
+ */
+static bool_t
+svc_uring_buf_init(struct svc_uring *u)
+{
+	struct io_uring_buf_reg reg;
+	size_t br_sz = SVC_URING_NBUFS * sizeof (struct io_uring_buf);
+	size_t bufs_sz = (size_t)SVC_URING_NBUFS * SVC_URING_BUFSZ;
+	int bid;
+
+	u->br = mmap(NULL, br_sz, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED)
+		goto fail;
+	u->bufs = mmap(NULL, bufs_sz, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->bufs == MAP_FAILED)
+		goto fail;
+	u->chunks = mem_alloc(SVC_URING_NBUFS *
+	    sizeof (struct svc_uring_chunk));
+	if (u->chunks == NULL)
+		goto fail;
+
+	memset(&reg, 0, sizeof (reg));
+	reg.ring_addr = (u_int64_t)u->br;
+	reg.ring_entries = SVC_URING_NBUFS;
+	reg.bgid = SVC_URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) < 0)
+		goto fail;
+	u->br_tail = 0;
+	for (bid = 0; bid < SVC_URING_NBUFS; bid++)
+		svc_uring_buf_put(u, bid);
+	u->recv_ok = TRUE;
+	u->accept_ok = TRUE;
+	return (TRUE);
+
+fail:
+	if (u->chunks != NULL)
+		mem_free(u->chunks, SVC_URING_NBUFS *
+		    sizeof (struct svc_uring_chunk));
+	if (u->bufs != NULL && u->bufs != MAP_FAILED)
+		(void) munmap(u->bufs, bufs_sz);
+	if (u->br != NULL && u->br != MAP_FAILED)
+		(void) munmap(u->br, br_sz);
+	u->chunks = NULL;
+	u->bufs = NULL;
+	u->br = NULL;
+	return (FALSE);
+}
+
+/*
+ * Set up shard sh's ring, which stands in for its epoll set (epoll_fd
+ * is the ring's fd), and watch its eventfd.  FALSE if the kernel
+ * cannot do what we need.
+ */
+bool_t
+__svc_uring_init(struct svc_epoll_shard *sh)
+{
+	struct io_uring_params p;
+	struct svc_uring *u;
+	char *sq, *cq;
+
+	u = mem_alloc(sizeof (struct svc_uring));
+	if (u == NULL)
+		return (FALSE);
+	memset(u, 0, sizeof (struct svc_uring));
+	memset(&p, 0, sizeof (p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = SVC_URING_CQ_ENTRIES;
+	u->fd = syscall(__NR_io_uring_setup, SVC_URING_SQ_ENTRIES, &p);
+	if (u->fd < 0)
+		goto fail;
+	/* EXT_ARG for timeouts, NODROP so no completion (reference) is lost */
+	if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP))
+		goto fail;
+
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof (u_int);
+	u->cq_ring_sz = p.cq_off.cqes +
+	    p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = u->sq_ring_sz;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			(void) munmap(u->sq_ring, u->sq_ring_sz);
+			goto fail;
+		}
+	}
+	u->sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		if (u->cq_ring != u->sq_ring)
+			(void) munmap(u->cq_ring, u->cq_ring_sz);
+		(void) munmap(u->sq_ring, u->sq_ring_sz);
+		goto fail;
+	}
+
+	sq = u->sq_ring;
+	u->sq_head = (u_int *)(sq + p.sq_off.head);
+	u->sq_tail = (u_int *)(sq + p.sq_off.tail);
+	u->sq_mask = *(u_int *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = *(u_int *)(sq + p.sq_off.ring_entries);
+	u->sq_array = (u_int *)(sq + p.sq_off.array);
+	cq = u->cq_ring;
+	u->cq_head = (u_int *)(cq + p.cq_off.head);
+	u->cq_tail = (u_int *)(cq + p.cq_off.tail);
+	u->cq_mask = *(u_int *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	mutex_init(&u->sq_lock, NULL);
+	mutex_init(&u->cq_lock, NULL);
+
+	/* without it, every transport is polled */
+	(void) svc_uring_buf_init(u);
+
+	sh->uring = u;
+	sh->epoll_fd = u->fd;
+	__svc_uring_arm_wake(sh);
+	return (TRUE);
+
+fail:
+	if (u->fd >= 0)
+		(void) close(u->fd);
+	mem_free(u, sizeof (struct svc_uring));
+	return (FALSE);
+}
+
+/*
+ * Ring I/O for xprt, a nonblocking connection or (accept) a listener,
+ * before it is registered;  NULL if the rings cannot do it, and xprt
+ * is polled.  Freed by __svc_uring_detach, with the last reference.
+ */
+struct svc_uring_io *
+__svc_uring_attach(SVCXPRT *xprt, bool_t accept)
+{
+	struct svc_uring_io *io;
+	struct svc_uring *u;
+
+	if (__svc_params->ev_type != SVC_EVENT_URING)
+		return (NULL);
+	/* shards are alike */
+	u = __svc_params->ev_u.epoll.shards[0].uring;
+	if (u == NULL || u->br == NULL)
+		return (NULL);
+	io = mem_alloc(sizeof (struct svc_uring_io));
+	if (io == NULL)
+		return (NULL);
+	memset(io, 0, sizeof (struct svc_uring_io));
+	io->xprt = xprt;
+	io->accept = accept;
+	io->rx_head = io->rx_tail = -1;
+	return (io);
+}
+
+void
+__svc_uring_detach(struct svc_uring_io *io)
+{
+	struct svc_uring *u;
+	struct svc_uring_ob *ob;
+	struct svc_uring_fd *a;
+	int bid;
+
+	/* the last reference is gone, so no request is outstanding */
+	if (io->sh != NULL) {
+		u = io->sh->uring;
+		mutex_lock(&u->cq_lock);
+		while ((bid = io->rx_head) >= 0) {
+			io->rx_head = u->chunks[bid].next;
+			svc_uring_buf_put(u, bid);
+		}
+		mutex_unlock(&u->cq_lock);
+	}
+	while ((a = io->acc_head) != NULL) {
+		io->acc_head = a->next;
+		(void) close(a->fd);
+		mem_free(a, sizeof (struct svc_uring_fd));
+	}
+	while ((ob = io->tx_head) != NULL) {
+		io->tx_head = ob->next;
+		mem_free(ob, sizeof (struct svc_uring_ob) + ob->len);
+	}
+	mem_free(io, sizeof (struct svc_uring_io));
+}
+
+/*
+ * Stand-in for read(2) on io's connection, by the thread serving it:
+ * what was received into provided buffers, or, when the ring is not
+ * receiving for it, what read(2) gets.  EAGAIN when it has nothing yet.
+ */
+ssize_t
+__svc_uring_read(struct svc_uring_io *io, void *buf, size_t len)
+{
+	struct svc_uring *u;
+	struct svc_uring_chunk *c;
+	size_t got, n;
+	int bid;
+	bool_t armed;
+
+	if (io->sh == NULL)
+		return (read(io->xprt->xp_fd, buf, len));
+	u = io->sh->uring;
+	got = 0;
+	mutex_lock(&u->cq_lock);
+	while (got < len && (bid = io->rx_head) >= 0) {
+		/* the reaper only appends, so the head is ours to copy */
+		c = &u->chunks[bid];
+		n = c->len - c->off;
+		if (n > len - got)
+			n = len - got;
+		mutex_unlock(&u->cq_lock);
+		memcpy((char *)buf + got,
+		    u->bufs + (size_t)bid * SVC_URING_BUFSZ + c->off, n);
+		got += n;
+		mutex_lock(&u->cq_lock);
+		if ((c->off += n) < c->len)
+			break;
+		if ((io->rx_head = c->next) < 0)
+			io->rx_tail = -1;
+		svc_uring_buf_put(u, bid);
+	}
+	armed = io->rx_armed;
+	if (got == 0 && io->err != 0) {
+		errno = io->err;
+		mutex_unlock(&u->cq_lock);
+		return (-1);
+	}
+	if (got == 0 && io->rx_eof) {
+		mutex_unlock(&u->cq_lock);
+		return (0);
+	}
+	mutex_unlock(&u->cq_lock);
+	if (got > 0)
+		return (got);
+	if (armed) {
+		errno = EAGAIN;
+		return (-1);
+	}
+	return (read(io->xprt->xp_fd, buf, len));
+}
+
+/*
+ * Stand-in for accept4(2) on io's listener:  a connection the ring
+ * accepted, or, when it is not accepting for it, what accept4 gets.
+ * EAGAIN when it has none yet.
+ */
+int
+__svc_uring_accept(struct svc_uring_io *io, struct sockaddr *addr,
+    socklen_t *lenp, int flags)
+{
+	struct svc_uring *u;
+	struct svc_uring_fd *a;
+	bool_t armed;
+	int sock, fl;
+
+	if (io->sh == NULL)
+		return (accept4(io->xprt->xp_fd, addr, lenp, flags));
+	u = io->sh->uring;
+	for (;;) {
+		mutex_lock(&u->cq_lock);
+		if ((a = io->acc_head) != NULL &&
+		    (io->acc_head = a->next) == NULL)
+			io->acc_tail = NULL;
+		armed = io->rx_armed;
+		mutex_unlock(&u->cq_lock);
+		if (a == NULL)
+			break;
+		sock = a->fd;
+		mem_free(a, sizeof (struct svc_uring_fd));
+		/* the ring accepts SOCK_CLOEXEC | SOCK_NONBLOCK */
+		if (getpeername(sock, addr, lenp) < 0 ||
+		    (!(flags & SOCK_NONBLOCK) &&
+		     ((fl = fcntl(sock, F_GETFL, 0)) == -1 ||
+		      fcntl(sock, F_SETFL, fl & ~O_NONBLOCK) == -1))) {
+			(void) close(sock);	/* gone already */
+			continue;
+		}
+		return (sock);
+	}
+	if (armed) {
+		errno = EAGAIN;
+		return (-1);
+	}
+	return (accept4(io->xprt->xp_fd, addr, lenp, flags));
+}
+
+/*
+ * Queue a copy of iov to go out on io's connection, after what is
+ * queued already;  an event thread submits it.  Over SVC_OUTQ_HIGH
+ * queued, the connection is not read (SVC_XPORT_FLAG_OUTFULL) until
+ * down to SVC_OUTQ_LOW.  Returns the length, or -1 if the connection
+ * failed.
+ */
+int
+__svc_uring_send(struct svc_uring_io *io, struct iovec *iov, int iovcnt)
+{
+	struct svc_epoll_shard *sh;
+	struct svc_uring *u;
+	struct svc_uring_ob *ob;
+	SVCXPRT *xprt = io->xprt;
+	size_t len;
+	char *p;
+	int i;
+
+	if ((sh = io->sh) == NULL && (sh = svc_uring_shard(xprt)) == NULL)
+		return (-1);	/* unregistered */
+	u = sh->uring;
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	ob = mem_alloc(sizeof (struct svc_uring_ob) + len);
+	if (ob == NULL) {
+		__warnx("__svc_uring_send: out of memory");
+		return (-1);
+	}
+	ob->next = NULL;
+	ob->io = io;
+	ob->len = len;
+	p = (char *)(ob + 1);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	mutex_lock(&u->cq_lock);
+	if (io->err != 0) {
+		mutex_unlock(&u->cq_lock);
+		mem_free(ob, sizeof (struct svc_uring_ob) + len);
+		return (-1);
+	}
+	io->sh = sh;
+	if (io->tx_tail != NULL)
+		io->tx_tail->next = ob;
+	else
+		io->tx_head = ob;
+	io->tx_tail = ob;
+	io->tx_bytes += len;
+	if (io->tx_bytes > SVC_OUTQ_HIGH)
+		__sync_fetch_and_or(&xprt->xp_flags, SVC_XPORT_FLAG_OUTFULL);
+	/* one chain at a time:  the last send of this one lists io */
+	if (io->tx_busy == 0 && !io->on_tx && __svc_xprt_ref(xprt)) {
+		io->on_tx = TRUE;
+		io->tx_next = u->tx_ready;
+		u->tx_ready = io;
+	}
+	mutex_unlock(&u->cq_lock);
+	svc_uring_kick(sh);
+	return (len);
+}
+
+/*
+ * The connection has failed if a send did.
+ */
+bool_t
+__svc_uring_failed(struct svc_uring_io *io)
+{
+	return (__atomic_load_n(&io->err, __ATOMIC_RELAXED) != 0);
+}
+
+/*
+ * Submit the replies queued on the connections listed in tx_ready, a
+ * chain of linked sends for each;  by an event thread of sh.
+ */
+static void
+svc_uring_tx_submit(struct svc_epoll_shard *sh)
+{
+	struct svc_uring *u = sh->uring;
+	struct svc_uring_io *io, *next;
+	struct svc_uring_ob *chain, *ob;
+	struct io_uring_sqe sqe;
+	SVCXPRT *xprt;
+	u_int n, room;
+	bool_t live, again;
+
+	mutex_lock(&u->cq_lock);
+	io = u->tx_ready;
+	u->tx_ready = NULL;
+	mutex_unlock(&u->cq_lock);
+
+	for (; io != NULL; io = next) {
+		next = io->tx_next;
+		xprt = io->xprt;
+
+		mutex_lock(&u->sq_lock);
+		room = u->sq_entries - svc_uring_unsubmitted(u);
+		if (room < SVC_URING_CHAIN) {
+			(void) svc_uring_enter(u->fd,
+			    svc_uring_unsubmitted(u), 0, 0, NULL, 0);
+			room = u->sq_entries - svc_uring_unsubmitted(u);
+		}
+		live = (!(xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED) &&
+		    xprt->xp_epoll_fd == sh->epoll_fd);
+
+		mutex_lock(&u->cq_lock);
+		chain = NULL;
+		n = 0;
+		/* no room even so:  at the next wait */
+		again = (live && room == 0 && io->err == 0);
+		if (again) {
+			io->tx_next = u->tx_ready;
+			u->tx_ready = io;
+		} else
+			io->on_tx = FALSE;
+		if (live && room > 0 && io->err == 0) {
+			if (room > SVC_URING_CHAIN)
+				room = SVC_URING_CHAIN;
+			chain = io->tx_head;
+			for (ob = chain; n < room && ob != NULL; ob = ob->next)
+				n++;
+			/* the rest goes when this chain is done */
+			if ((io->tx_head = ob) == NULL)
+				io->tx_tail = NULL;
+			io->tx_busy = n;
+		}
+		mutex_unlock(&u->cq_lock);
+
+		/* each send holds a reference;  with IOSQE_IO_LINK, the
+		 * next starts once this one is done, and if it fails, the
+		 * rest fail (ECANCELED) */
+		for (ob = chain; n > 0; ob = ob->next, n--) {
+			(void) __svc_xprt_ref(xprt);
+			memset(&sqe, 0, sizeof (sqe));
+			sqe.opcode = IORING_OP_SEND;
+			sqe.fd = xprt->xp_fd;
+			sqe.addr = (u_int64_t)(ob + 1);
+			sqe.len = ob->len;
+			sqe.msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			if (n > 1)
+				sqe.flags = IOSQE_IO_LINK;
+			sqe.user_data = (u_int64_t)ob | SVC_URING_SEND;
+			(void) svc_uring_sqe(u, &sqe);	/* room, above */
+		}
+		mutex_unlock(&u->sq_lock);
+		if (!again)
+			__svc_xprt_unref(xprt);	/* tx_ready's */
+	}
+}
+
+/*
+ * Deliver io's transport for ev now if it is armed for it, or else
+ * keep ev for when it is;  cq_lock held.  TRUE if delivered, in *evp.
+ */
+static bool_t
+svc_uring_io_event(struct svc_uring_io *io, u_int32_t ev,
+    struct epoll_event *evp)
+{
+	if (ev == 0)
+		return (FALSE);
+	if (!io->waiting ||
+	    (ev == EPOLLIN && !(io->want & EPOLLIN)) ||
+	    !__svc_xprt_ref(io->xprt)) {
+		io->pend_ev |= ev;
+		return (FALSE);
+	}
+	io->waiting = FALSE;
+	evp->events = ev;
+	evp->data.ptr = io->xprt;
+	return (TRUE);
+}
+
+/*
+ * A completion of a ring I/O transport's request;  cq_lock held.  What
+ * it held a reference for is in *dropp, and an event for it in *evp.
+ * TRUE if there is one.
+ */
+static bool_t
+svc_uring_io_cqe(struct svc_uring *u, struct io_uring_cqe *cqe,
+    SVCXPRT **dropp, struct epoll_event *evp)
+{
+	struct svc_uring_io *io;
+	struct svc_uring_ob *ob;
+	struct svc_uring_fd *a;
+	u_int32_t ev = 0;
+	int res = cqe->res, bid;
+
+	*dropp = NULL;
+	switch (cqe->user_data & SVC_URING_TAGS) {
+	case SVC_URING_POLL:
+		io = (struct svc_uring_io *)(cqe->user_data & ~SVC_URING_TAGS);
+		io->poll_armed = FALSE;
+		*dropp = io->xprt;
+		if (res != -ECANCELED)
+			ev = (res < 0) ? EPOLLERR : res;
+		break;
+
+	case SVC_URING_RECV:
+		io = (struct svc_uring_io *)(cqe->user_data & ~SVC_URING_TAGS);
+		if (io->accept && res >= 0) {
+			a = mem_alloc(sizeof (struct svc_uring_fd));
+			if (a == NULL)
+				(void) close(res);
+			else {
+				a->next = NULL;
+				a->fd = res;
+				if (io->acc_tail != NULL)
+					io->acc_tail->next = a;
+				else
+					io->acc_head = a;
+				io->acc_tail = a;
+			}
+		} else if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (res <= 0) {
+				svc_uring_buf_put(u, bid);
+				io->rx_eof = TRUE;
+			} else {
+				u->chunks[bid].next = -1;
+				u->chunks[bid].len = res;
+				u->chunks[bid].off = 0;
+				if (io->rx_tail >= 0)
+					u->chunks[io->rx_tail].next = bid;
+				else
+					io->rx_head = bid;
+				io->rx_tail = bid;
+			}
+		} else if (!io->accept && res == 0)
+			io->rx_eof = TRUE;
+		else if (res == -EINVAL) {
+			/* no multishot:  poll from now on */
+			if (io->accept)
+				u->accept_ok = FALSE;
+			else
+				u->recv_ok = FALSE;
+		} else if (res < 0 && res != -ENOBUFS && res != -ECANCELED &&
+		    !io->accept && !(cqe->flags & IORING_CQE_F_MORE))
+			io->err = -res;
+		/* ended:  ENOBUFS, or an accept error, leaves the
+		 * transport to do its own I/O until armed again */
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			io->rx_armed = FALSE;
+			*dropp = io->xprt;
+		}
+		if (res != -ECANCELED)
+			ev = EPOLLIN;
+		break;
+
+	case SVC_URING_SEND:
+	default:
+		ob = (struct svc_uring_ob *)(cqe->user_data & ~SVC_URING_TAGS);
+		io = ob->io;
+		*dropp = io->xprt;
+		if (res != (int)ob->len && res != -ECANCELED && io->err == 0) {
+			io->err = (res < 0) ? -res : EPIPE;
+			ev = EPOLLERR;
+		}
+		io->tx_bytes -= ob->len;
+		mem_free(ob, sizeof (struct svc_uring_ob) + ob->len);
+		if ((io->xprt->xp_flags & SVC_XPORT_FLAG_OUTFULL) &&
+		    io->tx_bytes <= SVC_OUTQ_LOW) {
+			__sync_fetch_and_and(&io->xprt->xp_flags,
+			    ~SVC_XPORT_FLAG_OUTFULL);
+			ev |= EPOLLOUT;
+		}
+		/* the chain is done:  the next one */
+		if (--io->tx_busy == 0 && io->tx_head != NULL &&
+		    io->err == 0 && !io->on_tx &&
+		    __svc_xprt_ref(io->xprt)) {
+			io->on_tx = TRUE;
+			io->tx_next = u->tx_ready;
+			u->tx_ready = io;
+		}
+		break;
+	}
+	return (svc_uring_io_event(io, ev, evp));
+}
+
+/*
+ * Arm ring I/O transport io on sh:  deliver it at once if something
+ * came for it meanwhile, or else have its requests outstanding.
+ */
+static void
+svc_uring_io_arm(struct svc_epoll_shard *sh, struct svc_uring_io *io)
+{
+	struct svc_uring *u = sh->uring;
+	struct io_uring_sqe sqe;
+	SVCXPRT *xprt = io->xprt;
+	u_int32_t ev;
+	bool_t rx, poll, rx_ok, queued;
+
+	mutex_lock(&u->cq_lock);
+	io->sh = sh;
+	io->want = xprt->xp_epoll_ev.events & (EPOLLIN | EPOLLOUT);
+	ev = io->pend_ev;
+	io->pend_ev = 0;
+	if (!(io->want & EPOLLIN))
+		ev &= ~EPOLLIN;
+	else if (io->rx_head >= 0 || io->acc_head != NULL || io->rx_eof)
+		ev |= EPOLLIN;
+	if (io->err != 0)
+		ev |= EPOLLERR;
+	if (ev != 0) {
+		/* svc_uring_wait delivers it */
+		if (!io->on_ready && __svc_xprt_ref(xprt)) {
+			io->on_ready = TRUE;
+			io->ready_ev = ev;
+			io->ready_next = u->ready;
+			u->ready = io;
+		}
+		mutex_unlock(&u->cq_lock);
+		svc_uring_kick(sh);
+		return;
+	}
+	io->waiting = TRUE;
+	rx_ok = io->accept ? u->accept_ok : u->recv_ok;
+	rx = ((io->want & EPOLLIN) && !io->rx_armed && rx_ok);
+	poll = (!io->poll_armed &&
+	    (((io->want & EPOLLIN) && !io->rx_armed && !rx_ok) ||
+	     (io->want & EPOLLOUT)));
+	if (rx)
+		io->rx_armed = TRUE;
+	if (poll)
+		io->poll_armed = TRUE;
+	mutex_unlock(&u->cq_lock);
+	if (!rx && !poll)
+		return;
+
+	queued = FALSE;
+	mutex_lock(&u->sq_lock);
+	/* as in __svc_uring_arm */
+	if (!(xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED) &&
+	    xprt->xp_epoll_fd == sh->epoll_fd) {
+		queued = TRUE;
+		if (rx) {
+			memset(&sqe, 0, sizeof (sqe));
+			sqe.fd = xprt->xp_fd;
+			sqe.user_data = (u_int64_t)io | SVC_URING_RECV;
+			if (io->accept) {
+				sqe.opcode = IORING_OP_ACCEPT;
+				sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+				sqe.accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+			} else {
+				sqe.opcode = IORING_OP_RECV;
+				sqe.ioprio = IORING_RECV_MULTISHOT;
+				sqe.flags = IOSQE_BUFFER_SELECT;
+				sqe.buf_group = SVC_URING_BGID;
+			}
+			if ((rx = svc_uring_queue(sh, &sqe)) == TRUE)
+				(void) __svc_xprt_ref(xprt);
+		}
+		if (poll) {
+			svc_uring_prep_poll(&sqe, xprt->xp_fd,
+			    ((io->want & EPOLLIN) ? POLLIN : 0) |
+			    ((io->want & EPOLLOUT) ? POLLOUT : 0),
+			    (u_int64_t)io | SVC_URING_POLL);
+			if ((poll = svc_uring_queue(sh, &sqe)) == TRUE)
+				(void) __svc_xprt_ref(xprt);
+		}
+	}
+	mutex_unlock(&u->sq_lock);
+	if (!queued || !rx || !poll) {
+		mutex_lock(&u->cq_lock);
+		if (!queued || !rx)
+			io->rx_armed = FALSE;
+		if (!queued || !poll)
+			io->poll_armed = FALSE;
+		mutex_unlock(&u->cq_lock);
+		if (queued)
+			__warnx("svc_uring: arm failed (out of memory)");
+	}
+	svc_uring_kick(sh);
+}
+
+/*
+ * Watch xprt for its xp_epoll_ev events, once (see svc_rearm_epoll).
+ */
+void
+__svc_uring_arm(SVCXPRT *xprt)
+{
+	struct svc_epoll_shard *sh;
+	struct svc_uring *u;
+	struct io_uring_sqe sqe;
+	bool_t queued = FALSE;
+
+	if ((sh = svc_uring_shard(xprt)) == NULL)
+		return;	/* unregistered */
+	if (xprt->xp_flags & SVC_XPORT_FLAG_URING) {
+		svc_uring_io_arm(sh, __svc_vc_uring(xprt));
+		return;
+	}
+	u = sh->uring;
+	if (!__svc_xprt_ref(xprt))
+		return;
+	mutex_lock(&u->sq_lock);
+	/* __svc_uring_disarm, which also holds sq_lock, sets these first,
+	 * so a poll queued here is cancelled after it, not missed */
+	if (!(xprt->xp_flags & SVC_XPORT_FLAG_DESTROYED) &&
+	    xprt->xp_epoll_fd == sh->epoll_fd) {
+		svc_uring_prep_poll(&sqe, xprt->xp_fd,
+		    ((xprt->xp_epoll_ev.events & EPOLLIN) ? POLLIN : 0) |
+		    ((xprt->xp_epoll_ev.events & EPOLLOUT) ? POLLOUT : 0),
+		    (u_int64_t)xprt);
+		queued = svc_uring_queue(sh, &sqe);
+	}
+	mutex_unlock(&u->sq_lock);
+	if (!queued) {
+		__svc_xprt_unref(xprt);
+		return;
+	}
+	svc_uring_kick(sh);
+}
+
+/*
+ * Stop watching xprt, as it is unregistered:  cancel its poll, or
+ * with ring I/O, all its requests.
+ */
+void
+__svc_uring_disarm(SVCXPRT *xprt)
+{
+	struct svc_epoll_shard *sh;
+	struct svc_uring *u;
+	struct io_uring_sqe sqe;
+
+	if ((sh = svc_uring_shard(xprt)) == NULL)
+		return;
+	u = sh->uring;
+	memset(&sqe, 0, sizeof (sqe));
+	if (xprt->xp_flags & SVC_XPORT_FLAG_URING) {
+		sqe.opcode = IORING_OP_ASYNC_CANCEL;
+		sqe.fd = xprt->xp_fd;
+		sqe.cancel_flags = IORING_ASYNC_CANCEL_FD |
+		    IORING_ASYNC_CANCEL_ALL;
+	} else {
+		sqe.opcode = IORING_OP_POLL_REMOVE;
+		sqe.fd = -1;
+		sqe.addr = (u_int64_t)xprt;
+	}
+	sqe.user_data = SVC_URING_CANCEL;
+	mutex_lock(&u->sq_lock);
+	xprt->xp_epoll_fd = -1;
+	if (!svc_uring_queue(sh, &sqe))
+		__warnx("__svc_uring_disarm: out of memory");
+	mutex_unlock(&u->sq_lock);
+	svc_uring_kick(sh);
+}
+
+/*
+ * Watch sh's eventfd, once;  completions for it have user_data 0.
+ * Submitted at once, as the caller may be an event thread on its way
+ * out (svc_run_epoll_wake).
+ */
+void
+__svc_uring_arm_wake(struct svc_epoll_shard *sh)
+{
+	struct svc_uring *u = sh->uring;
+	struct io_uring_sqe sqe;
+	bool_t queued;
+
+	svc_uring_prep_poll(&sqe, sh->wake_fd, POLLIN, 0);
+	mutex_lock(&u->sq_lock);
+	queued = svc_uring_queue(sh, &sqe);
+	mutex_unlock(&u->sq_lock);
+	if (!queued)
+		__warnx("svc_run: rearm eventfd failed (out of memory)");
+	(void) svc_uring_enter(u->fd, svc_uring_unsubmitted(u), 0, 0, NULL, 0);
+}
+
+/*
+ * epoll_wait, for sh's ring:  submit whatever is queued, and wait up
+ * to timeout_ms (-1:  indefinitely) for completions, unless there are
+ * some, or transports to deliver already.  Transports come back in
+ * data.ptr with a reference held, the eventfd as NULL.
+ */
+int
+__svc_uring_wait(struct svc_epoll_shard *sh, struct epoll_event *events,
+    int maxevents, int timeout_ms)
+{
+	struct svc_uring *u = sh->uring;
+	struct svc_uring_io *io;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	SVCXPRT *drop[SVC_URING_REAP];
+	u_int head, tail, todo, ndrop, ix;
+	bool_t wait;
+	int n;
+
+	/* what other threads could not queue (svc_uring_queue) */
+	if (__atomic_load_n(&u->npend, __ATOMIC_ACQUIRE) > 0) {
+		mutex_lock(&u->sq_lock);
+		svc_uring_flush(u);
+		mutex_unlock(&u->sq_lock);
+	}
+	if (__atomic_load_n(&u->tx_ready, __ATOMIC_ACQUIRE) != NULL)
+		svc_uring_tx_submit(sh);
+
+	/* armed with something for them already (svc_uring_io_arm) */
+	n = 0;
+	if (__atomic_load_n(&u->ready, __ATOMIC_ACQUIRE) != NULL) {
+		mutex_lock(&u->cq_lock);
+		while ((io = u->ready) != NULL && n < maxevents) {
+			u->ready = io->ready_next;
+			io->on_ready = FALSE;
+			events[n].events = io->ready_ev;
+			events[n].data.ptr = io->xprt;
+			n++;
+		}
+		mutex_unlock(&u->cq_lock);
+	}
+
+	todo = svc_uring_unsubmitted(u);
+	wait = (n == 0 && *u->cq_head ==
+	    __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE));
+	if (wait) {
+		memset(&arg, 0, sizeof (arg));
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+			arg.ts = (u_int64_t)&ts;
+		}
+		if (svc_uring_enter(u->fd, todo, 1,
+		    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+		    sizeof (arg)) < 0 && errno != ETIME && errno != EBUSY &&
+		    errno != EAGAIN && errno != EINTR)
+			return (-1);
+	} else if (todo > 0)
+		(void) svc_uring_enter(u->fd, todo, 0, 0, NULL, 0);
+
+	ndrop = 0;
+	mutex_lock(&u->cq_lock);
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail && n < maxevents && ndrop < SVC_URING_REAP) {
+		cqe = &u->cqes[head & u->cq_mask];
+		head++;
+		if (cqe->user_data == SVC_URING_CANCEL)
+			continue;
+		if (cqe->user_data & SVC_URING_TAGS) {
+			if (svc_uring_io_cqe(u, cqe, &drop[ndrop],
+			    &events[n]))
+				n++;
+			if (drop[ndrop] != NULL)
+				ndrop++;
+			continue;
+		}
+		if (cqe->user_data != 0 && cqe->res == -ECANCELED) {
+			/* __svc_uring_disarm:  the poll is gone */
+			drop[ndrop++] = (SVCXPRT *)cqe->user_data;
+			continue;
+		}
+		/* a poll which failed otherwise is an error event:  the
+		 * transport finds out what it is, and is destroyed, or
+		 * rearmed if that was passing */
+		events[n].events = (cqe->res < 0) ? EPOLLERR : cqe->res;
+		events[n].data.ptr = (void *)cqe->user_data;
+		n++;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	mutex_unlock(&u->cq_lock);
+
+	/* not under cq_lock:  the last one may detach (__svc_uring_detach) */
+	for (ix = 0; ix < ndrop; ix++)
+		__svc_xprt_unref(drop[ix]);
+
+	return (n);
+}
+
+#else /* !HAVE_LINUX_IO_URING_H */
+
+#if defined(TIRPC_EPOLL)
+bool_t
+__svc_uring_init(struct svc_epoll_shard *sh)
+{
+	return (FALSE);	/* no kernel headers at build time */
+}
+
+struct svc_uring_io *
+__svc_uring_attach(SVCXPRT *xprt, bool_t accept)
+{
+	return (NULL);
+}
+
+/* the rest is never called without __svc_uring_attach */
+void
+__svc_uring_detach(struct svc_uring_io *io)
+{
+}
+
+ssize_t
+__svc_uring_read(struct svc_uring_io *io, void *buf, size_t len)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+__svc_uring_accept(struct svc_uring_io *io, struct sockaddr *addr,
+    socklen_t *lenp, int flags)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+
+int
+__svc_uring_send(struct svc_uring_io *io, struct iovec *iov, int iovcnt)
+{
+	return (-1);
+}
+
+bool_t
+__svc_uring_failed(struct svc_uring_io *io)
+{
+	return (TRUE);
+}
+
+void
+__svc_uring_arm(SVCXPRT *xprt)
+{
+}
+
+void
+__svc_uring_disarm(SVCXPRT *xprt)
+{
+}
+
+void
+__svc_uring_arm_wake(struct svc_epoll_shard *sh)
+{
+}
+
+int
+__svc_uring_wait(struct svc_epoll_shard *sh, struct epoll_event *events,
+    int maxevents, int timeout_ms)
+{
+	errno = ENOSYS;
+	return (-1);
+}
+#endif
+
+#endif /* HAVE_LINUX_IO_URING_H */
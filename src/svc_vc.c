@@ -71,24 +71,85 @@
 extern svc_params __svc_params[1];
 extern rwlock_t svc_fd_lock;
 
+/*
+ * State of a connection beyond its cf_conn, whose layout is public
+ * (svc.h) and stays as it was.
+ */
+struct svc_vc_state {
+	mutex_t send_lock;	/* one reply record at a time */
+	/* idle queue, least recently active first */
+	SVCXPRT *idle_next;
+	SVCXPRT *idle_prev;
+	bool_t idle_linked;
+	/* replies the socket would not take yet, oldest first, under
+	 * send_lock */
+	struct svc_vc_outbuf *out_head;
+	struct svc_vc_outbuf *out_tail;
+	u_int out_bytes;
+	bool_t out_park;	/* may queue, rather than wait */
+#if defined(TIRPC_EPOLL)
+	struct svc_uring_io *io;	/* SVC_XPORT_FLAG_URING */
+#endif
+};
+
+/*
+ * A listener's cf_rendezvous (xp_p1), and the rest of its state.
+ */
+struct svc_vc_rendezvous {
+	struct cf_rendezvous r;
+#if defined(TIRPC_EPOLL)
+	struct svc_uring_io *io;	/* SVC_XPORT_FLAG_URING */
+#endif
+};
+
+/*
+ * A connection's cf_conn (xp_p1), and the rest of its state.
+ */
+struct svc_vc_conn {
+	struct cf_conn cd;
+	struct svc_vc_state vc;
+};
+
+#define	SVC_VC(xprt)	(&((struct svc_vc_conn *)(xprt)->xp_p1)->vc)
+
 static bool_t rendezvous_request(SVCXPRT *, struct rpc_msg *);
 static enum xprt_stat rendezvous_stat(SVCXPRT *);
 static void svc_vc_destroy(SVCXPRT *);
 static void __svc_vc_dodestroy (SVCXPRT *);
 static int read_vc(void *, void *, int);
 static int write_vc(void *, void *, int);
-static enum xprt_stat svc_vc_stat(SVCXPRT *);
-static bool_t svc_vc_recv(SVCXPRT *, struct rpc_msg *);
-static bool_t svc_vc_getargs(SVCXPRT *, xdrproc_t, void *);
-static bool_t svc_vc_freeargs(SVCXPRT *, xdrproc_t, void *);
-static bool_t svc_vc_reply(SVCXPRT *, struct rpc_msg *);
+static int writev_vc(void *, struct iovec *, int);
+static SVCXPRT *svc_vc_create_shard(int, u_int, u_int, int);
+static SVCXPRT *svc_vc_conn_alloc(u_int, u_int);
+static SVCXPRT *svc_vc_makefd(int, u_int, u_int,
+    struct __rpc_sockinfo *);
+static void svc_vc_accepted(SVCXPRT *, int, struct sockaddr_storage *,
+    socklen_t);
+static void svc_vc_idle_link(SVCXPRT *);
+static void svc_vc_idle_unlink(SVCXPRT *);
+static void svc_vc_idle_touch(SVCXPRT *);
+static void svc_vc_outq_free(struct svc_vc_state *);
 static void svc_vc_rendezvous_ops(SVCXPRT *);
 static void svc_vc_ops(SVCXPRT *);
 static bool_t svc_vc_control(SVCXPRT *xprt, const u_int rq, void *in);
+static bool_t svc_vc_send_detached(SVCXPRT *, struct svc_detached_reply *);
+static bool_t svc_vc_take_record(SVCXPRT *, struct svc_record *);
+static bool_t svc_vc_take_recbuf(SVCXPRT *, struct svc_record *);
 static bool_t svc_vc_rendezvous_control (SVCXPRT *xprt, const u_int rq,
 				   	     void *in);
 void clnt_vc_destroy(CLIENT *);
 
+extern struct svc_auth_ops svc_auth_none_ops;
+
+/*
+ * May a reply's results be gathered rather than copied
+ * (__xdrrec_setgather)?  Not under RPCSEC_GSS, which rewrites them in
+ * place.
+ */
+#define	svc_vc_can_gather(xprt, auth) \
+	(((xprt)->xp_flags & SVC_XPORT_FLAG_GATHER) && ((auth) != NULL) && \
+	 ((auth)->svc_ah_ops == &svc_auth_none_ops))
+
 static void map_ipv4_to_ipv6(sin, sin6)
 struct sockaddr_in *sin;
 struct sockaddr_in6 *sin6;
@@ -124,26 +185,91 @@ svc_vc_create(fd, sendsize, recvsize)
 	u_int recvsize;
 {
 	SVCXPRT *xprt;
+#if defined(TIRPC_EPOLL)
+	SVCXPRT *prev, *clone;
+	const char *netid;
+	struct __rpc_sockinfo si;
+	u_int ix;
+	int nfd;
+#endif
+
+	xprt = svc_vc_create_shard(fd, sendsize, recvsize, 0);
+#if defined(TIRPC_EPOLL)
+	if ((xprt == NULL) || !__svc_ev_epoll(__svc_params))
+		return (xprt);
+
+	/*
+	 * With SVC_INIT_SHARDS, give every other shard its own listener
+	 * on the same address (SO_REUSEPORT), so the kernel spreads
+	 * incoming connections across shards.  Clones are chained from
+	 * xprt, and destroyed with it.
+	 */
+	prev = xprt;
+	for (ix = 1; ix < __svc_params->ev_u.epoll.nshards; ++ix) {
+		if ((nfd = __svc_shard_clone_fd(fd)) < 0) {
+			__warnx("svc_vc_create: could not clone listener "
+			    "for shard %u (errno %d)", ix, errno);
+			break;
+		}
+		clone = svc_vc_create_shard(nfd, sendsize, recvsize, ix);
+		if (clone == NULL) {
+			(void) close(nfd);
+			break;
+		}
+		if (__rpc_fd2sockinfo(nfd, &si) &&
+		    __rpc_sockinfo2netid(&si, &netid))
+			clone->xp_netid = strdup(netid);
+		((struct cf_rendezvous *)prev->xp_p1)->sibling = clone;
+		prev = clone;
+	}
+#endif
+	return (xprt);
+}
+
+static SVCXPRT *
+svc_vc_create_shard(fd, sendsize, recvsize, shard)
+	int fd;
+	u_int sendsize;
+	u_int recvsize;
+	int shard;
+{
+	SVCXPRT *xprt;
+	struct svc_vc_rendezvous *rv = NULL;
 	struct cf_rendezvous *r = NULL;
 	struct __rpc_sockinfo si;
 	struct sockaddr_storage sslocal;
 	socklen_t slen;
+	int one;
 
-	r = mem_alloc(sizeof(*r));
-	if (r == NULL) {
+	rv = mem_alloc(sizeof(*rv));
+	if (rv == NULL) {
 		__warnx("svc_vc_create: out of memory");
 		goto cleanup_svc_vc_create;
 	}
+	memset(rv, 0, sizeof(*rv));
+	r = &rv->r;
 	if (!__rpc_fd2sockinfo(fd, &si))
 		return NULL;
 	r->sendsize = __rpc_get_t_size(si.si_af, si.si_proto, (int)sendsize);
 	r->recvsize = __rpc_get_t_size(si.si_af, si.si_proto, (int)recvsize);
 	r->maxrec = __svc_maxrec;
+	r->sibling = NULL;
+	r->si = si;
+	r->nonblock = FALSE;
+	if (si.si_proto == IPPROTO_TCP) {
+		one = 1;
+		/* for the connections accepted, see svc_vc_accepted */
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+		    sizeof (one));
+	}
 	xprt = mem_alloc(sizeof(SVCXPRT));
 	if (xprt == NULL) {
 		__warnx("svc_vc_create: out of memory");
 		goto cleanup_svc_vc_create;
 	}
+	memset(xprt, 0, sizeof(SVCXPRT));
+	xprt->xp_refcnt = 1;
+	xprt->xp_dtor = __svc_vc_dodestroy;
 	xprt->xp_flags = SVC_XPORT_FLAG_NONE;
 	xprt->xp_tp = NULL;
 	xprt->xp_p1 = r;
@@ -165,11 +291,16 @@ svc_vc_create(fd, sendsize, recvsize)
 		__warnx("svc_vc_create: no mem for local addr");
 		goto cleanup_svc_vc_create;
 	}
-	xprt_register(xprt);
+#if defined(TIRPC_EPOLL) && defined(HAVE_ACCEPT4)
+	/* accept through the ring, if it can */
+	if ((rv->io = __svc_uring_attach(xprt, TRUE)) != NULL)
+		xprt->xp_flags |= SVC_XPORT_FLAG_URING;
+#endif
+	__xprt_register_shard(xprt, shard);
 	return (xprt);
 cleanup_svc_vc_create:
-	if (r != NULL)
-		mem_free(r, sizeof(*r));
+	if (rv != NULL)
+		mem_free(rv, sizeof(*rv));
 	return (NULL);
 }
 
@@ -320,52 +451,93 @@ makefd_xprt(fd, sendsize, recvsize)
 	u_int recvsize;
 {
 	SVCXPRT *xprt;
+
+	xprt = svc_vc_makefd(fd, sendsize, recvsize, NULL);
+	if (xprt != NULL) {
+		svc_vc_idle_link(xprt);
+		xprt_register(xprt);
+	}
+	return (xprt);
+}
+
+/*
+ * A connection handle, with its cf_conn (svc_vc_conn) and record
+ * stream set up;  NULL if out of memory.
+ */
+static SVCXPRT *
+svc_vc_conn_alloc(sendsize, recvsize)
+	u_int sendsize;
+	u_int recvsize;
+{
+	struct svc_vc_conn *conn;
+	SVCXPRT *xprt;
 	struct cf_conn *cd;
+
+	xprt = mem_alloc(sizeof(SVCXPRT));
+	if (xprt == NULL)
+		return (NULL);
+	memset(xprt, 0, sizeof *xprt);
+	conn = mem_alloc(sizeof(struct svc_vc_conn));
+	if (conn == NULL) {
+		mem_free(xprt, sizeof(SVCXPRT));
+		return (NULL);
+	}
+	memset(conn, 0, sizeof *conn);
+	cd = &conn->cd;
+	mutex_init(&conn->vc.send_lock, NULL);
+	cd->strm_stat = XPRT_IDLE;
+	xdrrec_create(&(cd->xdrs), sendsize, recvsize,
+	    xprt, read_vc, write_vc);
+	if (cd->xdrs.x_private != NULL)
+		__xdrrec_setwritev(&(cd->xdrs), writev_vc);
+	xprt->xp_p1 = cd;
+	xprt->xp_verf.oa_base = cd->verf_body;
+	return (xprt);
+}
+
+/*
+ * Like makefd_xprt, but leave registration to the caller, which may
+ * need to configure the connection first.  sip, if not NULL, spares
+ * looking up the socket's type.
+ */
+static SVCXPRT *
+svc_vc_makefd(fd, sendsize, recvsize, sip)
+	int fd;
+	u_int sendsize;
+	u_int recvsize;
+	struct __rpc_sockinfo *sip;
+{
+	SVCXPRT *xprt;
 	const char *netid;
 	struct __rpc_sockinfo si;
  
 	assert(fd != -1);
 
-        /* XXX an ordering inelegance, at best */
-        if (! __svc_params->max_connections)
-            __svc_params->max_connections = FD_SETSIZE;
-
-        if (fd >= __svc_params->max_connections) {
+        if (fd >= __svc_xprt_limit()) {
                 __warnx("svc_vc: makefd_xprt: fd too high\n");
                 xprt = NULL;
                 goto done;
         }
 
-	xprt = mem_alloc(sizeof(SVCXPRT));
+	xprt = svc_vc_conn_alloc(sendsize, recvsize);
 	if (xprt == NULL) {
 		__warnx("svc_vc: makefd_xprt: out of memory");
 		goto done;
 	}
-	memset(xprt, 0, sizeof *xprt);
 	rwlock_init(&xprt->lock, NULL);
-	cd = mem_alloc(sizeof(struct cf_conn));
-	if (cd == NULL) {
-		__warnx("svc_tcp: makefd_xprt: out of memory");
-		mem_free(xprt, sizeof(SVCXPRT));
-		xprt = NULL;
-		goto done;
-	}
-	cd->strm_stat = XPRT_IDLE;
-	xdrrec_create(&(cd->xdrs), sendsize, recvsize,
-	    xprt, read_vc, write_vc);
-	xprt->xp_p1 = cd;
+	xprt->xp_refcnt = 1;
+	xprt->xp_dtor = __svc_vc_dodestroy;
 	xprt->xp_auth = NULL;
-	xprt->xp_verf.oa_base = cd->verf_body;
 	/* the SVCXPRT created in svc_vc_create accepts new connections
 	 * in its xp_recv op, the rendezvous_request method, but xprt is
 	 * a call channel */
 	svc_vc_ops(xprt);
 	xprt->xp_port = 0;  /* this is a connection, not a rendezvouser */
 	xprt->xp_fd = fd;
-        if (__rpc_fd2sockinfo(fd, &si) && __rpc_sockinfo2netid(&si, &netid))
+	if (sip == NULL && __rpc_fd2sockinfo(fd, &si))
+		sip = &si;
+	if (sip != NULL && __rpc_sockinfo2netid(sip, &netid))
 		xprt->xp_netid = strdup(netid);
-
-	xprt_register(xprt);
 done:
 	return (xprt);
 }
@@ -377,83 +549,154 @@ rendezvous_request(xprt, msg)
 	struct rpc_msg *msg;
 {
 	int sock, flags;
+	u_int n, batch;
 	struct cf_rendezvous *r;
-	struct cf_conn *cd;
 	struct sockaddr_storage addr;
 	socklen_t len;
-	struct __rpc_sockinfo si;
-	SVCXPRT *newxprt;
-	fd_set cleanfds;
 
 	assert(xprt != NULL);
 	assert(msg != NULL);
 
 	r = (struct cf_rendezvous *)xprt->xp_p1;
-again:
-	len = sizeof addr;
-	if ((sock = accept(xprt->xp_fd, (struct sockaddr *)(void *)&addr,
-	    &len)) < 0) {
-		if (errno == EINTR)
-			goto again;
-		/*
-		 * Clean out the most idle file descriptor when we're
-		 * running out.
-		 */
-		if (errno == EMFILE || errno == ENFILE) {
-                    switch (__svc_params->ev_type) {
+	batch = __svc_params->accept_batch;
+	if (batch > 1 && !r->nonblock) {
+		/* or the accept after the last waiting one would block */
+		if ((flags = fcntl(xprt->xp_fd, F_GETFL, 0)) == -1 ||
+		    fcntl(xprt->xp_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+			batch = 1;
+		else
+			r->nonblock = TRUE;
+	}
+
+	for (n = 0; n < batch; n++) {
+		len = sizeof addr;
+#ifdef HAVE_ACCEPT4
 #if defined(TIRPC_EPOLL)
-                    case SVC_EVENT_EPOLL:
-                        
-                        break;
+		if (xprt->xp_flags & SVC_XPORT_FLAG_URING)
+			sock = __svc_uring_accept(__svc_vc_uring(xprt),
+			    (struct sockaddr *)(void *)&addr, &len,
+			    SOCK_CLOEXEC | (r->maxrec != 0 ? SOCK_NONBLOCK : 0));
+		else
+#endif
+		sock = accept4(xprt->xp_fd, (struct sockaddr *)(void *)&addr,
+		    &len, SOCK_CLOEXEC | (r->maxrec != 0 ? SOCK_NONBLOCK : 0));
+#else
+		sock = accept(xprt->xp_fd, (struct sockaddr *)(void *)&addr,
+		    &len);
 #endif
-                    default:
-			cleanfds = svc_fdset;
-			__svc_clean_idle2(0, FALSE);
-                        break;
-                    } /* switch */
-                    goto again;
+		if (sock < 0) {
+			if (errno == EINTR) {
+				n--;
+				continue;
+			}
+			/*
+			 * Clean out the most idle file descriptor when we're
+			 * running out.
+			 */
+			if ((errno == EMFILE || errno == ENFILE) &&
+			    __svc_clean_idle2(0, FALSE)) {
+				n--;
+				continue;
+			}
+			break;	/* EAGAIN:  the backlog is drained */
 		}
-		return (FALSE);
+		svc_vc_accepted(xprt, sock, &addr, len);
 	}
+
+	return (FALSE); /* there is never an rpc msg to be processed */
+}
+
+/*
+ * Make and register a transport for a connection accepted on the
+ * rendezvouser xprt.  Its socket type is the listener's.
+ */
+static void
+svc_vc_accepted(xprt, sock, addr, len)
+	SVCXPRT *xprt;
+	int sock;
+	struct sockaddr_storage *addr;
+	socklen_t len;
+{
+	struct cf_rendezvous *r;
+	struct cf_conn *cd;
+	SVCXPRT *newxprt;
+#if !defined(__linux__)
+	int one;
+#endif
+#ifndef HAVE_ACCEPT4
+	int flags;
+#endif
+
+	r = (struct cf_rendezvous *)xprt->xp_p1;
+
 	/*
 	 * make a new transporter (re-uses xprt)
 	 */
 
-	newxprt = makefd_xprt(sock, r->sendsize, r->recvsize);
+	newxprt = svc_vc_makefd(sock, r->sendsize, r->recvsize, &r->si);
+	if (newxprt == NULL) {
+		(void)close(sock);
+		return;
+	}
 
-	if (!__rpc_set_netbuf(&newxprt->xp_rtaddr, &addr, len))
-		return (FALSE);
+	if (!__rpc_set_netbuf(&newxprt->xp_rtaddr, addr, len))
+		goto fail;
 
-	__xprt_set_raddr(newxprt, &addr);
+	__xprt_set_raddr(newxprt, addr);
 
-	if (__rpc_fd2sockinfo(sock, &si) && si.si_proto == IPPROTO_TCP) {
-		len = 1;
+#if !defined(__linux__)
+	/* Linux copies it from the listener (svc_vc_create_shard) */
+	if (r->si.si_proto == IPPROTO_TCP) {
+		one = 1;
 		/* XXX fvdl - is this useful? */
-		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &len, sizeof (len));
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
 	}
+#endif
 
 	cd = (struct cf_conn *)newxprt->xp_p1;
+	newxprt->xp_flags |= (xprt->xp_flags & SVC_XPORT_FLAG_GATHER);
 
 	cd->recvsize = r->recvsize;
 	cd->sendsize = r->sendsize;
 	cd->maxrec = r->maxrec;
 
 	if (cd->maxrec != 0) {
+#ifndef HAVE_ACCEPT4
 		flags = fcntl(sock, F_GETFL, 0);
 		if (flags  == -1)
-			return (FALSE);
+			goto fail;
 		if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
-			return (FALSE);
+			goto fail;
+#endif
 		if (cd->recvsize > cd->maxrec)
 			cd->recvsize = cd->maxrec;
 		cd->nonblock = TRUE;
 		__xdrrec_setnonblock(&cd->xdrs, cd->maxrec);
+		newxprt->xp_flags |= SVC_XPORT_FLAG_RECPOOL;
+		/* __svc_vc_recv reads until EAGAIN, so edges suffice */
+		if (__svc_ev_epoll(__svc_params) &&
+		    __svc_params->ev_u.epoll.edge)
+			newxprt->xp_flags |= SVC_XPORT_FLAG_EDGE;
+		/* whole records, so they can go to the worker pool */
+		if (__svc_ev_epoll(__svc_params) &&
+		    (__svc_params->nworkers > 0))
+			newxprt->xp_flags |= SVC_XPORT_FLAG_PIPELINE;
+#if defined(TIRPC_EPOLL)
+		/* receive and send through the ring, if it can */
+		if ((SVC_VC(newxprt)->io =
+		    __svc_uring_attach(newxprt, FALSE)) != NULL)
+			newxprt->xp_flags |= SVC_XPORT_FLAG_URING;
+#endif
 	} else
 		cd->nonblock = FALSE;
 
-	gettimeofday(&cd->last_recv_time, NULL);
+	/* only now may event threads (and the reaper) see it */
+	svc_vc_idle_link(newxprt);
+	xprt_register(newxprt);
+	return;
 
-	return (FALSE); /* there is never an rpc msg to be processed */
+fail:
+	__svc_vc_dodestroy(newxprt);
 }
 
 /*ARGSUSED*/
@@ -471,8 +714,8 @@ svc_vc_destroy(xprt)
 {
 	assert(xprt != NULL);
 	
-	xprt_unregister(xprt);
-	__svc_vc_dodestroy(xprt);
+	/* __svc_vc_dodestroy runs with the last reference */
+	__svc_xprt_destroy(xprt, TRUE);
 }
 
 static void
@@ -484,6 +727,11 @@ __svc_vc_dodestroy(xprt)
 
 	cd = (struct cf_conn *)xprt->xp_p1;
 
+#if defined(TIRPC_EPOLL)
+	if (xprt->xp_flags & SVC_XPORT_FLAG_URING)
+		__svc_uring_detach(__svc_vc_uring(xprt));
+#endif
+
 	/* Omit close in cases such as donation of the connection
 	 * to a client transport handle */
 	if ((xprt->xp_fd != RPC_ANYFD) &&
@@ -493,12 +741,16 @@ __svc_vc_dodestroy(xprt)
 	if (xprt->xp_port != 0) {
 		/* a rendezvouser socket */
 		r = (struct cf_rendezvous *)xprt->xp_p1;
-		mem_free(r, sizeof (struct cf_rendezvous));
+		if (r->sibling)
+			SVC_DESTROY(r->sibling);
+		mem_free(r, sizeof (struct svc_vc_rendezvous));
 		xprt->xp_port = 0;
 	} else {
 		/* an actual connection socket */
+		svc_vc_idle_unlink(xprt);
+		svc_vc_outq_free(SVC_VC(xprt));
 		XDR_DESTROY(&(cd->xdrs));
-		mem_free(cd, sizeof(struct cf_conn));
+		__svc_epoch_free(cd, sizeof(struct svc_vc_conn));
 	}
 	if (xprt->xp_auth != NULL) {
 		SVCAUTH_DESTROY(xprt->xp_auth);
@@ -515,7 +767,8 @@ __svc_vc_dodestroy(xprt)
 	if (xprt->xp_netid)
 		free(xprt->xp_netid); /* XXX check why not mem_alloc/free */
 
-	mem_free(xprt, sizeof(SVCXPRT));
+	/* an event thread may yet find xprt in an epoll event */
+	__svc_epoch_free(xprt, sizeof(SVCXPRT));
 }
 
 /*ARGSUSED*/
@@ -530,7 +783,7 @@ svc_vc_control(xprt, rq, in)
 	    *(u_int *)in = xprt->xp_flags;
 	    break;
 	case SVCSET_XP_FLAGS:
-	    xprt->xp_flags = *(u_int *)in;
+	    __svc_xprt_setflags(xprt, ~SVC_XPORT_FLAG_INTERNAL, *(u_int *)in);
 	    break;
 	case SVCGET_XP_RECV:
 	    *(xp_recv_t *)in = xprt->xp_ops->xp_recv;
@@ -538,6 +791,20 @@ svc_vc_control(xprt, rq, in)
 	case SVCSET_XP_RECV:
 	    xprt->xp_ops->xp_recv = *(xp_recv_t)in;
 	    break;
+	case SVCGET_XID:
+	    *(u_int32_t *)in = ((struct cf_conn *)(xprt->xp_p1))->x_id;
+	    break;
+	case SVCSEND_DETACHED:
+	    return (svc_vc_send_detached(xprt,
+		(struct svc_detached_reply *)in));
+	case SVCTAKE_RECORD:
+	    return (svc_vc_take_record(xprt, (struct svc_record *)in));
+	case SVCTAKE_RECBUF:
+	    return (svc_vc_take_recbuf(xprt, (struct svc_record *)in));
+	case SVCDONE_RECORD:
+	    /* no buffer between calls */
+	    __xdrrec_freerec(&((struct cf_conn *)(xprt->xp_p1))->xdrs);
+	    break;
 	default:
 	    return (FALSE);
 	}
@@ -561,6 +828,8 @@ svc_vc_rendezvous_control(xprt, rq, in)
 			break;
 		case SVCSET_CONNMAXREC:
 			cfp->maxrec = *(int *)in;
+			if (cfp->sibling)
+				(void) SVC_CONTROL(cfp->sibling, rq, in);
 			break;
 		case SVCGET_XP_RECV:
 			*(xp_recv_t *)in = xprt->xp_ops->xp_recv;
@@ -568,6 +837,16 @@ svc_vc_rendezvous_control(xprt, rq, in)
 		case SVCSET_XP_RECV:
 			xprt->xp_ops->xp_recv = *(xp_recv_t)in;
 			break;
+		case SVCGET_XP_FLAGS:
+			*(u_int *)in = xprt->xp_flags;
+			break;
+		case SVCSET_XP_FLAGS:
+			/* only what connections inherit */
+			__svc_xprt_setflags(xprt, SVC_XPORT_FLAG_GATHER,
+			    *(u_int *)in);
+			if (cfp->sibling)
+				(void) SVC_CONTROL(cfp->sibling, rq, in);
+			break;
 	default:
 			return (FALSE);
 	}
@@ -601,15 +880,22 @@ read_vc(xprtp, buf, len)
 	cfp = (struct cf_conn *)xprt->xp_p1;
 
 	if (cfp->nonblock) {
+#if defined(TIRPC_EPOLL)
+		if (xprt->xp_flags & SVC_XPORT_FLAG_URING)
+			len = __svc_uring_read(SVC_VC(xprt)->io, buf,
+			    (size_t)len);
+		else
+#endif
 		len = read(sock, buf, (size_t)len);
 		if (len < 0) {
 			if (errno == EAGAIN)
 				len = 0;
 			else
 				goto fatal_err;
-		}
+		} else if (len == 0)
+			goto fatal_err;	/* EOF, not EAGAIN */
 		if (len != 0)
-			gettimeofday(&cfp->last_recv_time, NULL);
+			svc_vc_idle_touch(xprt);
 		return len;
 	}
 
@@ -631,7 +917,7 @@ read_vc(xprtp, buf, len)
 	} while ((pollfd.revents & POLLIN) == 0);
 
 	if ((len = read(sock, buf, (size_t)len)) > 0) {
-		gettimeofday(&cfp->last_recv_time, NULL);
+		svc_vc_idle_touch(xprt);
 		return (len);
 	}
 
@@ -640,6 +926,191 @@ fatal_err:
 	return (-1);
 }
 
+/*
+ * A reply, or the rest of one, which the socket would not take yet
+ * (svc_vc_state.out_head).  data follows the header.
+ */
+struct svc_vc_outbuf {
+	struct svc_vc_outbuf *next;
+	u_int len;
+	u_int off;		/* written already */
+};
+
+/* how long a reply may take to go out when the caller waits */
+#define	SVC_VC_SEND_WAIT	2	/* seconds */
+
+/*
+ * Queue a copy of iov after what is queued already.  send_lock held.
+ */
+static bool_t
+svc_vc_outq_add(xprt, iov, iovcnt)
+	SVCXPRT *xprt;
+	struct iovec *iov;
+	int iovcnt;
+{
+	struct svc_vc_state *vc = SVC_VC(xprt);
+	struct svc_vc_outbuf *ob;
+	size_t len;
+	char *p;
+	int i;
+
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	ob = mem_alloc(sizeof (struct svc_vc_outbuf) + len);
+	if (ob == NULL) {
+		__warnx("svc_vc_outq_add: out of memory");
+		return (FALSE);
+	}
+	ob->next = NULL;
+	ob->len = len;
+	ob->off = 0;
+	p = (char *)(ob + 1);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	if (vc->out_tail != NULL)
+		vc->out_tail->next = ob;
+	else
+		vc->out_head = ob;
+	vc->out_tail = ob;
+	vc->out_bytes += len;
+	__sync_fetch_and_or(&xprt->xp_flags, SVC_XPORT_FLAG_OUTQ);
+	if (vc->out_bytes > SVC_OUTQ_HIGH)
+		__sync_fetch_and_or(&xprt->xp_flags, SVC_XPORT_FLAG_OUTFULL);
+	return (TRUE);
+}
+
+/*
+ * Write what is queued, as far as the socket takes it.  send_lock
+ * held.  FALSE if the connection failed.
+ */
+static bool_t
+svc_vc_outq_flush(xprt)
+	SVCXPRT *xprt;
+{
+	struct cf_conn *cd = (struct cf_conn *)xprt->xp_p1;
+	struct svc_vc_state *vc = SVC_VC(xprt);
+	struct svc_vc_outbuf *ob;
+	ssize_t i;
+
+	while ((ob = vc->out_head) != NULL) {
+		i = write(xprt->xp_fd, (char *)(ob + 1) + ob->off,
+		    ob->len - ob->off);
+		if (i < 0) {
+			if (errno == EAGAIN)
+				break;
+			cd->strm_stat = XPRT_DIED;
+			return (FALSE);
+		}
+		/* the client is reading:  not idle */
+		svc_vc_idle_touch(xprt);
+		vc->out_bytes -= i;
+		if ((ob->off += i) < ob->len)
+			continue;
+		if ((vc->out_head = ob->next) == NULL)
+			vc->out_tail = NULL;
+		mem_free(ob, sizeof (struct svc_vc_outbuf) + ob->len);
+	}
+	if (vc->out_bytes <= SVC_OUTQ_LOW)
+		__sync_fetch_and_and(&xprt->xp_flags, ~SVC_XPORT_FLAG_OUTFULL);
+	if (vc->out_head == NULL)
+		__sync_fetch_and_and(&xprt->xp_flags, ~SVC_XPORT_FLAG_OUTQ);
+	return (TRUE);
+}
+
+static void
+svc_vc_outq_free(vc)
+	struct svc_vc_state *vc;
+{
+	struct svc_vc_outbuf *ob;
+
+	while ((ob = vc->out_head) != NULL) {
+		vc->out_head = ob->next;
+		mem_free(ob, sizeof (struct svc_vc_outbuf) + ob->len);
+	}
+	vc->out_tail = NULL;
+	vc->out_bytes = 0;
+}
+
+/*
+ * Send iov on xprt, send_lock held.  A blocking socket takes it all.
+ * On a nonblocking one, what the socket will not take yet is queued if
+ * the caller allows (svc_vc_state.out_park), for the event loop to write
+ * when it polls writable (svc_getreq_xprt);  otherwise the caller
+ * sleeps until it can go on, up to SVC_VC_SEND_WAIT.  Once some is
+ * queued, everything after it is too, in order.  iov is consumed.
+ */
+static int
+svc_vc_send(xprt, iov, iovcnt)
+	SVCXPRT *xprt;
+	struct iovec *iov;
+	int iovcnt;
+{
+	struct cf_conn *cd;
+	struct svc_vc_state *vc = SVC_VC(xprt);
+	struct timeval tv0, tv1;
+	struct pollfd pfd;
+	ssize_t i;
+	int len, wait;
+
+	cd = (struct cf_conn *)xprt->xp_p1;
+	timerclear(&tv0);
+
+#if defined(TIRPC_EPOLL)
+	/* the ring sends it, in order */
+	if (xprt->xp_flags & SVC_XPORT_FLAG_URING) {
+		if ((len = __svc_uring_send(vc->io, iov, iovcnt)) < 0)
+			goto fatal_err;
+		return (len);
+	}
+#endif
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (vc->out_head != NULL)
+		goto park;
+
+	while (iovcnt > 0) {
+		i = writev(xprt->xp_fd, iov, iovcnt);
+		if (i < 0) {
+			if (errno != EAGAIN || !cd->nonblock)
+				goto fatal_err;
+			if (vc->out_park)
+				goto park;
+			/* wait, but do not spin */
+			if (!timerisset(&tv0))
+				gettimeofday(&tv0, NULL);
+			gettimeofday(&tv1, NULL);
+			wait = (SVC_VC_SEND_WAIT - (tv1.tv_sec - tv0.tv_sec)) *
+			    1000;
+			pfd.fd = xprt->xp_fd;
+			pfd.events = POLLOUT;
+			if (wait <= 0 || poll(&pfd, 1, wait) == 0)
+				goto fatal_err;
+			continue;
+		}
+		/* past what went out */
+		while ((iovcnt > 0) && (i >= (ssize_t)iov->iov_len)) {
+			i -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + i;
+			iov->iov_len -= i;
+		}
+	}
+	return (len);
+
+park:
+	if (svc_vc_outq_add(xprt, iov, iovcnt))
+		return (len);
+fatal_err:
+	cd->strm_stat = XPRT_DIED;
+	return (-1);
+}
+
 /*
  * writes data to the tcp connection.
  * Any error is fatal and the connection is closed.
@@ -650,48 +1121,43 @@ write_vc(xprtp, buf, len)
 	void *buf;
 	int len;
 {
-	SVCXPRT *xprt;
-	int i, cnt;
-	struct cf_conn *cd;
-	struct timeval tv0, tv1;
+	struct iovec iov;
 
-	xprt = (SVCXPRT *)xprtp;
-	assert(xprt != NULL);
+	assert(xprtp != NULL);
 
-	cd = (struct cf_conn *)xprt->xp_p1;
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return (svc_vc_send((SVCXPRT *)xprtp, &iov, 1));
+}
 
-	if (cd->nonblock)
-		gettimeofday(&tv0, NULL);
-	
-	for (cnt = len; cnt > 0; cnt -= i, buf += i) {
-		i = write(xprt->xp_fd, buf, (size_t)cnt);
-		if (i  < 0) {
-			if (errno != EAGAIN || !cd->nonblock) {
-				cd->strm_stat = XPRT_DIED;
-				return (-1);
-			}
-			if (cd->nonblock && i != cnt) {
-				/*
-				 * For non-blocking connections, do not
-				 * take more than 2 seconds writing the
-				 * data out.
-				 *
-				 * XXX 2 is an arbitrary amount.
-				 */
-				gettimeofday(&tv1, NULL);
-				if (tv1.tv_sec - tv0.tv_sec >= 2) {
-					cd->strm_stat = XPRT_DIED;
-					return (-1);
-				}
-			}
-		}
-	}
+/*
+ * write_vc for a gathered record (__xdrrec_setgather).  iov is
+ * consumed.
+ */
+static int
+writev_vc(xprtp, iov, iovcnt)
+	void *xprtp;
+	struct iovec *iov;
+	int iovcnt;
+{
+	assert(xprtp != NULL);
 
-	return (len);
+	return (svc_vc_send((SVCXPRT *)xprtp, iov, iovcnt));
 }
 
-static enum xprt_stat
-svc_vc_stat(xprt)
+#if defined(TIRPC_EPOLL)
+struct svc_uring_io *
+__svc_vc_uring(xprt)
+	SVCXPRT *xprt;
+{
+	if (xprt->xp_port != 0)
+		return (((struct svc_vc_rendezvous *)xprt->xp_p1)->io);
+	return (SVC_VC(xprt)->io);
+}
+#endif
+
+enum xprt_stat
+__svc_vc_stat(xprt)
 	SVCXPRT *xprt;
 {
 	struct cf_conn *cd;
@@ -702,18 +1168,40 @@ svc_vc_stat(xprt)
 
 	if (cd->strm_stat == XPRT_DIED)
 		return (XPRT_DIED);
+#if defined(TIRPC_EPOLL)
+	/* a reply failed to go out */
+	if ((xprt->xp_flags & SVC_XPORT_FLAG_URING) &&
+	    __svc_uring_failed(SVC_VC(xprt)->io))
+		return (XPRT_DIED);
+#endif
+	if (cd->nonblock) {
+		if (xprt->xp_flags & SVC_XPORT_FLAG_OUTFULL)
+			return (XPRT_IDLE);
+		/* calls read ahead raise no event */
+		if (__xdrrec_buffered(&cd->xdrs))
+			return (XPRT_MOREREQS);
+		/* edge-triggered:  keep reading until __xdrrec_getrec
+		 * sees EAGAIN (XPRT_IDLE), or there will be no further
+		 * event.  Not xdrrec_eof, which would read a partial
+		 * record's next fragment header itself, blocking-style. */
+		if ((xprt->xp_flags & SVC_XPORT_FLAG_EDGE) &&
+		    (cd->strm_stat == XPRT_MOREREQS))
+			return (XPRT_MOREREQS);
+		return (XPRT_IDLE);
+	}
 	if (! xdrrec_eof(&(cd->xdrs)))
 		return (XPRT_MOREREQS);
 	return (XPRT_IDLE);
 }
 
-static bool_t
-svc_vc_recv(xprt, msg)
+bool_t
+__svc_vc_recv(xprt, msg)
 	SVCXPRT *xprt;
 	struct rpc_msg *msg;
 {
 	struct cf_conn *cd;
 	XDR *xdrs;
+	bool_t flushed;
 
 	assert(xprt != NULL);
 	assert(msg != NULL);
@@ -722,7 +1210,20 @@ svc_vc_recv(xprt, msg)
 	xdrs = &(cd->xdrs);
 
 	if (cd->nonblock) {
-		if (!__xdrrec_getrec(xdrs, &cd->strm_stat, TRUE))
+		/* polled writable, perhaps:  see svc_vc_send */
+		if (xprt->xp_flags & SVC_XPORT_FLAG_OUTQ) {
+			mutex_lock(&SVC_VC(xprt)->send_lock);
+			flushed = svc_vc_outq_flush(xprt);
+			mutex_unlock(&SVC_VC(xprt)->send_lock);
+			if (!flushed)
+				return FALSE;
+		}
+		/* no more calls from a client not reading replies */
+		if (xprt->xp_flags & SVC_XPORT_FLAG_OUTFULL)
+			return FALSE;
+		/* read_vc returns 0 only for EAGAIN, so we need not
+		 * expect data */
+		if (!__xdrrec_getrec(xdrs, &cd->strm_stat, FALSE))
 			return FALSE;
 	}
 
@@ -740,8 +1241,8 @@ svc_vc_recv(xprt, msg)
 	return (FALSE);
 }
 
-static bool_t
-svc_vc_getargs(xprt, xdr_args, args_ptr)
+bool_t
+__svc_vc_getargs(xprt, xdr_args, args_ptr)
 	SVCXPRT *xprt;
 	xdrproc_t xdr_args;
 	void *args_ptr;
@@ -750,16 +1251,18 @@ svc_vc_getargs(xprt, xdr_args, args_ptr)
 	assert(xprt != NULL);
 	/* args_ptr may be NULL */
 
+	__SVC_TRACE(SVC_TRACE_GETARGS);
 	if (! SVCAUTH_UNWRAP(xprt->xp_auth,
 			     &(((struct cf_conn *)(xprt->xp_p1))->xdrs),
 			     xdr_args, args_ptr)) {
 		return FALSE;  
 	}
+	__SVC_TRACE(SVC_TRACE_EXEC);
 	return TRUE;
 }
 
-static bool_t
-svc_vc_freeargs(xprt, xdr_args, args_ptr)
+bool_t
+__svc_vc_freeargs(xprt, xdr_args, args_ptr)
 	SVCXPRT *xprt;
 	xdrproc_t xdr_args;
 	void *args_ptr;
@@ -775,8 +1278,8 @@ svc_vc_freeargs(xprt, xdr_args, args_ptr)
 	return ((*xdr_args)(xdrs, args_ptr));
 }
 
-static bool_t
-svc_vc_reply(xprt, msg)
+bool_t
+__svc_vc_reply(xprt, msg)
 	SVCXPRT *xprt;
 	struct rpc_msg *msg;
 {
@@ -805,15 +1308,129 @@ svc_vc_reply(xprt, msg)
 	} else
 		has_args = FALSE;
 
+	__SVC_TRACE(SVC_TRACE_ENCODE);
 	xdrs->x_op = XDR_ENCODE;
 	msg->rm_xid = cd->x_id;
 	rstat = FALSE;
+	/* detached replies may be going out from other threads */
+	mutex_lock(&SVC_VC(xprt)->send_lock);
+	/* the caller is the event thread which owns xprt, and which
+	 * polls it for output if need be (svc_getreq_xprt) */
+	SVC_VC(xprt)->out_park = cd->nonblock && __svc_ev_epoll(__svc_params);
+	/* a nonblocking connection has an output buffer per reply */
+	if (cd->nonblock && !__xdrrec_getout(xdrs)) {
+		SVC_VC(xprt)->out_park = FALSE;
+		mutex_unlock(&SVC_VC(xprt)->send_lock);
+		return (FALSE);
+	}
+	if (has_args && svc_vc_can_gather(xprt, xprt->xp_auth))
+		(void)__xdrrec_setgather(xdrs, TRUE);
 	if (xdr_replymsg(xdrs, msg) &&
 	    (!has_args || (xprt->xp_auth &&
 	     SVCAUTH_WRAP(xprt->xp_auth, xdrs, xdr_results, xdr_location)))) {
 		rstat = TRUE;
 	}
+	__SVC_TRACE(SVC_TRACE_SEND);
 	(void)xdrrec_endofrecord(xdrs, TRUE);
+	(void)__xdrrec_setgather(xdrs, FALSE);
+	SVC_VC(xprt)->out_park = FALSE;
+	mutex_unlock(&SVC_VC(xprt)->send_lock);
+	__SVC_TRACE(SVC_TRACE_SENT);
+	return (rstat);
+}
+
+/*
+ * Take the next complete record off a nonblocking connection, for the
+ * worker pool (svc_pool.c), with the pool buffer holding it.
+ */
+static bool_t
+svc_vc_take_record(xprt, rec)
+	SVCXPRT *xprt;
+	struct svc_record *rec;
+{
+	struct cf_conn *cd;
+
+	cd = (struct cf_conn *)(xprt->xp_p1);
+	if (!cd->nonblock ||
+	    !__xdrrec_getrec(&cd->xdrs, &cd->strm_stat, FALSE))
+		return (FALSE);
+	return (__xdrrec_takerec(&cd->xdrs, &rec->buf, &rec->len,
+	    &rec->size));
+}
+
+/*
+ * svc_req_detach is taking the request being served away:  let it
+ * have the record's buffer too, in case arguments were decoded by
+ * reference.  The stream has none of the next record yet.
+ */
+static bool_t
+svc_vc_take_recbuf(xprt, rec)
+	SVCXPRT *xprt;
+	struct svc_record *rec;
+{
+	struct cf_conn *cd;
+
+	cd = (struct cf_conn *)(xprt->xp_p1);
+	if (!cd->nonblock)
+		return (FALSE);
+	return (__xdrrec_takerec(&cd->xdrs, &rec->buf, &rec->len,
+	    &rec->size));
+}
+
+/*
+ * Reply to a detached request (svc_req_detach).  cd->xdrs may be busy
+ * decoding a later request, so encode through a stream of our own;
+ * send_lock keeps the record whole on the wire.
+ */
+static bool_t
+svc_vc_send_detached(xprt, dreply)
+	SVCXPRT *xprt;
+	struct svc_detached_reply *dreply;
+{
+	struct cf_conn *cd;
+	struct rpc_msg *msg;
+	XDR xdrs;
+	bool_t rstat;
+
+	xdrproc_t xdr_results;
+	caddr_t xdr_location;
+	bool_t has_args;
+
+	cd = (struct cf_conn *)(xprt->xp_p1);
+	msg = dreply->msg;
+
+	if (msg->rm_reply.rp_stat == MSG_ACCEPTED &&
+	    msg->rm_reply.rp_acpt.ar_stat == SUCCESS) {
+		has_args = TRUE;
+		xdr_results = msg->acpted_rply.ar_results.proc;
+		xdr_location = msg->acpted_rply.ar_results.where;
+
+		msg->acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
+		msg->acpted_rply.ar_results.where = NULL;
+	} else
+		has_args = FALSE;
+
+	__SVC_TRACE_XID(SVC_TRACE_ENCODE, msg->rm_xid);
+	memset(&xdrs, 0, sizeof xdrs);
+	xdrrec_create(&xdrs, cd->sendsize, 0, xprt, read_vc, write_vc);
+	if (xdrs.x_private == NULL)
+		return (FALSE);
+	__xdrrec_setwritev(&xdrs, writev_vc);
+	if (has_args && svc_vc_can_gather(xprt, dreply->auth))
+		(void)__xdrrec_setgather(&xdrs, TRUE);
+	xdrs.x_op = XDR_ENCODE;
+	rstat = FALSE;
+	mutex_lock(&SVC_VC(xprt)->send_lock);
+	if (xdr_replymsg(&xdrs, msg) &&
+	    (!has_args ||
+	     SVCAUTH_WRAP(dreply->auth, &xdrs, xdr_results, xdr_location))) {
+		rstat = TRUE;
+	}
+	__SVC_TRACE_XID(SVC_TRACE_SEND, msg->rm_xid);
+	(void)xdrrec_endofrecord(&xdrs, TRUE);
+	mutex_unlock(&SVC_VC(xprt)->send_lock);
+	__SVC_TRACE_XID(SVC_TRACE_SENT, msg->rm_xid);
+	XDR_DESTROY(&xdrs);
 	return (rstat);
 }
 
@@ -829,11 +1446,11 @@ svc_vc_ops(xprt)
 
 	mutex_lock(&ops_lock);
 	if (ops.xp_recv == NULL) {
-		ops.xp_recv = svc_vc_recv;
-		ops.xp_stat = svc_vc_stat;
-		ops.xp_getargs = svc_vc_getargs;
-		ops.xp_reply = svc_vc_reply;
-		ops.xp_freeargs = svc_vc_freeargs;
+		ops.xp_recv = __svc_vc_recv;
+		ops.xp_stat = __svc_vc_stat;
+		ops.xp_getargs = __svc_vc_getargs;
+		ops.xp_reply = __svc_vc_reply;
+		ops.xp_freeargs = __svc_vc_freeargs;
 		ops.xp_destroy = svc_vc_destroy;
 		ops2.xp_control = svc_vc_control;
 	}
@@ -891,106 +1508,206 @@ __rpc_get_local_uid(SVCXPRT *transp, uid_t *uid) {
 }
 
 /*
- * Destroy xprts that have not have had any activity in 'timeout' seconds.
- * If 'cleanblock' is true, blocking connections (the default) are also
- * cleaned. If timeout is 0, the least active connection is picked.
+ * Idle connections.  Each connection sits on one of two queues
+ * (blocking, nonblocking) in order of last receive:  a receive moves
+ * it to the tail, so the head is always the least recently active.
+ * Reaping is thus O(expired) and the "least active" victim is a queue
+ * head.  All connections share one idle timeout, so this is the
+ * degenerate timer wheel, with every timer in one slot.
  *
- * Though this is not a publicly documented interface, some versions of
- * rpcbind are known to call this function.  Do not alter or remove this
- * API without changing the library's sonum.
+ * A connection is requeued at most once a second, so svc_idle_lock
+ * is rarely taken on the receive path.
  */
+struct svc_idle_queue {
+	SVCXPRT *head;
+	SVCXPRT *tail;
+};
 
-bool_t
-__svc_clean_idle(fd_set *fds, int timeout, bool_t cleanblock)
+static mutex_t svc_idle_lock = MUTEX_INITIALIZER;
+static struct svc_idle_queue svc_idle_q[2];	/* by cf_conn.nonblock */
+
+#define	SVC_IDLE_Q(cd)	(&svc_idle_q[(cd)->nonblock ? 1 : 0])
+#define	SVC_IDLE_CD(xprt)	((struct cf_conn *)(xprt)->xp_p1)
+#define	SVC_IDLE_NEXT(xprt)	(SVC_VC(xprt)->idle_next)
+
+/* svc_idle_lock held */
+static void
+svc_vc_idle_insert(SVCXPRT *xprt, struct cf_conn *cd)
 {
-	int i, ncleaned;
-	SVCXPRT *xprt, *least_active;
-	struct timeval tv, tdiff, tmax;
-	struct cf_conn *cd;
+	struct svc_idle_queue *q = SVC_IDLE_Q(cd);
+	struct svc_vc_state *vc = SVC_VC(xprt);
+
+	gettimeofday(&cd->last_recv_time, NULL);
+	vc->idle_next = NULL;
+	vc->idle_prev = q->tail;
+	if (q->tail != NULL)
+		SVC_IDLE_NEXT(q->tail) = xprt;
+	else
+		q->head = xprt;
+	q->tail = xprt;
+	vc->idle_linked = TRUE;
+}
+
+/* svc_idle_lock held */
+static void
+svc_vc_idle_remove(SVCXPRT *xprt, struct cf_conn *cd)
+{
+	struct svc_idle_queue *q = SVC_IDLE_Q(cd);
+	struct svc_vc_state *vc = SVC_VC(xprt);
+
+	if (vc->idle_prev != NULL)
+		SVC_IDLE_NEXT(vc->idle_prev) = vc->idle_next;
+	else
+		q->head = vc->idle_next;
+	if (vc->idle_next != NULL)
+		SVC_VC(vc->idle_next)->idle_prev = vc->idle_prev;
+	else
+		q->tail = vc->idle_prev;
+	vc->idle_next = vc->idle_prev = NULL;
+	vc->idle_linked = FALSE;
+}
+
+/*
+ * Start idle accounting for a connection.  Call once it is configured
+ * (cf_conn.nonblock picks the queue) and before it is registered.
+ */
+static void
+svc_vc_idle_link(SVCXPRT *xprt)
+{
+	mutex_lock(&svc_idle_lock);
+	svc_vc_idle_insert(xprt, SVC_IDLE_CD(xprt));
+	mutex_unlock(&svc_idle_lock);
+}
+
+static void
+svc_vc_idle_unlink(SVCXPRT *xprt)
+{
+	struct cf_conn *cd = SVC_IDLE_CD(xprt);
+
+	mutex_lock(&svc_idle_lock);
+	if (SVC_VC(xprt)->idle_linked)
+		svc_vc_idle_remove(xprt, cd);
+	mutex_unlock(&svc_idle_lock);
+}
+
+/*
+ * Note receive activity on xprt, which the caller holds.
+ */
+static void
+svc_vc_idle_touch(SVCXPRT *xprt)
+{
+	struct cf_conn *cd = SVC_IDLE_CD(xprt);
+	struct timeval tv;
 
 	gettimeofday(&tv, NULL);
-	tmax.tv_sec = tmax.tv_usec = 0;
-	least_active = NULL;
-	rwlock_wrlock(&svc_fd_lock);
-	for (i = ncleaned = 0; i <= svc_maxfd; i++) {
-		xprt = __svc_xports[i];
-		if (FD_ISSET(i, fds)) {			
-			if (xprt == NULL || xprt->xp_ops == NULL ||
-			    xprt->xp_ops->xp_recv != svc_vc_recv)
-				continue;
-			cd = (struct cf_conn *)xprt->xp_p1;
-			if (!cleanblock && !cd->nonblock)
-				continue;
-			if (timeout == 0) {
-				timersub(&tv, &cd->last_recv_time, &tdiff);
-				if (timercmp(&tdiff, &tmax, >)) {
-					tmax = tdiff;
-					least_active = xprt;
-				}
-				continue;
-			}
-			if (tv.tv_sec - cd->last_recv_time.tv_sec > timeout) {
-				__xprt_unregister_unlocked(xprt);
-				__svc_vc_dodestroy(xprt);
-				ncleaned++;
-			}
-		} /* ! FD_ISSET */
-	} /* loop */
-	if (timeout == 0 && least_active != NULL) {
-		__xprt_unregister_unlocked(least_active);
-		__svc_vc_dodestroy(least_active);
-		ncleaned++;
+	if (tv.tv_sec == cd->last_recv_time.tv_sec) {
+		cd->last_recv_time = tv;
+		return;
 	}
-	rwlock_unlock(&svc_fd_lock);
-	return ncleaned > 0 ? TRUE : FALSE;
-} /* __svc_clean_idle */
+	mutex_lock(&svc_idle_lock);
+	if (SVC_VC(xprt)->idle_linked) {
+		svc_vc_idle_remove(xprt, cd);
+		svc_vc_idle_insert(xprt, cd);
+	} else
+		cd->last_recv_time = tv;
+	mutex_unlock(&svc_idle_lock);
+}
 
 /*
- * Like __svc_clean_idle but event-type independent.  For now no cleanfds.
+ * Take the connections to clean off the idle queues, each with a
+ * reference held, chained through idle_next.
  */
-bool_t
-__svc_clean_idle2(int timeout, bool_t cleanblock)
+static SVCXPRT *
+svc_vc_idle_collect(fd_set *fds, int timeout, bool_t cleanblock)
 {
-	int i, ncleaned;
-	SVCXPRT *xprt, *least_active;
-	struct timeval tv, tdiff, tmax;
+	SVCXPRT *xprt, *next, *victims, *least_active;
 	struct cf_conn *cd;
+	struct timeval tv;
+	int ix;
 
+	victims = least_active = NULL;
+	mutex_lock(&svc_idle_lock);
 	gettimeofday(&tv, NULL);
-	tmax.tv_sec = tmax.tv_usec = 0;
-	least_active = NULL;
-	rwlock_wrlock(&svc_fd_lock);
-	for (i = ncleaned = 0; i <= svc_maxfd; i++) {
-		xprt = __svc_xports[i];
-		if (TRUE) { /* flag in__svc_params->ev_u.epoll? */
-			if (xprt == NULL || xprt->xp_ops == NULL ||
-			    xprt->xp_ops->xp_recv != svc_vc_recv)
+	for (ix = cleanblock ? 0 : 1; ix < 2; ix++) {
+		for (xprt = svc_idle_q[ix].head; xprt != NULL; xprt = next) {
+			cd = SVC_IDLE_CD(xprt);
+			next = SVC_IDLE_NEXT(xprt);
+			/* everything behind it is younger still */
+			if (timeout != 0 &&
+			    tv.tv_sec - cd->last_recv_time.tv_sec <= timeout)
+				break;
+			if (fds != NULL && (xprt->xp_fd >= FD_SETSIZE ||
+			    !FD_ISSET(xprt->xp_fd, fds)))
 				continue;
-			cd = (struct cf_conn *)xprt->xp_p1;
-			if (!cleanblock && !cd->nonblock)
+			/* in service on another event thread */
+			if (xprt->xp_refcnt > 1)
 				continue;
 			if (timeout == 0) {
-				timersub(&tv, &cd->last_recv_time, &tdiff);
-				if (timercmp(&tdiff, &tmax, >)) {
-					tmax = tdiff;
+				/* the first eligible is this queue's oldest */
+				if (least_active == NULL ||
+				    timercmp(&cd->last_recv_time,
+				    &SVC_IDLE_CD(least_active)->last_recv_time,
+				    <))
 					least_active = xprt;
-				}
-				continue;
+				break;
 			}
-			if (tv.tv_sec - cd->last_recv_time.tv_sec > timeout) {
-				__xprt_unregister_unlocked(xprt);
-				__svc_vc_dodestroy(xprt);
-				ncleaned++;
-			}
-		} /* TRUE */
-	} /* loop */
-	if (timeout == 0 && least_active != NULL) {
-		__xprt_unregister_unlocked(least_active);
-		__svc_vc_dodestroy(least_active);
+			if (!__svc_xprt_ref(xprt))
+				continue;	/* on its way out */
+			svc_vc_idle_remove(xprt, cd);
+			SVC_IDLE_NEXT(xprt) = victims;
+			victims = xprt;
+		}
+	}
+	if (least_active != NULL && __svc_xprt_ref(least_active)) {
+		cd = SVC_IDLE_CD(least_active);
+		svc_vc_idle_remove(least_active, cd);
+		victims = least_active;
+	}
+	mutex_unlock(&svc_idle_lock);
+
+	return (victims);
+}
+
+static bool_t
+svc_vc_idle_reap(fd_set *fds, int timeout, bool_t cleanblock)
+{
+	SVCXPRT *xprt, *next;
+	int ncleaned = 0;
+
+	for (xprt = svc_vc_idle_collect(fds, timeout, cleanblock);
+	    xprt != NULL; xprt = next) {
+		next = SVC_IDLE_NEXT(xprt);
+		__svc_xprt_destroy(xprt, TRUE);
+		__svc_xprt_unref(xprt);
 		ncleaned++;
 	}
-	rwlock_unlock(&svc_fd_lock);
 	return ncleaned > 0 ? TRUE : FALSE;
+}
+
+/*
+ * Destroy xprts that have not have had any activity in 'timeout' seconds.
+ * If 'cleanblock' is true, blocking connections (the default) are also
+ * cleaned. If timeout is 0, the least active connection is picked.
+ *
+ * Though this is not a publicly documented interface, some versions of
+ * rpcbind are known to call this function.  Do not alter or remove this
+ * API without changing the library's sonum.
+ */
+
+bool_t
+__svc_clean_idle(fd_set *fds, int timeout, bool_t cleanblock)
+{
+	return (svc_vc_idle_reap(fds, timeout, cleanblock));
+} /* __svc_clean_idle */
+
+/*
+ * Like __svc_clean_idle but event-type independent:  the idle queues
+ * are the only index, so no fd_set is needed (or consulted).
+ */
+bool_t
+__svc_clean_idle2(int timeout, bool_t cleanblock)
+{
+	return (svc_vc_idle_reap(NULL, timeout, cleanblock));
 } /* __svc_clean_idle2 */
 
 /*
@@ -1032,7 +1749,7 @@ svc_vc_clnt_create(xprt, prog, vers, flags)
 	xprt->xp_p4 = cl;
 
 	/* Warn cleanup routines not to close xp_fd */
-	xprt->xp_flags |= SVC_XPORT_FLAG_DONTCLOSE;
+	__sync_fetch_and_or(&xprt->xp_flags, SVC_XPORT_FLAG_DONTCLOSE);
 
         /* In this case, unregister and free xprt */
 	if (flags & SVC_VC_CLNT_CREATE_DEDICATED)
@@ -1071,7 +1788,7 @@ svc_vc_create_cl(cl, sendsize, recvsize, flags)
      * make a new transport
      */
 
-    xprt = makefd_xprt(fd, sendsize, recvsize);
+    xprt = svc_vc_makefd(fd, sendsize, recvsize, NULL);
 
     if (!__rpc_set_netbuf(&xprt->xp_rtaddr, &addr, len))
 		return (FALSE);
@@ -1099,10 +1816,12 @@ svc_vc_create_cl(cl, sendsize, recvsize, flags)
 	    cd->recvsize = cd->maxrec;
 	cd->nonblock = TRUE;
 	__xdrrec_setnonblock(&cd->xdrs, cd->maxrec);
+	xprt->xp_flags |= SVC_XPORT_FLAG_RECPOOL;
     } else
 	cd->nonblock = FALSE;
 
-    gettimeofday(&cd->last_recv_time, NULL);
+    svc_vc_idle_link(xprt);
+    xprt_register(xprt);
 
     /* If creating a dedicated channel collect the supplied client
      * without closing fd */
@@ -1130,7 +1849,7 @@ void svc_vc_destroy_xprt(SVCXPRT * xprt)
 	return;
     
     XDR_DESTROY(&(cd->xdrs));
-    mem_free(cd, sizeof(struct cf_conn));
+    mem_free(cd, sizeof(struct svc_vc_conn));
     mem_free(xprt, sizeof(SVCXPRT));
 }
 
@@ -1140,30 +1859,8 @@ void svc_vc_destroy_xprt(SVCXPRT * xprt)
  */
 SVCXPRT *svc_vc_create_xprt(u_long sendsz, u_long recvsz)
 {
-    SVCXPRT *xprt;
-    struct cf_conn *cd;
-
-    xprt = (SVCXPRT *) mem_alloc(sizeof(SVCXPRT));
-    if(xprt == NULL) {
-	goto done;
-    }
-
-    cd = (struct cf_conn *) mem_alloc(sizeof(struct cf_conn));
-    if(cd == NULL) {
-	mem_free(xprt, sizeof(SVCXPRT));
-	xprt = NULL;
-	goto done;
-    }
-
-    cd->strm_stat = XPRT_IDLE;
-    xdrrec_create(&(cd->xdrs), sendsz, recvsz, xprt, read_vc, write_vc);
-    
-    xprt->xp_p1 = cd;
-    xprt->xp_verf.oa_base = cd->verf_body;
-
-done:
-    return (xprt);
- }
+    return (svc_vc_conn_alloc(sendsz, recvsz));
+}
 
 /*
  * Duplicate xprt from original to copy.
@@ -1176,6 +1873,13 @@ void svc_vc_copy_xprt(SVCXPRT *xprt_copy, SVCXPRT *xprt_orig)
     memcpy(xprt_copy, xprt_orig, sizeof(SVCXPRT));
     xprt_copy->xp_p1 = cd_copy;
     xprt_copy->xp_verf.oa_base = cd_copy->verf_body;
+    /* not the original's references, calls or registration */
+    xprt_copy->xp_refcnt = 1;
+    xprt_copy->xp_inflight = 0;
+    xprt_copy->xp_flags &= ~SVC_XPORT_FLAG_INTERNAL;
+#if defined(TIRPC_EPOLL)
+    xprt_copy->xp_epoll_fd = -1;
+#endif
 
     cd_copy->strm_stat = cd_orig->strm_stat;
     cd_copy->x_id = cd_orig->x_id;
@@ -46,6 +46,7 @@
 #include <rpc/types.h>
 #include <rpc/xdr.h>
 #include <rpc/rpc.h>
+#include "rpc_com.h"
 
 typedef quad_t          longlong_t;     /* ANSI long long type */
 typedef u_quad_t        u_longlong_t;   /* ANSI unsigned long long type */
@@ -607,6 +608,58 @@ xdr_bytes(xdrs, cpp, sizep, maxsize)
 	return (FALSE);
 }
 
+/*
+ * XDR counted bytes, decoded by reference:  *cpp is set to point at
+ * the bytes in the stream's own buffer (memory streams, and record
+ * streams of nonblocking connections, which hold the record whole).
+ * A record stream which does not hold them whole points *cpp at a copy
+ * of its own instead.  Either way they last until the stream moves to
+ * the next record, and freeing does nothing.  Other streams must have
+ * them inline (XDR_INLINE), or decoding fails.  Encodes like xdr_bytes.
+ */
+bool_t
+xdr_bytes_ref(xdrs, cpp, sizep, maxsize)
+	XDR *xdrs;
+	char **cpp;
+	u_int *sizep;
+	u_int maxsize;
+{
+	u_int nodesize;
+
+	if (! xdr_u_int(xdrs, sizep)) {
+		return (FALSE);
+	}
+	nodesize = *sizep;
+	if ((nodesize > maxsize) && (xdrs->x_op != XDR_FREE)) {
+		return (FALSE);
+	}
+
+	switch (xdrs->x_op) {
+
+	case XDR_DECODE:
+		if (nodesize == 0) {
+			*cpp = NULL;
+			return (TRUE);
+		}
+		if (RNDUP(nodesize) < nodesize) {
+			return (FALSE);
+		}
+		*cpp = (char *)(void *)XDR_INLINE(xdrs, RNDUP(nodesize));
+		if (*cpp == NULL)
+			*cpp = __xdrrec_getbytes_kept(xdrs, RNDUP(nodesize));
+		return (*cpp != NULL);
+
+	case XDR_ENCODE:
+		return (xdr_opaque(xdrs, *cpp, nodesize));
+
+	case XDR_FREE:
+		*cpp = NULL;
+		return (TRUE);
+	}
+	/* NOTREACHED */
+	return (FALSE);
+}
+
 /*
  * Implemented here due to commonality of the object.
  */
@@ -0,0 +1,192 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * xdr_bufpool.c, record buffers shared by nonblocking streams.
+ *
+ * A nonblocking record stream (xdr_rec.c) takes a buffer from here
+ * for each record it reads, its read-ahead and each record it writes,
+ * and gives it back when done with it, rather than keep a buffer of its own grown to the
+ * biggest record it ever had.  Buffers come in power of two classes;
+ * each class keeps up to XDR_BUFPOOL_KEEP bytes of them for reuse, on
+ * a free list chained through their first word.
+ */
+#include <config.h>
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <reentrant.h>
+#include <stdlib.h>
+
+#if defined(TIRPC_EPOLL)
+#include <sys/epoll.h> /* before rpc.h */
+#endif
+#include <rpc/rpc.h>
+
+#include "rpc_com.h"
+
+#define	XDR_BUFPOOL_SHIFT	12	/* the smallest class, 4 KB */
+#define	XDR_BUFPOOL_BIG		(SVC_BUFPOOL_CLASSES - 1)	/* the rest */
+#define	XDR_BUFPOOL_KEEP	(2 * 1024 * 1024)	/* bytes per class */
+
+struct xdr_bufclass {
+	mutex_t lock;
+	char *free;			/* kept buffers */
+	struct svc_bufpool_class stat;
+};
+
+static struct xdr_bufclass xdr_bufpool[SVC_BUFPOOL_CLASSES];
+static once_t xdr_bufpool_once = ONCE_INITIALIZER;
+
+/* updated atomically */
+static u_long xdr_bufpool_bytes;
+static u_long xdr_bufpool_max_bytes;
+static u_long xdr_bufpool_free_bytes;
+
+static void
+xdr_bufpool_init(void)
+{
+	int c;
+
+	for (c = 0; c < SVC_BUFPOOL_CLASSES; c++) {
+		mutex_init(&xdr_bufpool[c].lock, NULL);
+		if (c != XDR_BUFPOOL_BIG)
+			xdr_bufpool[c].stat.bc_size =
+			    1U << (XDR_BUFPOOL_SHIFT + c);
+	}
+}
+
+/* the smallest class with buffers of size bytes or more */
+static int
+xdr_bufpool_class(u_int size)
+{
+	int c;
+
+	for (c = 0; c < XDR_BUFPOOL_BIG; c++)
+		if (size <= (1U << (XDR_BUFPOOL_SHIFT + c)))
+			return (c);
+	return (XDR_BUFPOOL_BIG);
+}
+
+/* a buffer of bc goes out;  bc->lock held */
+static void
+xdr_bufpool_out(struct xdr_bufclass *bc, u_int size)
+{
+	u_long n, max;
+
+	bc->stat.bc_gets++;
+	if (++bc->stat.bc_inuse > bc->stat.bc_max_inuse)
+		bc->stat.bc_max_inuse = bc->stat.bc_inuse;
+	n = __sync_add_and_fetch(&xdr_bufpool_bytes, size);
+	while (n > (max = xdr_bufpool_max_bytes) &&
+	    !__sync_bool_compare_and_swap(&xdr_bufpool_max_bytes, max, n))
+		;
+}
+
+/*
+ * A buffer of size bytes at least, or NULL if out of memory.  *sizep
+ * is its size, to give it back with.
+ */
+char *
+__xdr_bufpool_get(u_int size, u_int *sizep)
+{
+	struct xdr_bufclass *bc;
+	char *buf;
+	int c;
+
+	thr_once(&xdr_bufpool_once, xdr_bufpool_init);
+	c = xdr_bufpool_class(size);
+	bc = &xdr_bufpool[c];
+	if (c != XDR_BUFPOOL_BIG)
+		size = bc->stat.bc_size;
+	*sizep = size;
+
+	mutex_lock(&bc->lock);
+	if ((buf = bc->free) != NULL) {
+		bc->free = *(char **)(void *)buf;
+		bc->stat.bc_free--;
+		xdr_bufpool_out(bc, size);
+		mutex_unlock(&bc->lock);
+		__sync_sub_and_fetch(&xdr_bufpool_free_bytes, size);
+		return (buf);
+	}
+	mutex_unlock(&bc->lock);
+
+	if ((buf = mem_alloc(size)) == NULL)
+		return (NULL);
+	mutex_lock(&bc->lock);
+	bc->stat.bc_allocs++;
+	xdr_bufpool_out(bc, size);
+	mutex_unlock(&bc->lock);
+	return (buf);
+}
+
+/*
+ * Give back a buffer from __xdr_bufpool_get, of the size it said.
+ */
+void
+__xdr_bufpool_put(char *buf, u_int size)
+{
+	struct xdr_bufclass *bc;
+	bool_t keep;
+	int c;
+
+	c = xdr_bufpool_class(size);
+	bc = &xdr_bufpool[c];
+
+	mutex_lock(&bc->lock);
+	bc->stat.bc_inuse--;
+	keep = (c != XDR_BUFPOOL_BIG) &&
+	    ((u_long)(bc->stat.bc_free + 1) * size <= XDR_BUFPOOL_KEEP);
+	if (keep) {
+		*(char **)(void *)buf = bc->free;
+		bc->free = buf;
+		bc->stat.bc_free++;
+	}
+	mutex_unlock(&bc->lock);
+
+	__sync_sub_and_fetch(&xdr_bufpool_bytes, size);
+	if (keep)
+		__sync_add_and_fetch(&xdr_bufpool_free_bytes, size);
+	else
+		mem_free(buf, size);
+}
+
+/*
+ * For rpc_control(RPC_SVC_BUFPOOL_STATS_GET).
+ */
+void
+__xdr_bufpool_stats(struct svc_bufpool_stats *stats)
+{
+	int c;
+
+	thr_once(&xdr_bufpool_once, xdr_bufpool_init);
+	for (c = 0; c < SVC_BUFPOOL_CLASSES; c++) {
+		mutex_lock(&xdr_bufpool[c].lock);
+		stats->bp_class[c] = xdr_bufpool[c].stat;
+		mutex_unlock(&xdr_bufpool[c].lock);
+	}
+	stats->bp_bytes = xdr_bufpool_bytes;
+	stats->bp_max_bytes = xdr_bufpool_max_bytes;
+	stats->bp_free_bytes = xdr_bufpool_free_bytes;
+}
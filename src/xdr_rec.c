@@ -48,6 +48,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 
@@ -101,23 +102,40 @@ static const struct  xdr_ops xdrrec_ops = {
 
 #define LAST_FRAG ((u_int32_t)(1 << 31))
 
+#define	XDRREC_GATHER_MIN	1024	/* smaller putbytes are copied */
+#define	XDRREC_GATHER_MAX	(1 << 30)	/* referenced per fragment */
+#define	XDRREC_IOV_MAX		64	/* out_iov entries */
+#define	XDRREC_READAHEAD	(16 * 1024)	/* nonblocking read size */
+
 typedef struct rec_strm {
 	char *tcp_handle;
 	/*
 	 * out-goung bits
 	 */
 	int (*writeit)(void *, void *, int);
-	char *out_base;	/* output buffer (points to frag header) */
+	char *out_base;	/* output buffer (points to frag header);
+			 * nonblocking:  from the pool, or NULL */
 	char *out_finger;	/* next output position */
 	char *out_boundry;	/* data cannot up to this address */
 	u_int32_t *frag_header;	/* beginning of curren fragment */
 	bool_t frag_sent;	/* true if buffer sent in middle of record */
+	/*
+	 * gathered output (__xdrrec_setgather):  big putbytes are not
+	 * copied, but referenced from out_iov, between the segments of
+	 * the output buffer before and after them
+	 */
+	int (*writevit)(void *, struct iovec *, int);
+	bool_t gather;
+	struct iovec *out_iov;
+	int out_iovcnt;
+	char *out_seg;		/* buffered output not in out_iov yet */
+	u_int out_reflen;	/* bytes referenced in this fragment */
 	/*
 	 * in-coming bits
 	 */
 	int (*readit)(void *, void *, int);
 	u_long in_size;	/* fixed size of the input buffer */
-	char *in_base;
+	char *in_base;		/* nonblocking:  from the pool, or NULL */
 	char *in_finger;	/* location of next byte to be had */
 	char *in_boundry;	/* can read up to this location */
 	long fbtbc;		/* fragment bytes to be consumed */
@@ -133,11 +151,37 @@ typedef struct rec_strm {
 	int in_reclen;
 	int in_received;
 	int in_maxrec;
+	/*
+	 * read-ahead (nonblocking):  __xdrrec_getrec reads what the
+	 * socket has, XDRREC_READAHEAD bytes at most, into in_ra, and
+	 * takes headers and fragments from there.  Taken from the pool
+	 * while the connection is busy, given back when it runs dry.
+	 */
+	char *in_ra;
+	char *in_ra_finger;	/* next byte to be had */
+	char *in_ra_boundry;	/* end of what was read */
+	/*
+	 * bytes xdr_bytes_ref could not point at in the buffer (a
+	 * blocking stream's, which they do not fit whole):  copies,
+	 * kept until the next record
+	 */
+	struct rec_kept *in_kept;
 } RECSTREAM;
 
+struct rec_kept {
+	struct rec_kept *next;
+	u_int size;		/* with this header */
+};
+
 static u_int	fix_buf_size(u_int);
 static bool_t	flush_out(RECSTREAM *, bool_t);
+static bool_t	gather_out(RECSTREAM *, const char *, u_int);
 static bool_t	fill_input_buf(RECSTREAM *);
+static ssize_t	fill_input_ra(RECSTREAM *);
+static void	free_input_ra(RECSTREAM *);
+static void	free_output_buf(RECSTREAM *);
+static void	free_input_rec(RECSTREAM *);
+static void	free_input_kept(RECSTREAM *);
 static bool_t	get_input_bytes(RECSTREAM *, char *, int);
 static bool_t	set_input_fragment(RECSTREAM *);
 static bool_t	skip_input_bytes(RECSTREAM *, long);
@@ -197,11 +241,18 @@ xdrrec_create(xdrs, sendsize, recvsize, tcp_handle, readit, writeit)
 	rstrm->tcp_handle = tcp_handle;
 	rstrm->readit = readit;
 	rstrm->writeit = writeit;
+	rstrm->in_kept = NULL;
 	rstrm->out_finger = rstrm->out_boundry = rstrm->out_base;
 	rstrm->frag_header = (u_int32_t *)(void *)rstrm->out_base;
 	rstrm->out_finger += sizeof(u_int32_t);
 	rstrm->out_boundry += sendsize;
 	rstrm->frag_sent = FALSE;
+	rstrm->writevit = NULL;
+	rstrm->gather = FALSE;
+	rstrm->out_iov = NULL;
+	rstrm->out_iovcnt = 0;
+	rstrm->out_seg = rstrm->out_base;
+	rstrm->out_reflen = 0;
 	rstrm->in_size = recvsize;
 	rstrm->in_boundry = rstrm->in_base;
 	rstrm->in_finger = (rstrm->in_boundry += recvsize);
@@ -213,6 +264,7 @@ xdrrec_create(xdrs, sendsize, recvsize, tcp_handle, readit, writeit)
 	rstrm->nonblock = FALSE;
 	rstrm->in_reclen = 0;
 	rstrm->in_received = 0;
+	rstrm->in_ra = rstrm->in_ra_finger = rstrm->in_ra_boundry = NULL;
 }
 
 
@@ -306,6 +358,9 @@ xdrrec_putbytes(xdrs, addr, len)
 	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
 	size_t current;
 
+	if (rstrm->gather && (len >= XDRREC_GATHER_MIN) &&
+	    gather_out(rstrm, addr, len))
+		return (TRUE);
 	while (len > 0) {
 		current = (size_t)((u_long)rstrm->out_boundry -
 		    (u_long)rstrm->out_finger);
@@ -334,7 +389,7 @@ xdrrec_getpos(xdrs)
 
 	case XDR_ENCODE:
 		pos = rstrm->out_finger - rstrm->out_base
-			- BYTES_PER_XDR_UNIT;
+			- BYTES_PER_XDR_UNIT + rstrm->out_reflen;
 		break;
 
 	case XDR_DECODE:
@@ -364,7 +419,9 @@ xdrrec_setpos(xdrs, pos)
 
 		case XDR_ENCODE:
 			newpos = rstrm->out_finger - delta;
+			/* not back over referenced bytes */
 			if ((newpos > (char *)(void *)(rstrm->frag_header)) &&
+				(newpos >= rstrm->out_seg) &&
 				(newpos < rstrm->out_boundry)) {
 				rstrm->out_finger = newpos;
 				return (TRUE);
@@ -426,8 +483,18 @@ xdrrec_destroy(xdrs)
 {
 	RECSTREAM *rstrm = (RECSTREAM *)xdrs->x_private;
 
-	mem_free(rstrm->out_base, rstrm->sendsize);
-	mem_free(rstrm->in_base, rstrm->recvsize);
+	free_input_kept(rstrm);
+	if (rstrm->nonblock) {
+		free_output_buf(rstrm);
+		free_input_rec(rstrm);
+		free_input_ra(rstrm);
+	} else {
+		mem_free(rstrm->out_base, rstrm->sendsize);
+		mem_free(rstrm->in_base, rstrm->recvsize);
+	}
+	if (rstrm->out_iov != NULL)
+		mem_free(rstrm->out_iov,
+		    XDRREC_IOV_MAX * sizeof(struct iovec));
 	mem_free(rstrm, sizeof(RECSTREAM));
 }
 
@@ -447,6 +514,7 @@ xdrrec_skiprecord(xdrs)
 	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
 	enum xprt_stat xstat;
 
+	free_input_kept(rstrm);
 	if (rstrm->nonblock) {
 		if (__xdrrec_getrec(xdrs, &xstat, FALSE)) {
 			rstrm->fbtbc = 0;
@@ -499,6 +567,7 @@ xdrrec_eof(xdrs)
  * The second paraemters tells whether the record should be flushed to the
  * (output) tcp stream.  (This let's the package support batched or
  * pipelined procedure calls.)  TRUE => immmediate flush to tcp connection.
+ * A nonblocking stream always flushes, and gives its buffer back.
  */
 bool_t
 xdrrec_endofrecord(xdrs, sendnow)
@@ -507,8 +576,17 @@ xdrrec_endofrecord(xdrs, sendnow)
 {
 	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
 	u_long len;  /* fragment length */
+	bool_t ok;
 
-	if (sendnow || rstrm->frag_sent ||
+	if (rstrm->nonblock) {
+		if (rstrm->out_base == NULL)
+			return (FALSE);
+		rstrm->frag_sent = FALSE;
+		ok = flush_out(rstrm, TRUE);
+		free_output_buf(rstrm);
+		return (ok);
+	}
+	if (sendnow || rstrm->frag_sent || (rstrm->out_iovcnt > 0) ||
 		((u_long)rstrm->out_finger + sizeof(u_int32_t) >=
 		(u_long)rstrm->out_boundry)) {
 		rstrm->frag_sent = FALSE;
@@ -525,6 +603,15 @@ xdrrec_endofrecord(xdrs, sendnow)
 /*
  * Fill the stream buffer with a record for a non-blocking connection.
  * Return true if a record is available in the buffer, false if not.
+ * The buffer comes from the pool (xdr_bufpool.c) as the record's
+ * headers arrive;  the last record's goes back first.
+ *
+ * Reads go through the read-ahead, so that one read takes in all the
+ * small calls a client has pipelined;  the calls after the one
+ * returned stay there for the next time (see __xdrrec_buffered).
+ * Fragment bytes beyond what the read-ahead holds are read straight
+ * into the record when there are many of them.  Reads go on until a
+ * record is complete or the socket is drained (XPRT_IDLE).
  */
 bool_t
 __xdrrec_getrec(xdrs, statp, expectdata)
@@ -534,58 +621,82 @@ __xdrrec_getrec(xdrs, statp, expectdata)
 {
 	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
 	ssize_t n;
-	int fraglen;
+	int fraglen, want;
 
-	if (!rstrm->in_haveheader) {
-		n = rstrm->readit(rstrm->tcp_handle, rstrm->in_hdrp,
-		    (int)sizeof (rstrm->in_header) - rstrm->in_hdrlen);
+	/* the last record is done with */
+	if (!rstrm->in_haveheader && (rstrm->in_hdrlen == 0) &&
+	    (rstrm->in_received == 0)) {
+		free_input_rec(rstrm);
+		free_input_kept(rstrm);
+	}
+	for (;;) {
+		want = rstrm->in_haveheader ?
+		    rstrm->in_reclen - rstrm->in_received :
+		    (int)sizeof (rstrm->in_header) - rstrm->in_hdrlen;
+		n = rstrm->in_ra_boundry - rstrm->in_ra_finger;
 		if (n == 0) {
-			*statp = expectdata ? XPRT_DIED : XPRT_IDLE;
-			return FALSE;
-		}
-		if (n < 0) {
-			*statp = XPRT_DIED;
-			return FALSE;
-		}
-		rstrm->in_hdrp += n;
-		rstrm->in_hdrlen += n;
-		if (rstrm->in_hdrlen < sizeof (rstrm->in_header)) {
-			*statp = XPRT_MOREREQS;
-			return FALSE;
-		}
-		rstrm->in_header = ntohl(rstrm->in_header);
-		fraglen = (int)(rstrm->in_header & ~LAST_FRAG);
-		if (fraglen == 0 || fraglen > rstrm->in_maxrec ||
-		    (rstrm->in_reclen + fraglen) > rstrm->in_maxrec) {
-			*statp = XPRT_DIED;
-			return FALSE;
+			if (rstrm->in_haveheader &&
+			    (want >= XDRREC_READAHEAD)) {
+				/* big:  no need to go through in_ra */
+				n = rstrm->readit(rstrm->tcp_handle,
+				    rstrm->in_base + rstrm->in_received,
+				    want);
+				if (n > 0) {
+					rstrm->in_received += n;
+					goto fragment;
+				}
+			} else
+				n = fill_input_ra(rstrm);
+			if (n <= 0) {
+				free_input_ra(rstrm);
+				*statp = ((n < 0) || expectdata) ?
+				    XPRT_DIED : XPRT_IDLE;
+				return FALSE;
+			}
+			/* no data now is no error */
+			expectdata = FALSE;
 		}
-		rstrm->in_reclen += fraglen;
-		if (rstrm->in_reclen > rstrm->recvsize)
-			realloc_stream(rstrm, rstrm->in_reclen);
-		if (rstrm->in_header & LAST_FRAG) {
+		if (n > want)
+			n = want;
+
+		if (!rstrm->in_haveheader) {
+			memcpy(rstrm->in_hdrp, rstrm->in_ra_finger, n);
+			rstrm->in_ra_finger += n;
+			rstrm->in_hdrp += n;
+			rstrm->in_hdrlen += n;
+			if (rstrm->in_hdrlen < sizeof (rstrm->in_header))
+				continue;
+			rstrm->in_header = ntohl(rstrm->in_header);
+			fraglen = (int)(rstrm->in_header & ~LAST_FRAG);
+			if (fraglen == 0 || fraglen > rstrm->in_maxrec ||
+			    (rstrm->in_reclen + fraglen) > rstrm->in_maxrec) {
+				*statp = XPRT_DIED;
+				return FALSE;
+			}
+			rstrm->in_reclen += fraglen;
+			if ((rstrm->in_reclen > rstrm->recvsize) &&
+			    !realloc_stream(rstrm, rstrm->in_reclen)) {
+				__warnx("xdrrec_getrec: out of memory");
+				*statp = XPRT_DIED;
+				return FALSE;
+			}
+			/* a record of several fragments is not done with
+			 * the first */
+			rstrm->last_frag = (rstrm->in_header & LAST_FRAG) ?
+			    TRUE : FALSE;
 			rstrm->in_header &= ~LAST_FRAG;
-			rstrm->last_frag = TRUE;
+			rstrm->in_haveheader = TRUE;
+			continue;
 		}
-	}
 
-	n =  rstrm->readit(rstrm->tcp_handle,
-	    rstrm->in_base + rstrm->in_received,
-	    (rstrm->in_reclen - rstrm->in_received));
-
-	if (n < 0) {
-		*statp = XPRT_DIED;
-		return FALSE;
-	}
+		memcpy(rstrm->in_base + rstrm->in_received,
+		    rstrm->in_ra_finger, n);
+		rstrm->in_ra_finger += n;
+		rstrm->in_received += n;
 
-	if (n == 0) {
-		*statp = expectdata ? XPRT_DIED : XPRT_IDLE;
-		return FALSE;
-	}
-
-	rstrm->in_received += n;
-
-	if (rstrm->in_received == rstrm->in_reclen) {
+	fragment:
+		if (rstrm->in_received < rstrm->in_reclen)
+			continue;
 		rstrm->in_haveheader = FALSE;
 		rstrm->in_hdrp = (char *)(void *)&rstrm->in_header;
 		rstrm->in_hdrlen = 0;
@@ -598,11 +709,120 @@ __xdrrec_getrec(xdrs, statp, expectdata)
 			return TRUE;
 		}
 	}
+}
 
-	*statp = XPRT_MOREREQS;
+/*
+ * Is a whole record waiting in the read-ahead of a non-blocking
+ * connection, between records?  Nothing would poll it readable.
+ */
+bool_t
+__xdrrec_buffered(xdrs)
+	XDR *xdrs;
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+	char *p = rstrm->in_ra_finger;
+	u_int32_t header;
+	u_int fraglen;
+
+	if (rstrm->in_haveheader || (rstrm->in_hdrlen != 0) ||
+	    (rstrm->in_received != 0))
+		return FALSE;
+	while (rstrm->in_ra_boundry - p >= (int)sizeof (header)) {
+		memcpy(&header, p, sizeof (header));
+		header = ntohl(header);
+		fraglen = header & ~LAST_FRAG;
+		p += sizeof (header);
+		if ((u_int)(rstrm->in_ra_boundry - p) < fraglen)
+			return FALSE;
+		if (header & LAST_FRAG)
+			return TRUE;
+		p += fraglen;
+	}
 	return FALSE;
 }
 
+/*
+ * The record __xdrrec_getrec made available is done with:  give its
+ * buffer back to the pool, and the read-ahead if it holds nothing
+ * more, so that a connection between calls holds none.  Whatever was
+ * decoded from the record by reference goes with it.
+ */
+void
+__xdrrec_freerec(xdrs)
+	XDR *xdrs;
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+
+	if (!rstrm->nonblock)
+		return;
+	if (!rstrm->in_haveheader && (rstrm->in_hdrlen == 0) &&
+	    (rstrm->in_received == 0))
+		free_input_rec(rstrm);
+	if (rstrm->in_ra_finger == rstrm->in_ra_boundry)
+		free_input_ra(rstrm);
+}
+
+/*
+ * Decode len bytes of xdrs into a copy which the stream keeps until it
+ * moves to the next record (or is destroyed), for xdr_bytes_ref when
+ * they are not in the buffer whole.  NULL if xdrs is not a record
+ * stream, or the bytes cannot be had.
+ */
+char *
+__xdrrec_getbytes_kept(xdrs, len)
+	XDR *xdrs;
+	u_int len;
+{
+	RECSTREAM *rstrm;
+	struct rec_kept *k;
+	u_int size;
+
+	if (xdrs->x_ops != &xdrrec_ops)
+		return (NULL);
+	rstrm = (RECSTREAM *)(xdrs->x_private);
+	size = sizeof (struct rec_kept) + len;
+	if (size < len || (k = mem_alloc(size)) == NULL)
+		return (NULL);
+	if (!xdrrec_getbytes(xdrs, (char *)(void *)(k + 1), len)) {
+		mem_free(k, size);
+		return (NULL);
+	}
+	k->size = size;
+	k->next = rstrm->in_kept;
+	rstrm->in_kept = k;
+	return ((char *)(void *)(k + 1));
+}
+
+/*
+ * Hand the record __xdrrec_getrec has made available over to the
+ * caller with the buffer holding it:  *bufp is from __xdr_bufpool_get,
+ * of *sizep bytes, and the record is the *lenp bytes at its start.
+ * Whatever was decoded from the record by reference (xdr_bytes_ref)
+ * stays valid there.  The rest of the record is consumed.
+ */
+bool_t
+__xdrrec_takerec(xdrs, bufp, lenp, sizep)
+	XDR *xdrs;
+	char **bufp;
+	u_int *lenp;
+	u_int *sizep;
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+
+	/* only a whole record is in the buffer */
+	if (!rstrm->nonblock || (rstrm->in_base == NULL) ||
+	    rstrm->in_haveheader || (rstrm->in_hdrlen != 0) ||
+	    (rstrm->in_received != 0))
+		return FALSE;
+	*bufp = rstrm->in_base;
+	*lenp = (u_int)(rstrm->in_boundry - rstrm->in_base);
+	*sizep = rstrm->recvsize;
+	rstrm->in_base = rstrm->in_finger = rstrm->in_boundry = NULL;
+	rstrm->recvsize = rstrm->in_size = 0;
+	rstrm->fbtbc = 0;
+	return TRUE;
+}
+
 bool_t
 __xdrrec_setnonblock(xdrs, maxrec)
 	XDR *xdrs;
@@ -610,13 +830,85 @@ __xdrrec_setnonblock(xdrs, maxrec)
 {
 	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
 
-	rstrm->nonblock = TRUE;
 	if (maxrec == 0)
 		maxrec = rstrm->recvsize;
 	rstrm->in_maxrec = maxrec;
+	if (!rstrm->nonblock) {
+		/* records get buffers from the pool */
+		mem_free(rstrm->in_base, rstrm->recvsize);
+		rstrm->in_base = rstrm->in_finger = rstrm->in_boundry = NULL;
+		rstrm->recvsize = rstrm->in_size = 0;
+		/* and so do replies (__xdrrec_getout) */
+		mem_free(rstrm->out_base, rstrm->sendsize);
+		rstrm->out_base = NULL;
+		rstrm->nonblock = TRUE;
+	}
 	return TRUE;
 }
 
+/*
+ * Before encoding a record on a nonblocking stream:  take its output
+ * buffer from the pool, until xdrrec_endofrecord has flushed it.
+ * FALSE if out of memory.
+ */
+bool_t
+__xdrrec_getout(xdrs)
+	XDR *xdrs;
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+	u_int size;
+
+	if (rstrm->out_base != NULL)
+		return (TRUE);
+	if ((rstrm->out_base = __xdr_bufpool_get(rstrm->sendsize,
+	    &size)) == NULL) {
+		__warnx("xdrrec_getout: out of memory");
+		return (FALSE);
+	}
+	rstrm->frag_header = (u_int32_t *)(void *)rstrm->out_base;
+	rstrm->out_finger = rstrm->out_base + sizeof(u_int32_t);
+	rstrm->out_boundry = rstrm->out_base + rstrm->sendsize;
+	rstrm->out_seg = rstrm->out_base;
+	rstrm->out_iovcnt = 0;
+	rstrm->out_reflen = 0;
+	rstrm->frag_sent = FALSE;
+	return (TRUE);
+}
+
+/*
+ * Give an output stream a writev-like routine, for __xdrrec_setgather.
+ */
+void
+__xdrrec_setwritev(xdrs, writevit)
+	XDR *xdrs;
+	int (*writevit)(void *, struct iovec *, int);
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+
+	rstrm->writevit = writevit;
+}
+
+/*
+ * Until turned off again, have the bytes of big putbytes referenced,
+ * rather than copied, so that a record goes out with one writevit
+ * however big it is.  They must stay put until the record is flushed
+ * (xdrrec_endofrecord(xdrs, TRUE)), and nothing may be encoded which
+ * sets the position back over them, as RPCSEC_GSS integrity and privacy
+ * do.  Turn it on and off between records.
+ */
+bool_t
+__xdrrec_setgather(xdrs, on)
+	XDR *xdrs;
+	bool_t on;
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+
+	if (on && (rstrm->writevit == NULL))
+		return (FALSE);
+	rstrm->gather = on;
+	return (TRUE);
+}
+
 /*
  * Internal useful routines
  */
@@ -628,15 +920,66 @@ flush_out(rstrm, eor)
 	u_int32_t eormask = (eor == TRUE) ? LAST_FRAG : 0;
 	u_int32_t len = (u_int32_t)((u_long)(rstrm->out_finger) - 
 		(u_long)(rstrm->frag_header) - sizeof(u_int32_t));
-
-	*(rstrm->frag_header) = htonl(len | eormask);
-	len = (u_int32_t)((u_long)(rstrm->out_finger) - 
-	    (u_long)(rstrm->out_base));
-	if ((*(rstrm->writeit))(rstrm->tcp_handle, rstrm->out_base, (int)len)
-		!= (int)len)
-		return (FALSE);
+	struct iovec *iov;
+
+	*(rstrm->frag_header) = htonl((len + rstrm->out_reflen) | eormask);
+	if (rstrm->out_iovcnt > 0) {
+		/* and the buffered tail */
+		iov = &rstrm->out_iov[rstrm->out_iovcnt++];
+		iov->iov_base = rstrm->out_seg;
+		iov->iov_len = rstrm->out_finger - rstrm->out_seg;
+		len = (u_int32_t)((u_long)(rstrm->out_finger) -
+		    (u_long)(rstrm->out_base)) + rstrm->out_reflen;
+		if ((*(rstrm->writevit))(rstrm->tcp_handle, rstrm->out_iov,
+		    rstrm->out_iovcnt) != (int)len)
+			return (FALSE);
+	} else {
+		len = (u_int32_t)((u_long)(rstrm->out_finger) -
+		    (u_long)(rstrm->out_base));
+		if ((*(rstrm->writeit))(rstrm->tcp_handle, rstrm->out_base,
+		    (int)len) != (int)len)
+			return (FALSE);
+	}
 	rstrm->frag_header = (u_int32_t *)(void *)rstrm->out_base;
 	rstrm->out_finger = (char *)rstrm->out_base + sizeof(u_int32_t);
+	rstrm->out_seg = rstrm->out_base;
+	rstrm->out_iovcnt = 0;
+	rstrm->out_reflen = 0;
+	return (TRUE);
+}
+
+/*
+ * Reference len bytes at addr from the output, after what is buffered.
+ * FALSE if they are to be copied after all.
+ */
+static bool_t
+gather_out(rstrm, addr, len)
+	RECSTREAM *rstrm;
+	const char *addr;
+	u_int len;
+{
+	struct iovec *iov;
+
+	/* room for this, the segment before it, and the tail */
+	if ((rstrm->out_iovcnt + 3 > XDRREC_IOV_MAX) ||
+	    (rstrm->out_reflen + len > XDRREC_GATHER_MAX))
+		return (FALSE);
+	if (rstrm->out_iov == NULL) {
+		rstrm->out_iov = mem_alloc(XDRREC_IOV_MAX *
+		    sizeof(struct iovec));
+		if (rstrm->out_iov == NULL)
+			return (FALSE);
+	}
+	if (rstrm->out_finger > rstrm->out_seg) {
+		iov = &rstrm->out_iov[rstrm->out_iovcnt++];
+		iov->iov_base = rstrm->out_seg;
+		iov->iov_len = rstrm->out_finger - rstrm->out_seg;
+		rstrm->out_seg = rstrm->out_finger;
+	}
+	iov = &rstrm->out_iov[rstrm->out_iovcnt++];
+	iov->iov_base = (char *)addr;
+	iov->iov_len = len;
+	rstrm->out_reflen += len;
 	return (TRUE);
 }
 
@@ -663,6 +1006,89 @@ fill_input_buf(rstrm)
 	return (TRUE);
 }
 
+/*
+ * Read what there is into the (empty) read-ahead, allocating it if
+ * need be.  Returns as readit does, or -1 if out of memory.
+ */
+static ssize_t
+fill_input_ra(rstrm)
+	RECSTREAM *rstrm;
+{
+	ssize_t n;
+	u_int size;
+
+	if ((rstrm->in_ra == NULL) &&
+	    ((rstrm->in_ra = __xdr_bufpool_get(XDRREC_READAHEAD,
+	    &size)) == NULL)) {
+		__warnx("xdrrec_getrec: out of memory");
+		return (-1);
+	}
+	n = rstrm->readit(rstrm->tcp_handle, rstrm->in_ra, XDRREC_READAHEAD);
+	rstrm->in_ra_finger = rstrm->in_ra;
+	rstrm->in_ra_boundry = rstrm->in_ra + ((n > 0) ? n : 0);
+	return (n);
+}
+
+/*
+ * The socket is drained:  an idle connection holds no read-ahead.
+ */
+static void
+free_input_ra(rstrm)
+	RECSTREAM *rstrm;
+{
+	if (rstrm->in_ra == NULL)
+		return;
+	__xdr_bufpool_put(rstrm->in_ra, XDRREC_READAHEAD);
+	rstrm->in_ra = rstrm->in_ra_finger = rstrm->in_ra_boundry = NULL;
+}
+
+/*
+ * A nonblocking stream's record is out, and writeit or writevit done
+ * with the buffer:  it holds none until the next (__xdrrec_getout).
+ */
+static void
+free_output_buf(rstrm)
+	RECSTREAM *rstrm;
+{
+	if (rstrm->out_base == NULL)
+		return;
+	__xdr_bufpool_put(rstrm->out_base, rstrm->sendsize);
+	rstrm->out_base = rstrm->out_finger = rstrm->out_boundry = NULL;
+	rstrm->frag_header = NULL;
+	rstrm->out_seg = NULL;
+	rstrm->out_iovcnt = 0;
+	rstrm->out_reflen = 0;
+}
+
+/*
+ * Give the input buffer of a non-block stream back to the pool.
+ */
+static void
+free_input_rec(rstrm)
+	RECSTREAM *rstrm;
+{
+	if (rstrm->in_base == NULL)
+		return;
+	__xdr_bufpool_put(rstrm->in_base, rstrm->recvsize);
+	rstrm->in_base = rstrm->in_finger = rstrm->in_boundry = NULL;
+	rstrm->recvsize = rstrm->in_size = 0;
+}
+
+/*
+ * Free the copies __xdrrec_getbytes_kept made for the last record.
+ */
+static void
+free_input_kept(rstrm)
+	RECSTREAM *rstrm;
+{
+	struct rec_kept *k;
+
+	while ((k = rstrm->in_kept) != NULL) {
+		rstrm->in_kept = k->next;
+		mem_free(k, k->size);
+	}
+}
+
 static bool_t  /* knows nothing about records!  Only about input buffers */
 get_input_bytes(rstrm, addr, len)
 	RECSTREAM *rstrm;
@@ -755,26 +1181,30 @@ fix_buf_size(s)
 }
 
 /*
- * Reallocate the input buffer for a non-block stream.
+ * Make room for size bytes of record in the input buffer of a
+ * non-block stream:  a bigger buffer from the pool, with what has
+ * been received so far.
  */
 static bool_t
 realloc_stream(rstrm, size)
 	RECSTREAM *rstrm;
 	int size;
 {
-	ptrdiff_t diff;
 	char *buf;
+	u_int bufsize;
 
 	if (size > rstrm->recvsize) {
-		buf = realloc(rstrm->in_base, (size_t)size);
+		buf = __xdr_bufpool_get((u_int)size, &bufsize);
 		if (buf == NULL)
 			return FALSE;
-		diff = buf - rstrm->in_base;
-		rstrm->in_finger += diff;
-		rstrm->in_base = buf;
-		rstrm->in_boundry = buf + size;
-		rstrm->recvsize = size;
-		rstrm->in_size = size;
+		if (rstrm->in_base != NULL) {
+			memcpy(buf, rstrm->in_base,
+			    (size_t)rstrm->in_received);
+			__xdr_bufpool_put(rstrm->in_base, rstrm->recvsize);
+		}
+		rstrm->in_base = rstrm->in_finger = rstrm->in_boundry = buf;
+		rstrm->recvsize = bufsize;
+		rstrm->in_size = bufsize;
 	}
 
 	return TRUE;
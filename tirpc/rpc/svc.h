@@ -70,6 +70,16 @@
 #define SVC_INIT_XPORTS         0x0001
 #define SVC_INIT_EPOLL          0x0002
 #define SVC_INIT_WARNX          0x0004
+#define SVC_INIT_THREADS        0x0008
+#define SVC_INIT_SHARDS         0x0010
+#define SVC_INIT_EPOLLET        0x0020 /* nonblocking conns edge-triggered */
+#define SVC_INIT_IDLE           0x0040 /* idle_timeout is set */
+#define SVC_INIT_WORKERS        0x0080 /* pipeline conns to nworkers */
+#define SVC_INIT_THROTTLE       0x0100 /* max_inflight, max_xprt_inflight */
+#define SVC_INIT_ACCEPT         0x0200 /* accept_batch is set */
+#define SVC_INIT_URING          0x0400 /* with EPOLL, events and
+                                        * connection I/O through io_uring
+                                        * if the kernel can */
 
 /*
  *      Service control requests
@@ -82,6 +92,11 @@
 #define SVCSET_XP_RECV		6
 #define SVCGET_XP_FLAGS		7
 #define SVCSET_XP_FLAGS		8
+#define SVCGET_XID		9	/* xid of the request at hand */
+#define SVCSEND_DETACHED	10	/* internal, see svc_req_detach */
+#define SVCTAKE_RECORD		11	/* internal, see svc_pool.c */
+#define SVCTAKE_RECBUF		12	/* internal, see svc_req_detach */
+#define SVCDONE_RECORD		13	/* internal, see svc_getreq_xprt */
 
 /*
  * Operations for rpc_control().
@@ -92,6 +107,10 @@
 #define RPC_SVC_XPRTS_SET       3
 #define RPC_SVC_FDSET_GET       4
 #define RPC_SVC_FDSET_SET       5
+#define RPC_SVC_INFLIGHT_GET    6	/* u_int, requests being served */
+#define RPC_SVC_THROTTLED_GET   7	/* u_long, transports throttled, ever */
+#define RPC_SVC_SCHED_STATS_GET 8	/* struct svc_sched_stat[], svc_sched_class */
+#define RPC_SVC_BUFPOOL_STATS_GET 9	/* struct svc_bufpool_stats */
 
 /*
  * Flags for svc_fd_create2
@@ -108,16 +127,29 @@
 /* Svc event strategy */
 enum svc_event_type {
     SVC_EVENT_FDSET /* trad. using select and poll */,
-    SVC_EVENT_EPOLL /* Linux epoll interface */ 
+    SVC_EVENT_EPOLL /* Linux epoll interface */,
+    SVC_EVENT_URING /* the epoll engine, on io_uring */
 };
 
 typedef struct svc_init_params
 {
     u_int version;
     u_long flags;
-    u_int max_connections; /* xprts */
+    u_int max_connections; /* xprts;  advisory, the table grows */
     u_int max_events;      /* epoll events */
     warnx_t warnx;
+    u_int nthreads;        /* epoll event threads (SVC_INIT_THREADS) */
+    u_int nshards;         /* epoll sets, 0 => one per cpu (SVC_INIT_SHARDS) */
+    u_int idle_timeout;    /* seconds, 0 => never reap (SVC_INIT_IDLE) */
+    u_int nworkers;        /* dispatch threads for pipelined nonblocking
+                            * conns, with epoll (SVC_INIT_WORKERS) */
+    u_int max_inflight;    /* requests being served, 0 => no limit;  a
+                            * transport which would exceed it is not read
+                            * until some finish (epoll, SVC_INIT_THROTTLE) */
+    u_int max_xprt_inflight; /* the same, per transport */
+    u_int accept_batch;    /* connections accepted per listener wakeup,
+                            * > 1 makes listeners nonblocking
+                            * (SVC_INIT_ACCEPT) */
 } svc_init_params;
 
 /* this won't work yet.  threading fdsets around is annoying */
@@ -129,6 +161,10 @@ typedef struct svc_params
             int epoll_fd;
             struct epoll_event *events;
             u_int max_events;      /* epoll events */
+            u_int nthreads;        /* event threads per epoll set */
+            u_int nshards;         /* epoll sets */
+            struct svc_epoll_shard *shards; /* shards[0].epoll_fd == epoll_fd */
+            bool_t edge;           /* SVC_INIT_EPOLLET */
         } epoll;
         struct {
             fd_set set; /* XXX future svc_fdset */
@@ -145,6 +181,12 @@ typedef struct svc_params
         void (*svc_exit)(void);
     } *svc_ops;
 
+    u_int idle_timeout;    /* seconds, reaped by svc_run */
+    u_int nworkers;        /* svc_pool.c */
+    u_int max_inflight;    /* admission control, 0 => no limit */
+    u_int max_xprt_inflight;
+    u_int accept_batch;    /* rendezvous_request */
+
 } svc_params;
 
 /*
@@ -154,6 +196,37 @@ typedef struct svc_params
 #define SVC_XPORT_FLAG_NONE       0x0000
 #define SVC_XPORT_FLAG_SETNEWFDS  0x0001
 #define SVC_XPORT_FLAG_DONTCLOSE  0x0002
+#define SVC_XPORT_FLAG_GATHER     0x0004 /* connection-oriented:  see below */
+
+/*
+ * The library's own state of a transport, changed atomically by its
+ * threads:  not for applications.  SVCSET_XP_FLAGS leaves these bits
+ * as they are.
+ */
+#define SVC_XPORT_FLAG_INTERNAL   0xffff0000
+#define SVC_XPORT_FLAG_DESTROYED  0x00010000 /* awaiting last unref */
+#define SVC_XPORT_FLAG_EDGE       0x00020000 /* EPOLLET, drain reads */
+#define SVC_XPORT_FLAG_PIPELINE   0x00040000 /* calls to svc_pool.c */
+#define SVC_XPORT_FLAG_THROTTLED  0x00080000 /* not read, see
+					      * __svc_inflight_put */
+#define SVC_XPORT_FLAG_OUTQ       0x00100000 /* replies queued, poll for
+					      * output (svc_vc.c) */
+#define SVC_XPORT_FLAG_OUTFULL    0x00200000 /* too many, stop reading
+					      * requests meanwhile */
+#define SVC_XPORT_FLAG_URING      0x00400000 /* I/O through io_uring
+					      * (svc_uring.c) */
+#define SVC_XPORT_FLAG_RECPOOL    0x00800000 /* records in pool buffers,
+					      * see SVCDONE_RECORD */
+
+/*
+ * With SVC_XPORT_FLAG_GATHER, opaque data of 1k or more in the results
+ * of a reply (xdr_opaque, xdr_bytes, ...) is not copied into the send
+ * buffer, but written from where it lies, with the rest of the record,
+ * by one writev.  It must stay put until the reply is sent:  the XDR
+ * routines may not encode it from storage of their own which they
+ * release first.  Not done for RPCSEC_GSS.  Set on a listener, the flag
+ * goes to the connections it accepts from then on.
+ */
 
 enum xprt_stat {
 	XPRT_DIED,
@@ -165,6 +238,9 @@ struct cf_rendezvous { /* kept in xprt->xp_p1 for rendezvouser */
 	u_int sendsize;
 	u_int recvsize;
 	int maxrec;
+	struct __rpc_svcxprt *sibling; /* SO_REUSEPORT clone, next shard */
+	struct __rpc_sockinfo si;      /* of the listener, and so its conns */
+	bool_t nonblock;               /* listener, for batched accept */
 };
 
 struct cf_conn {  /* kept in xprt->xp_p1 for actual connection */
@@ -225,6 +301,13 @@ typedef struct __rpc_svcxprt {
 	int		xp_type;	 /* transport type */
 	u_int		xp_flags;	 /* flags */
 	rwlock_t lock;                   /* xprt lock */
+	u_int		xp_refcnt;	 /* references (1 until destroyed) */
+	u_int		xp_inflight;	 /* requests being served */
+	/* teardown, run with the last reference;  NULL if not counted */
+	void		(*xp_dtor)(struct __rpc_svcxprt *);
+#if defined(TIRPC_EPOLL)
+	int		xp_epoll_fd;	 /* epoll set (shard) of xprt */
+#endif
 } SVCXPRT;
 
 /* functions which can be installed using a control function, e.g., 
@@ -321,6 +404,44 @@ extern bool_t	svc_reg(SVCXPRT *, const rpcprog_t, const rpcvers_t,
 			const struct netconfig *);
 __END_DECLS
 
+/*
+ * Per-procedure service registration
+ *
+ * svc_reg_procs(xprt, prog, vers, procs, nprocs, nconf)
+ *	const SVCXPRT *xprt;
+ *	const rpcprog_t prog;
+ *	const rpcvers_t vers;
+ *	const struct svc_proc *procs;
+ *	const u_int nprocs;
+ *	const struct netconfig *nconf;
+ *
+ * Like svc_reg, but instead of a dispatch routine, a table of
+ * procedures indexed by procedure number.  For each call the library
+ * decodes the arguments (sp_xargs) into sp_argsize bytes of zeroed
+ * storage, calls sp_handler with them and sp_ressize bytes of zeroed
+ * result storage, sends the results (sp_xres) if the handler returns
+ * TRUE, and then frees arguments and results.  A handler which returns
+ * FALSE has replied itself (e.g., with svcerr_*), or does not reply.
+ * Calls to procedures beyond nprocs or without a handler get PROC_UNAVAIL,
+ * except NULLPROC, which is answered with an empty reply.  procs must
+ * remain valid until the service is unregistered.  An empty table
+ * (procs NULL or nprocs 0), like a NULL dispatch routine for svc_reg,
+ * is refused.
+ */
+struct svc_proc {
+	xdrproc_t	sp_xargs;	/* decode arguments, NULL => void */
+	u_int		sp_argsize;	/* sizeof arguments */
+	xdrproc_t	sp_xres;	/* encode results, NULL => void */
+	u_int		sp_ressize;	/* sizeof results */
+	bool_t		(*sp_handler)(void *, void *, struct svc_req *);
+};
+
+__BEGIN_DECLS
+extern bool_t	svc_reg_procs(SVCXPRT *, const rpcprog_t, const rpcvers_t,
+			const struct svc_proc *, const u_int,
+			const struct netconfig *);
+__END_DECLS
+
 /*
  * Service un-registration
  *
@@ -417,6 +538,201 @@ extern int	rpc_reg(rpcprog_t, rpcvers_t, rpcproc_t,
 			char *);
 __END_DECLS
 
+/*
+ * Detached (asynchronous) replies
+ *
+ * A service routine which cannot answer before it returns, e.g.
+ * because the answer comes from a slow backend, may detach the
+ * request once it has decoded the arguments:
+ *
+ *	struct svc_req *dreq = svc_req_detach(rqstp);
+ *
+ * and return without replying.  dreq is a heap copy of rqstp which
+ * owns its credentials and a snapshot of the xid, verifier and
+ * client address, and holds the transport.  Later, from any thread,
+ * exactly one of svc_sendreply_detached, svcerr_detached or
+ * svc_req_release completes it and frees dreq.  Replies are written
+ * to the transport one record at a time, so detached replies may be
+ * sent while the transport serves later requests.
+ *
+ * Arguments decoded by reference (xdr_bytes_ref) point into the
+ * call's record.  On nonblocking connections, and under the worker
+ * pool, dreq keeps the record until it is completed;  elsewhere they
+ * must be copied before the routine returns.
+ *
+ * svc_req_detach returns NULL, and the routine must reply as usual,
+ * if the transport or credential flavor (RPCSEC_GSS, AUTH_DES) does
+ * not support it.
+ */
+__BEGIN_DECLS
+extern struct svc_req *svc_req_detach(struct svc_req *);
+extern bool_t	svc_sendreply_detached(struct svc_req *, xdrproc_t, void *);
+extern bool_t	svcerr_detached(struct svc_req *, enum accept_stat);
+extern void	svc_req_release(struct svc_req *);
+__END_DECLS
+
+/*
+ * Request scheduling
+ *
+ * svc_sched_class(prog, vers, proc, cls)
+ *	const rpcprog_t prog;
+ *	const rpcvers_t vers;
+ *	const rpcproc_t proc;
+ *	const u_int cls;
+ *
+ * Calls waiting for the worker pool (SVC_INIT_WORKERS) are started
+ * class by class, lowest first.  Within a class, the clients (by
+ * address) with calls waiting take turns, each getting an even share
+ * of the record bytes (deficit round robin).  Calls are of class
+ * SVC_SCHED_DEFAULT unless set here, except NULLPROC calls, which are
+ * SVC_SCHED_URGENT.  So short, latency sensitive calls (pings, lock and
+ * lease renewals) can overtake a backlog of bulk transfers.
+ *
+ * rpc_control(RPC_SVC_SCHED_STATS_GET, stats) fills in
+ * struct svc_sched_stat stats[SVC_SCHED_CLASSES].
+ */
+#define SVC_SCHED_CLASSES	4
+#define SVC_SCHED_URGENT	0
+#define SVC_SCHED_DEFAULT	1
+#define SVC_SCHED_BULK		3
+
+struct svc_sched_stat {
+	u_int	ss_queued;		/* calls waiting */
+	u_int	ss_max_queued;
+	u_long	ss_dispatched;		/* calls started */
+	u_long	ss_wait_usec;		/* their total time waiting */
+	u_long	ss_max_wait_usec;
+};
+
+__BEGIN_DECLS
+extern bool_t	svc_sched_class(const rpcprog_t, const rpcvers_t,
+			const rpcproc_t, const u_int);
+__END_DECLS
+
+/*
+ * Request tracing
+ *
+ * svc_trace_enable(on, cb, arg)
+ *	bool_t on;
+ *	svc_trace_cb_t cb;
+ *	void *arg;
+ *
+ * While on, each call served is timestamped (CLOCK_MONOTONIC, in ns)
+ * as it enters each phase below;  st_ns[phase] is 0 for a phase it
+ * did not go through, e.g. the reply phases of a detached request.
+ * When the dispatch routine returns, the record goes to cb(rec, arg)
+ * if cb is not NULL, on the serving thread, and into that thread's
+ * ring of recent records, which svc_trace_drain(recs, max) empties
+ * into recs, returning how many it copied;  a thread's ring goes
+ * when the thread exits.  Off, tracing costs a test per phase.
+ * Encoding and sending overlap for replies bigger than the
+ * transport's send buffer.
+ */
+#define SVC_TRACE_RECV		0	/* receiving a call */
+#define SVC_TRACE_AUTH		1	/* received, authenticating */
+#define SVC_TRACE_DISPATCH	2	/* in the dispatch routine */
+#define SVC_TRACE_GETARGS	3	/* decoding arguments */
+#define SVC_TRACE_EXEC		4	/* arguments decoded */
+#define SVC_TRACE_ENCODE	5	/* encoding the reply */
+#define SVC_TRACE_SEND		6	/* sending it */
+#define SVC_TRACE_SENT		7	/* reply sent */
+#define SVC_TRACE_DONE		8	/* dispatch routine returned */
+#define SVC_TRACE_PHASES	9
+
+struct svc_trace {
+	u_int32_t	st_xid;
+	rpcprog_t	st_prog;
+	rpcvers_t	st_vers;
+	rpcproc_t	st_proc;
+	int		st_fd;		/* of the transport */
+	u_int64_t	st_ns[SVC_TRACE_PHASES];
+};
+
+typedef void (*svc_trace_cb_t)(const struct svc_trace *, void *);
+
+__BEGIN_DECLS
+extern void	svc_trace_enable(bool_t, svc_trace_cb_t, void *);
+extern u_int	svc_trace_drain(struct svc_trace *, u_int);
+__END_DECLS
+
+/*
+ * Call statistics
+ *
+ * svc_stats_enable(on)
+ *	bool_t on;
+ *
+ * While on, calls to each registered (prog, vers) are counted per
+ * procedure:  calls, authentication failures, GARBAGE_ARGS replies
+ * (svcerr_decode, from the thread running the dispatch routine), and
+ * the time from authentication to the dispatch routine's return, in
+ * log2-spaced buckets.  The counters are kept per CPU, updated without
+ * locks, and never reset.
+ *
+ * svc_stats_snapshot(stats, max) sums them into up to max records,
+ * one for each procedure called so far, and returns how many there
+ * are;  svc_stats_walk(cb, arg) hands each to cb(stat, arg) instead.
+ * A service with a dispatch routine of its own has its first
+ * SVC_STATS_PROCS procedures counted apart, and the rest together as
+ * SVC_STATS_OTHER;  one registered with svc_reg_procs, all of them.
+ */
+#define SVC_STATS_BUCKETS	20	/* ss_lat[i]: under 2^i us, but the last */
+#define SVC_STATS_PROCS		32
+#define SVC_STATS_OTHER		((rpcproc_t)-1)
+
+struct svc_stat {
+	rpcprog_t	ss_prog;
+	rpcvers_t	ss_vers;
+	rpcproc_t	ss_proc;
+	u_long		ss_calls;
+	u_long		ss_auth_errs;
+	u_long		ss_decode_errs;
+	u_long		ss_lat[SVC_STATS_BUCKETS];
+};
+
+typedef void (*svc_stats_cb_t)(const struct svc_stat *, void *);
+
+__BEGIN_DECLS
+extern void	svc_stats_enable(bool_t);
+extern u_int	svc_stats_snapshot(struct svc_stat *, u_int);
+extern void	svc_stats_walk(svc_stats_cb_t, void *);
+__END_DECLS
+
+/*
+ * Record buffers
+ *
+ * Nonblocking connections (RPC_SVC_CONNMAXREC_SET) hold no buffers
+ * between calls.  Each record is read into a buffer from a pool
+ * shared by all of them, of the smallest power of two size from 4 KB
+ * up that fits it, and the buffer goes back when the call is done;
+ * a few of each size are kept for reuse.  So a connection which once
+ * sent a big call does not keep a buffer that big.  Replies are
+ * encoded into a buffer of the send size from the same pool, which
+ * goes back once the reply is written or queued.  Blocking
+ * connections keep buffers of their own.
+ *
+ * rpc_control(RPC_SVC_BUFPOOL_STATS_GET, stats) fills in a
+ * struct svc_bufpool_stats.  bp_class[i] counts the buffers of
+ * 4 KB << i, but the last, which counts those bigger than any class;
+ * they are allocated to size and never kept.
+ */
+#define SVC_BUFPOOL_CLASSES	16
+
+struct svc_bufpool_class {
+	u_int	bc_size;		/* of its buffers, 0 for the last */
+	u_int	bc_inuse;		/* buffers out */
+	u_int	bc_max_inuse;
+	u_int	bc_free;		/* buffers kept */
+	u_long	bc_gets;
+	u_long	bc_allocs;		/* gets that had to allocate */
+};
+
+struct svc_bufpool_stats {
+	u_long	bp_bytes;		/* in buffers out */
+	u_long	bp_max_bytes;
+	u_long	bp_free_bytes;		/* in buffers kept */
+	struct svc_bufpool_class bp_class[SVC_BUFPOOL_CLASSES];
+};
+
 /*
  * Lowest level dispatching -OR- who owns this process anyway.
  * Somebody has to wait for incoming requests and then call the correct
@@ -457,6 +773,7 @@ extern void	svc_getreq_poll(struct pollfd *, int);
 
 extern void	svc_run(void);
 extern void	svc_exit(void);
+extern void	svc_wakeup(void);
 __END_DECLS
 
 /*
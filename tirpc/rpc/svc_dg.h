@@ -48,6 +48,7 @@ struct svc_dg_data {
 
 	struct msghdr	su_msghdr;		/* msghdr received from clnt */
 	unsigned char	su_cmsg[64];		/* cmsghdr received from clnt */
+	SVCXPRT		*su_sibling;		/* SO_REUSEPORT clone, next shard */
 };
 
 #define __rpcb_get_dg_xidp(x)	(&((struct svc_dg_data *)(x)->xp_p2)->su_xid)
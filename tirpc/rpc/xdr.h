@@ -308,6 +308,9 @@ extern bool_t	xdr_bool(XDR *, bool_t *);
 extern bool_t	xdr_enum(XDR *, enum_t *);
 extern bool_t	xdr_array(XDR *, char **, u_int *, u_int, u_int, xdrproc_t);
 extern bool_t	xdr_bytes(XDR *, char **, u_int *, u_int);
+/* decodes pointing into the stream, until its next record:  memory
+ * and record streams, or streams whose x_inline has the bytes */
+extern bool_t	xdr_bytes_ref(XDR *, char **, u_int *, u_int);
 extern bool_t	xdr_opaque(XDR *, char *, u_int);
 extern bool_t	xdr_string(XDR *, char **, u_int);
 extern bool_t	xdr_union(XDR *, enum_t *, char *, const struct xdr_discrim *, xdrproc_t);